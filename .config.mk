@@ -0,0 +1,2 @@
+CC = gcc
+PREFIX = /tmp
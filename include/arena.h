@@ -0,0 +1,78 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+//allocations up to this size come from free lists of 16 byte classes
+#define ARENA_SMALL 4096
+
+//address space set aside up front so the file can grow in place
+#define ARENA_RESERVE (1UL << 40)
+
+//bytes the file grows by at a time
+#define ARENA_GROW (64UL * 1024 * 1024)
+
+//a freed block bigger than ARENA_SMALL
+struct arena_block {
+	size_t				size; //bytes in the block
+	struct arena_block	*next;
+};
+
+//memory backed by an unlinked file instead of swap, with only a bounded
+//part of it kept resident, addresses stay valid until the arena is freed
+struct arena {
+	int					fd; //unlinked file the memory is written back to
+	char				*base; //start of the reserved address range
+	size_t				mapped; //bytes of the file mapped so far
+	size_t				used; //bytes handed out from the end of the mapping
+	void				*free_lists[ARENA_SMALL / 16]; //freed small blocks by size class
+	struct arena_block	*large; //freed large blocks
+	size_t				budget; //bytes of the file allowed to stay resident
+	size_t				ops; //accesses since residency was last checked
+	size_t				interval; //accesses between checks
+	size_t				clock; //where the next page out starts
+	size_t				scan; //where the next residency check starts
+	size_t				resident; //bytes of the file seen resident, summed over the chunks
+	unsigned short		*counts; //pages of each 1M chunk seen resident when it was last checked
+	unsigned char		*vec; //residency of the pages of a window being checked
+};
+
+/*
+ * Initialize an arena backed by an unlinked file in dir on the heap,
+ * keeping about budget bytes of it resident
+ * Returns the arena
+ * Otherwise returns 0
+ */
+struct arena *init_arena(char *dir, size_t budget);
+
+/*
+ * Free an arena and everything allocated from it, removing its file
+ */
+void free_arena(struct arena *arena);
+
+/*
+ * Allocate size bytes from an arena
+ * Returns the memory, zeroed
+ * Otherwise returns 0
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/*
+ * Give size bytes allocated from an arena back to it
+ */
+void arena_free(struct arena *arena, void *ptr, size_t size);
+
+/*
+ * Copy a string into an arena
+ * Returns the copy
+ * Otherwise returns 0
+ */
+char *arena_strdup(struct arena *arena, char *str);
+
+/*
+ * Count an access to the arena, every so often pages are written back
+ * and dropped, in turn, until the resident part is within the budget
+ */
+void arena_touch(struct arena *arena);
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef AUDIT_H
+#define AUDIT_H
+
+#include <pthread.h>
+
+#include "utils.h"
+
+//regular files compared between saves of the audit's place
+#define AUDIT_BATCH 64
+
+//bytes of each file read at a time when comparing content
+#define AUDIT_CHUNK (1024 * 1024)
+
+//what a destination needs to match its source again
+enum drift_kind {
+	DRIFT_COPY, //missing, or with a different size, mtime or content
+	DRIFT_META, //only the mode or owner differs
+	DRIFT_DELETE, //not in the source
+};
+
+//a path found to differ between a source and its destination
+struct drift {
+	int				root; //index of the source and destination
+	char			*path; //path relative to both roots
+	enum drift_kind	kind;
+	struct drift	*next;
+};
+
+//a source and a destination that should hold the same files
+struct audit_root {
+	char			*src, *dest;
+	int				pair, target; //indices of the pair and its target the root was added for
+};
+
+//compares destinations with their sources in the background while
+//nothing else is being synced, remembering how far it got so a pass
+//over a large tree can be spread over many idle periods (and restarts
+//when there is a progress file)
+struct audit {
+	struct audit_root	*roots; //trees compared in order
+	int					root_count;
+	char				*progress_path; //file the place in the pass is saved to (may be null)
+	long				interval; //seconds from the end of one pass to the start of the next
+	long				next; //when the next pass starts in seconds since the epoch
+	int					root; //root being compared
+	char				cursor[4096]; //last path compared in the root ("" at its start)
+	int					follow; //whether symbolic links in the sources are compared as what they point to
+	struct walk			dirs; //source directories the walker is in, so a link back up to one is skipped
+	long long			saved; //when the place was last saved in nanoseconds
+	pthread_t			walker; //thread walking the trees
+	int					started; //whether the threads were created
+	pthread_t			*threads; //threads comparing file content
+	int					count; //number of content threads
+	pthread_mutex_t		lock; //protects everything below
+	pthread_cond_t		ready; //signalled when a batch is handed out, the audit goes idle or stops
+	pthread_cond_t		done; //signalled when a file of the batch is compared
+	int					idle; //set while nothing else is being synced
+	int					stop; //set when the threads should exit
+	char				*batch[AUDIT_BATCH]; //files of the root to compare, relative to it
+	int					differs[AUDIT_BATCH]; //whether each file's content differs
+	int					batch_fill; //files the walker has put in the batch, it is handed out when full
+	int					batch_count, batch_next, batch_left; //files in the batch, handed out and not finished
+	struct drift		*head, *tail; //drift found but not repaired yet
+	unsigned long		checked, drifted; //files compared and found to differ in this pass
+};
+
+/*
+ * Initialize an audit that runs every so many hours on the heap, with
+ * its place read from progress_path if it is set and the file exists
+ * Returns the audit
+ * Otherwise returns 0
+ */
+struct audit *init_audit(double hours, char *progress_path, int threads);
+
+/*
+ * Stop an audit's threads, save its place and free it from the heap
+ */
+void free_audit(struct audit *audit);
+
+/*
+ * Add a source and destination to compare, before the audit is started,
+ * remembering the pair and target they belong to for repairs
+ * Returns the index of the root
+ * Otherwise returns -1
+ */
+int add_audit_root(struct audit *audit, char *src, char *dest, int pair, int target);
+
+/*
+ * Start the threads of an audit, which only do anything while it is idle
+ * Returns 0 if the threads were started
+ * Otherwise returns -1
+ */
+int start_audit(struct audit *audit);
+
+/*
+ * Let an audit run (idle) or pause it until nothing else is being synced
+ */
+void set_idle(struct audit *audit, int idle);
+
+/*
+ * Take the drift an audit found since the last call
+ * Returns the drift, which the caller frees with free_drift
+ * Otherwise returns 0 if there was none
+ */
+struct drift *take_drift(struct audit *audit);
+
+/*
+ * Free drift taken from an audit
+ */
+void free_drift(struct drift *drift);
+
+#endif
@@ -2,17 +2,38 @@
 #define CACHE_H
 
 #include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct list;
+struct arena;
 
 enum filetype {
 	FILE_TYPE_FILE,
 	FILE_TYPE_DIR,
+	FILE_TYPE_LINK, //symbolic link, synced as a link rather than what it points to
 };
 
 //indexes a file for determining changes
 struct filenode {
 	char			*filename; //file's path name
-	long 			last_modify_time, size; //metadata
-	enum filetype	type; //file or directory
+	long long		last_modify_time; //mtime in nanoseconds, so two saves in the same second differ
+	long 			size; //metadata
+	long			change_time; //last inode change, catches chmod and chown
+	mode_t			mode; //type and permissions
+	ino_t			ino; //inode, changes when a file is replaced by a rename
+	dev_t			dev; //device, with the inode tells a directory reached through a link apart
+	int				from_index; //set while the stat data is the git index's, which only keeps part of it
+	enum filetype	type; //file, directory or link
+	long long		detected; //when the last change was found in nanoseconds
+	long			synced_size; //bytes the destination holds after the last copy (0 if unknown)
+	unsigned long	synced_tail; //fingerprint of the source's last block at synced_size
+	unsigned long	synced_hash; //fingerprint of the first synced_size bytes (0 if unknown)
+	unsigned long	generation; //last scan that visited the file
+	long long		dir_mtime; //directory mtime in nanoseconds when its entries were listed
+	struct list		*children; //names of a directory's entries (0 until listed)
+	long long		next_scan; //when a directory is due to be checked again
+	long long		interval; //time between checks of a directory, grows while it's unchanged
 	struct filenode *next; //used to resolve hashing collisions
 };
 
@@ -20,13 +41,20 @@ struct filenode {
 struct cache {
 	size_t 			capacity; //size of underlying hash table
 	struct filenode **values;  //values stored in hash table		
+	struct arena	*arena; //where the table, nodes and names live (0 for the heap)
+	size_t			count; //entries in an arena's table, which doubles when it fills
 };
 
 /*
- * Create a filenode for a given file
+ * Create a filenode for a given file, a symbolic link is not followed
  */
 struct filenode *init_filenode(char *filename);
 
+/*
+ * Create a filenode for a given file from stat info that is already known
+ */
+struct filenode *stat_filenode(char *filename, struct stat *st_info);
+
 /*
  * Free a filenode from the heap
  */
@@ -37,6 +65,12 @@ void free_node(struct filenode *node);
  */
 struct cache *init_cache(size_t initial_capacity);
 
+/*
+ * Initialize a cache with a given capacity on the heap, keeping its
+ * table, filenodes, names and directory entries in an arena
+ */
+struct cache *init_arena_cache(size_t initial_capacity, struct arena *arena);
+
 /*
  * Reclaim the memory stored by a cache
  */
@@ -54,6 +88,34 @@ size_t hash(struct cache *cache, char *filename);
  */
 int insert(struct cache *cache, char *filename);
 
+/*
+ * Insert a file into the cache using stat info that is already known
+ * Returns 0 if the file was inserted
+ * Otherwise returns -1
+ */
+int insert_stat(struct cache *cache, char *filename, struct stat *st_info);
+
+/*
+ * Insert a filenode into the cache, the cache takes ownership of it
+ * (an existing entry for the same file has its metadata updated instead)
+ * Returns 0 if the node was inserted
+ * Otherwise returns -1
+ */
+int insert_node(struct cache *cache, struct filenode *filenode);
+
+/*
+ * Replace the entries remembered for a directory, the cache takes
+ * ownership of the list
+ * Returns 0 if the entries were stored
+ * Otherwise returns -1
+ */
+int set_children(struct cache *cache, struct filenode *node, struct list *children);
+
+/*
+ * Free a filenode that was unlinked from the cache's table
+ */
+void discard_node(struct cache *cache, struct filenode *node);
+
 /*
  * Get a filenode from the cache
  * Returns filenode the file is found
@@ -0,0 +1,68 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+//longest command a client can send, including the newline
+#define CONTROL_LINE 64
+
+//a client of the control socket
+struct waiter {
+	int				fd; //connection the answer is written to
+	char			line[CONTROL_LINE]; //command read so far
+	size_t			len; //bytes of the command read so far
+	int				asked; //set once the client asked to wait
+	long long		since; //when the client asked in nanoseconds
+	unsigned long	scan; //first scan that started after the client asked
+	int				queued; //set once that scan's changes were queued
+	unsigned long	seq; //last job queued by then, every job up to it has to finish
+	int				failed; //set once one of those jobs failed
+	struct waiter	*next;
+};
+
+//unix socket build scripts ask through to wait until the changes they
+//made have reached every destination, instead of sleeping and hoping
+struct control {
+	int				fd; //listening socket
+	char			*path; //path name of the socket
+	struct waiter	*waiters; //connected clients
+};
+
+/*
+ * Listen on a unix socket for control commands, replacing an old socket
+ * Returns the control socket
+ * Otherwise returns 0
+ */
+struct control *init_control(char *path);
+
+/*
+ * Close the control socket and its clients, removing the socket file
+ */
+void free_control(struct control *control);
+
+/*
+ * Wait up to timeout milliseconds for clients to connect or send commands,
+ * taking everything that arrived (a null control only sleeps)
+ * A client that sends WAIT waits for scan and everything before it
+ * Returns the number of clients that asked to wait
+ */
+int poll_control(struct control *control, int timeout, unsigned long scan);
+
+/*
+ * Answer the clients whose jobs are done with the number of the last scan,
+ * OK if their changes reached every destination and ERR if a job failed
+ * scans is the number of scans whose changes were queued, seq the last job
+ * queued, oldest the first job still waiting to run (0 if none), held
+ * when the oldest deletion still held back was found (0 if none) and
+ * failed the first job that failed since the last call (0 if none)
+ */
+void answer_waiters(struct control *control, unsigned long scans, unsigned long seq, unsigned long oldest, long long held, unsigned long failed);
+
+/*
+ * Ask the sentinel listening on a control socket to sync now and wait
+ * until everything changed before the call reached every destination,
+ * printing the number of the scan that found the last of it
+ * Returns 0 if everything was synced
+ * Otherwise returns -1
+ */
+int wait_sync(char *path);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+//smallest file worth making from another one, smaller ones fit in a block anyway
+#define DEDUP_MIN 4096
+
+//how a file is made from one with the same content on the destination
+enum dedup_mode {
+	DEDUP_REFLINK, //share the other file's blocks, or copy them on the destination if the filesystem can't
+	DEDUP_HARDLINK, //link to the other file if its metadata matches too, otherwise as DEDUP_REFLINK
+};
+
+//a file on the destination with known content
+struct content {
+	off_t			size; //bytes in the file
+	unsigned long	hash; //fingerprint of the file's content
+	char			*path; //path name on the destination
+	struct content	*next; //used to resolve hashing collisions
+};
+
+//hash table of the files copied to one destination, by size so the
+//source of a new file only has to be read when some file is as big
+struct dedup {
+	enum dedup_mode	mode;
+	struct content	**values; //values stored in hash table
+	size_t			capacity, count; //size of the table, files in it
+};
+
+/*
+ * Initialize an empty content index on the heap
+ * Returns the index
+ * Otherwise returns 0
+ */
+struct dedup *init_dedup(enum dedup_mode mode);
+
+/*
+ * Free a content index from the heap
+ */
+void free_dedup(struct dedup *dedup);
+
+/*
+ * Remember that path on the destination holds size bytes with the
+ * fingerprint hash, replacing what was known about it before
+ * Returns 0 if the file was added (or is too small to be worth it)
+ * Otherwise returns -1
+ */
+int add_content(struct dedup *dedup, char *path, off_t size, unsigned long hash);
+
+/*
+ * Check if the index has a file of a size, which a file of that size
+ * could be made from
+ */
+int has_size(struct dedup *dedup, off_t size);
+
+/*
+ * Make dest from a file already on the destination that holds the same
+ * content as src, compared byte for byte first, giving it the mode,
+ * owner and times of st_info
+ * Returns 0 if dest was made
+ * Otherwise returns -1 and dest is left alone
+ */
+int dedup_file(struct dedup *dedup, char *src, char *dest, struct stat *st_info);
+
+/*
+ * Unlink a destination file that is hard linked to another one, so
+ * writing to it doesn't change both (a null index does nothing)
+ * Returns 1 if the file was unlinked
+ * Otherwise returns 0
+ */
+int break_link(struct dedup *dedup, char *dest);
+
+#endif
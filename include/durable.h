@@ -0,0 +1,93 @@
+#ifndef DURABLE_H
+#define DURABLE_H
+
+#include <stddef.h>
+
+//files published before a batch is flushed early, each is held open
+//for a moment while it is flushed
+#define DURABLE_BATCH 256
+
+//how copies reach their destination
+enum durability {
+	DURABLE_NONE, //written in place, flushed whenever the kernel gets to it
+	DURABLE_ATOMIC, //written under a temporary name and renamed into place once complete
+	DURABLE_FSYNC, //as atomic, with the files of a batch and their directories fsynced together
+	DURABLE_SYNCFS, //as atomic, with one syncfs per destination filesystem per batch
+};
+
+//a destination written in a batch
+struct published {
+	char				*dest; //path name on the destination
+	int					staged; //whether it waits under its temporary name to be renamed
+	int					fd; //descriptor held while its data is flushed
+	int					failed; //set when its data or name couldn't be flushed, a staged file is then left unpublished
+	void				*owner; //what it was published for, handed back once it is flushed (may be null)
+	struct published	*next;
+};
+
+//what was written since the destinations were last flushed, in the
+//order it was written
+struct durable {
+	enum durability		mode;
+	struct published	*head, *tail;
+	size_t				count; //entries in the batch
+	struct published	*done; //flushed entries with an owner, until they are taken
+};
+
+/*
+ * Initialize an empty batch on the heap
+ * Returns the batch
+ * Otherwise returns 0
+ */
+struct durable *init_durable(enum durability mode);
+
+/*
+ * Flush what is left in a batch and free it from the heap
+ */
+void free_durable(struct durable *durable);
+
+/*
+ * Get the temporary name a staged copy of dest is written under
+ */
+void staged_name(char *dest, char *tmp, size_t n);
+
+/*
+ * Remove the temporary files left in a directory by sentinels that died
+ * before publishing them, recognized by the name and a process id that
+ * is no longer running
+ */
+void sweep_staged(char *dir);
+
+/*
+ * Hand over a destination that was written, renaming it into place from
+ * its temporary name if it is staged, right away with DURABLE_ATOMIC and
+ * once the data is on disk otherwise
+ * An owner is handed back with the entry once the batch is flushed
+ * A null batch or one with DURABLE_NONE does nothing
+ * Returns 1 if the destination was added to the batch, 0 if it was published
+ * Otherwise returns -1 and a staged file is removed
+ */
+int publish(struct durable *durable, char *dest, int staged, void *owner);
+
+/*
+ * Flush the data of a batch, rename the staged files whose data is on
+ * disk into place and flush the directories the names are in, then
+ * empty it, keeping the entries with an owner until they are taken
+ * Returns 0 if every destination was published and flushed
+ * Otherwise returns -1
+ */
+int flush_durable(struct durable *durable);
+
+/*
+ * Take the flushed entries that have an owner, in the order they were
+ * published, to be freed with free_published
+ * Returns the first entry (0 if there are none)
+ */
+struct published *take_published(struct durable *durable);
+
+/*
+ * Free an entry taken from a batch
+ */
+void free_published(struct published *published);
+
+#endif
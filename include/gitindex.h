@@ -0,0 +1,68 @@
+#ifndef GITINDEX_H
+#define GITINDEX_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct list;
+
+//a tracked file as recorded in a git index
+struct index_entry {
+	char				*path; //path relative to the worktree
+	long				ctime, mtime, mtime_nsec; //stat data from the last refresh
+	long				size; //size in bytes (truncated to 32 bits by git)
+	mode_t				mode; //git mode, regular files, symlinks or submodules
+	ino_t				ino; //inode
+	unsigned char		oid[20]; //object id of the content
+	int					trusted; //whether the stat data can stand in for a stat
+	struct index_entry	*next; //used to resolve hashing collisions
+};
+
+//the entries of a worktree's .git/index (versions 2 to 4) by path
+struct git_index {
+	char				*path; //path of the index file
+	char				*root; //worktree the entry paths are relative to
+	struct index_entry	**values; //hash table of entries
+	size_t				capacity, count;
+	struct timespec		mtime; //identity of the index file when it was read
+	off_t				size;
+	ino_t				ino;
+	int					fsmonitor; //whether an fsmonitor extension marked dirty entries
+};
+
+/*
+ * Read the git index of a worktree on the heap
+ * Returns 0 if the worktree has no index or it couldn't be parsed
+ */
+struct git_index *open_git_index(char *root);
+
+/*
+ * Free a git index from the heap
+ */
+void free_git_index(struct git_index *index);
+
+/*
+ * Get the entry of a source path
+ * Returns 0 if the path isn't tracked
+ */
+struct index_entry *lookup_index(struct git_index *index, char *path);
+
+/*
+ * Fill stat info for a source path from its index entry
+ * Entries git couldn't vouch for (racily clean, flagged by fsmonitor,
+ * outside a sparse checkout, not regular files) aren't used
+ * Returns 0 if st_info was filled
+ * Otherwise returns -1
+ */
+int index_stat(struct git_index *index, char *path, struct stat *st_info);
+
+/*
+ * Re-read the index if git rewrote it and add the source paths whose
+ * content or mode changed to changed, and those no longer tracked to removed
+ * Returns the number of paths added, 0 if the index wasn't rewritten
+ * Otherwise returns -1
+ */
+int diff_git_index(struct git_index *index, struct list *changed, struct list *removed);
+
+#endif
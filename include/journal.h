@@ -0,0 +1,85 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct list;
+
+//seconds before a journal was last written in which a change may have
+//been found without its record making it to disk
+#define JOURNAL_SLACK 60
+
+//append-only log of detected changes and their completion
+//records are one per line: I/U/A/D <path> for an insert, update,
+//metadata change or delete, C <path> once the destination is up to date,
+//M once the initial migration finished
+//paths are stored relative to the source and destination roots
+struct journal {
+	FILE	*fp; //journal file opened for appending
+	char	*path; //path of the journal file
+	char	*src, *dest; //roots the relative paths are resolved against
+	size_t	size; //bytes in the journal file
+	size_t	compacted; //size of the journal after the last compaction
+	int		migrated; //whether the initial migration finished
+	int		dirty; //whether records were written since the last sync
+	long long	written; //when an existing journal was last written to before it was opened in nanoseconds (0 if it is new)
+};
+
+/*
+ * Open the journal at path for a source and destination, creating it if needed
+ * A journal written for different roots is discarded
+ */
+struct journal *open_journal(char *path, char *src, char *dest);
+
+/*
+ * Sync and close a journal, freeing it from the heap
+ */
+void close_journal(struct journal *journal);
+
+/*
+ * Add every change without a completion marker to the lists
+ * Each path is re-checked so it lands in the list that brings the
+ * destination up to date
+ * Returns the number of changes added
+ * Otherwise returns -1
+ */
+int replay_journal(struct journal *journal, struct list *insert_list, struct list *update_list, struct list *delete_list);
+
+/*
+ * Record a change to a source path, op is one of I, U, A or D
+ * Returns 0 if the record was buffered
+ * Otherwise returns -1
+ */
+int journal_change(struct journal *journal, char op, char *path);
+
+/*
+ * Record that a destination path is up to date
+ * Returns 0 if the record was buffered
+ * Otherwise returns -1
+ */
+int journal_done(struct journal *journal, char *path);
+
+/*
+ * Record that the initial migration finished
+ * Returns 0 if the record was buffered
+ * Otherwise returns -1
+ */
+int journal_migrated(struct journal *journal);
+
+/*
+ * Write buffered records and flush them to disk with a single fsync,
+ * compacting the journal once it has grown enough
+ * Returns 0 if the records are durable
+ * Otherwise returns -1
+ */
+int sync_journal(struct journal *journal);
+
+/*
+ * Rewrite the journal with only the changes that are still pending
+ * Returns 0 if the journal was rewritten
+ * Otherwise returns -1
+ */
+int compact_journal(struct journal *journal);
+
+#endif
@@ -28,6 +28,11 @@ int fetch(struct list *list, char *dest, size_t i, size_t maxlen);
  */
 int append(struct list *list, char *src);
 
+/*
+ * Remove the item at index i, the last item takes its place
+ */
+int discard(struct list *list, size_t i);
+
 /*
  * Clear a list
  */
@@ -0,0 +1,61 @@
+#ifndef PAIR_H
+#define PAIR_H
+
+struct cache;
+struct list;
+struct saves;
+struct git_index;
+struct journal;
+struct ring;
+struct snapshot;
+struct dedup;
+
+//a destination of a pair, which makes progress on its own
+struct target {
+	char				*dest; //root being synced to
+	char				*socket_path; //socket of the receiver dest is written through (may be null)
+	struct ring			*ring; //connection to the receiver (may be null)
+	char				*journal_file; //journal of the changes still to reach dest (may be null)
+	struct journal		*journal; //journal of the changes still to reach dest (may be null)
+	int					queue; //scheduler queue the destination's jobs go to
+	struct dedup		*dedup; //files on dest by content (may be null)
+};
+
+//a source kept in sync with one or more destinations, with its own cache and changes
+struct pair {
+	char				*src; //root being synced
+	struct target		*targets; //destinations, each changed file is read once for all of them
+	int					target_count; //number of destinations
+	struct cache		*cache; //files of the source
+	struct list			*insert_list, *delete_list, *update_list, *meta_list; //changes found by the last scan
+	struct saves		*saves; //deletions held back in case an editor is saving (may be null)
+	struct git_index	*git_index; //index of a git source (may be null)
+	struct snapshot		*snapshot; //source at the last scan, when changes are found by diffing snapshots (may be null)
+	unsigned long		generation; //number of the scan being run
+	long long			clean_time; //when the last deletion sweep ran
+};
+
+/*
+ * Initialize a pair with an empty cache and change lists on the heap
+ * dests is a comma separated list of destinations, journal_files is
+ * either 0 or a comma separated list with a journal for each destination
+ * A destination written as ring:socket_path:dest_path is a path on the
+ * receiver listening on socket_path
+ */
+struct pair *init_pair(char *src, char *dests, char *journal_files);
+
+/*
+ * Free a pair and everything it owns from the heap
+ */
+void free_pair(struct pair *pair);
+
+/*
+ * Read the pairs of a config file, one `src_path dest_path[,dest_path...]
+ * [journal_file[,journal_file...]]` per line, blank lines and lines
+ * starting with # are skipped
+ * Returns the pairs and sets count
+ * Otherwise returns 0
+ */
+struct pair **load_pairs(char *path, int *count);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef REMOVER_H
+#define REMOVER_H
+
+#include <pthread.h>
+
+struct task;
+
+//removes directory trees relative to directory descriptors, sharing the
+//subdirectories of a tree out to a pool of threads
+struct remover {
+	pthread_t		*threads; //worker threads
+	int				count; //number of worker threads
+	pthread_mutex_t	lock; //protects the queue and the stop flag
+	pthread_cond_t	ready; //signalled when a task is queued or the pool stops
+	pthread_cond_t	done; //signalled when a task finishes
+	struct task		*head, *tail; //subtrees waiting to be removed
+	int				stop; //set when the workers should exit
+};
+
+/*
+ * Initialize a remover with a number of worker threads on the heap
+ * With 0 threads trees are removed by the caller alone
+ */
+struct remover *init_remover(int threads);
+
+/*
+ * Stop the worker threads and free a remover from the heap
+ */
+void free_remover(struct remover *remover);
+
+/*
+ * Remove a file, or a directory with everything in it
+ * A null remover removes the tree on the calling thread
+ * Returns 0 if the path is gone
+ * Otherwise returns -1
+ */
+int remove_tree(struct remover *remover, char *path);
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+//bytes of shared memory records are passed through
+#define RING_SIZE (4 * 1024 * 1024)
+
+//most file data a single record carries
+#define RING_MAX_DATA 65536
+
+//status a receiver answers a passed descriptor with when it can't copy
+//from it and the data has to be sent through the ring instead
+#define RING_FALLBACK 1
+
+//status a receiver answers an exclusive open or copy with when the file
+//is already there
+#define RING_EXISTS 2
+
+//status a receiver answers a copy with when it copied its range and
+//the source goes on past it
+#define RING_PARTIAL 3
+
+//most bytes a receiver copies from a passed descriptor per record, so
+//the sender waits for a bounded time and can get to other work between ranges
+#define RING_COPY_RANGE (4 * 1024 * 1024)
+
+enum ring_op {
+	RING_PAD, //unused space before the end of the ring
+	RING_MKDIR, //create a directory
+	RING_META, //apply a mode, owner and times
+	RING_DELETE, //remove a file or directory tree
+	RING_COPY, //copy a range from a descriptor passed over the socket
+	RING_OPEN, //start a stream of file data
+	RING_DATA, //file data of a stream
+	RING_CLOSE, //finish a stream
+	RING_ABORT, //drop a stream
+	RING_LINK, //make a symbolic link to the target in the data
+};
+
+//positions shared by both sides at the start of the memory, counted in
+//bytes since the ring was created and kept on separate cache lines
+struct ring_header {
+	uint64_t	head; //end of the records written by the sender
+	char		head_pad[56];
+	uint64_t	tail; //end of the records consumed by the receiver
+	char		tail_pad[56];
+};
+
+//a record in the ring, followed by its path and then its data,
+//records never wrap around the end of the ring
+struct ring_record {
+	uint32_t	op; //one of enum ring_op
+	uint32_t	length; //bytes of the whole record, a multiple of 8
+	uint64_t	seq; //number of the record
+	uint64_t	handle; //stream the record belongs to
+	int64_t		offset, size; //position of the data, size of the file
+	uint32_t	mode, uid, gid; //metadata of the file
+	uint32_t	path_len, data_len; //bytes of path and data after the record
+	uint32_t	exclusive; //only create the file if it doesn't exist, and answer the open
+	int64_t		atime_sec, atime_nsec, mtime_sec, mtime_nsec;
+};
+
+//answer to a record that waits for the receiver
+struct ring_ack {
+	uint64_t	seq; //record being answered
+	int32_t		status; //0, RING_FALLBACK, RING_EXISTS, RING_PARTIAL or -1
+	int32_t		error; //errno of a failure
+};
+
+//connection of a sender to a receiver on the same host, file data
+//goes through shared memory instead of the socket
+struct ring {
+	int					sock; //unix socket to the receiver
+	int					data_fd; //eventfd signalled when records are written
+	int					space_fd; //eventfd signalled when records are consumed
+	struct ring_header	*header; //start of the shared memory
+	char				*data; //records, after the header
+	uint64_t			seq; //number of the last record
+	uint64_t			reserved; //position of the record being filled in
+};
+
+/*
+ * Connect to the receiver listening on a unix socket and hand it
+ * the shared memory
+ * Returns the connection
+ * Otherwise returns 0
+ */
+struct ring *connect_ring(char *socket_path);
+
+/*
+ * Close a connection, freeing it from the heap
+ */
+void close_ring(struct ring *ring);
+
+/*
+ * Create a directory on the receiver, an existing one is left alone
+ * Returns 0 if the directory exists
+ * Otherwise returns -1
+ */
+int ring_mkdir(struct ring *ring, char *path, mode_t mode);
+
+/*
+ * Give a path on the receiver the mode, owner and times of stat info
+ * Returns 0 if the metadata was applied
+ * Otherwise returns -1
+ */
+int ring_meta(struct ring *ring, char *path, struct stat *st_info);
+
+/*
+ * Make a path on the receiver a symbolic link to target with the owner
+ * and times of stat info, replacing whatever is there except a directory
+ * Returns 0 if the link was made
+ * Otherwise returns -1
+ */
+int ring_link(struct ring *ring, char *path, char *target, struct stat *st_info);
+
+/*
+ * Remove a file or directory tree on the receiver
+ * Returns 0 if the path is gone
+ * Otherwise returns -1
+ */
+int ring_delete(struct ring *ring, char *path);
+
+/*
+ * Pass an open file to the receiver to copy up to RING_COPY_RANGE bytes
+ * from offset to path with copy_file_range, creating or truncating path
+ * at offset 0, where with exclusive an existing file is left alone
+ * The copy is finished with the metadata of the file once a range
+ * reaches its end
+ * Returns 0 if the receiver finished the copy, RING_PARTIAL if the file
+ * goes on past the range, RING_EXISTS if it left an existing file alone,
+ * RING_FALLBACK if the data has to be streamed
+ * Otherwise returns -1
+ */
+int ring_copy(struct ring *ring, int fd, char *path, mode_t mode, int exclusive, off_t offset);
+
+/*
+ * Start streaming file data to path on the receiver and set handle to
+ * the stream, with exclusive an existing file is left alone
+ * Returns 0 if the stream was started, RING_EXISTS if the file is already
+ * there (exclusive only)
+ * Otherwise returns -1
+ */
+int ring_open(struct ring *ring, char *path, mode_t mode, int exclusive, uint64_t *handle);
+
+/*
+ * Get space for up to n bytes of data in the ring, waiting for the
+ * receiver to make room if needed
+ * Returns where the data goes until it is committed
+ * Otherwise returns 0
+ */
+char *ring_reserve(struct ring *ring, size_t n);
+
+/*
+ * Send n bytes of reserved data to be written at offset in a stream
+ * Returns 0 if the data was sent
+ * Otherwise returns -1
+ */
+int ring_commit(struct ring *ring, uint64_t handle, off_t offset, size_t n);
+
+/*
+ * Send n bytes to be written at offset in a stream
+ * Returns 0 if the data was sent
+ * Otherwise returns -1
+ */
+int ring_write(struct ring *ring, uint64_t handle, off_t offset, char *buf, size_t n);
+
+/*
+ * Finish a stream, setting its file to size bytes and the metadata
+ * of the source's stat info
+ * Returns 0 if the receiver has the whole file
+ * Otherwise returns -1
+ */
+int ring_close(struct ring *ring, uint64_t handle, off_t size, struct stat *st_info);
+
+/*
+ * Drop a stream that won't be finished
+ */
+void ring_abort(struct ring *ring, uint64_t handle);
+
+/*
+ * Receive records from senders connecting to a unix socket, applying
+ * them to the local filesystem under root
+ * Returns -1 if the socket couldn't be set up, otherwise never returns
+ */
+int serve_ring(char *socket_path, char *root);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef SAVES_H
+#define SAVES_H
+
+#include <stddef.h>
+
+struct list;
+
+//a deletion held back in case the file is about to be saved over
+struct held {
+	char		*path; //source path that disappeared
+	long long	since; //when the deletion was found in nanoseconds
+	struct held	*prev, *next; //neighbouring deletions, newest first
+	struct held	*hnext; //used to resolve hashing collisions in the index
+};
+
+//recognizes editors saving through a temp file and a rename
+struct saves {
+	struct held	*held; //deletions waiting out the window
+	struct held	**index; //hash table of path -> held deletion
+	size_t		capacity, count; //size of the index, deletions in the index
+	long long	window; //nanoseconds a deletion is held back
+	char		*src, *dest; //roots of the paths being synced (dest may be null)
+	int			follow; //whether a symbolic link is synced as what it points to
+};
+
+/*
+ * Initialize save recognition for a source and destination on the heap
+ * window is how long in milliseconds a deleted file can take to reappear
+ * Without a destination saves are recognized from the source alone
+ */
+struct saves *init_saves(long window, char *src, char *dest);
+
+/*
+ * Free save recognition from the heap
+ */
+void free_saves(struct saves *saves);
+
+/*
+ * Check if a path is an editor's temp, swap or backup file
+ * (4913, *.swp, *~, *.tmp, ...) that should never be synced
+ */
+int is_temp_file(char *path);
+
+/*
+ * Collapse a file that was deleted and created again into one update
+ * Deletions in delete_list are held back for the window, a held
+ * deletion that shows up in insert_list again as a regular file, when the
+ * destination (if there is one) still has a regular file there, becomes
+ * an update, and
+ * deletions whose window ran out are put back into delete_list
+ * Returns 0 if the lists were updated
+ * Otherwise returns -1
+ */
+int collapse_saves(struct saves *saves, struct list *insert_list, struct list *update_list, struct list *delete_list);
+
+#endif
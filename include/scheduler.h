@@ -0,0 +1,188 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "transfer.h"
+
+struct throttle;
+struct cache;
+struct stats;
+struct trace;
+struct journal;
+struct remover;
+struct ring;
+struct uring;
+struct dedup;
+
+enum job_kind {
+	JOB_MKDIR,
+	JOB_COPY,
+	JOB_META,
+	JOB_DELETE,
+	JOB_LINK,
+};
+
+//jobs in a higher class always run before jobs in a lower class
+enum priority {
+	PRIORITY_HIGH, //directories, metadata, small and recently edited files
+	PRIORITY_NORMAL, //everything else, including deletes
+	PRIORITY_LOW, //large and generated files
+	PRIORITY_COUNT,
+};
+
+//a pending change to the destination
+struct job {
+	enum job_kind	kind;
+	enum priority	priority;
+	char			*src, *dest; //source and destination path names
+	mode_t			mode; //mode to create the destination with
+	unsigned long	seq; //order the job was scheduled in
+	long long		detected, queued, saved; //when the change was found, queued and saved in nanoseconds
+	int				started, done; //whether the job has run / finished
+	off_t			size; //size of the source when the job was queued
+	off_t			append_from; //destination size when only appended data needs copying
+	unsigned long	tail; //fingerprint the source must have before append_from
+	unsigned long	hash; //fingerprint of the destination's content (0 if unknown)
+	int				verify; //only copy if the content no longer matches hash
+	int				staged; //whether the copy is written to a temporary file and published when complete
+	int				published; //whether it waits for its destination to be flushed before it counts as done
+	int				queue; //queue of the destination the job belongs to
+	struct transfer	transfer; //copy state of a JOB_COPY
+	struct job		*prev, *next; //neighbouring jobs in the same priority class
+	struct job		*hnext; //used to resolve hashing collisions in the index
+	struct job		*sibling; //next job copying the same source to another destination (may be null)
+};
+
+//pending jobs of one destination, which takes turns with the other
+//destinations' queues
+struct queue {
+	struct job		*head[PRIORITY_COUNT], *tail[PRIORITY_COUNT]; //jobs per class
+	struct cache	*cache; //source cache remembering what each destination holds (may be null)
+	struct journal	*journal; //completed jobs are recorded here (may be null)
+	struct ring		*ring; //receiver the destination is reached through (may be null)
+	struct dedup	*dedup; //files on the destination by content, new files are made from them (may be null)
+};
+
+//priority queues of pending jobs
+struct scheduler {
+	struct queue	*queues; //one queue per destination
+	int				queue_count; //number of queues
+	int				turn; //queue that goes first when several have work in the same class
+	struct job		**index; //hash table of dest -> most recent job
+	size_t			capacity, count; //size of the index, jobs in the index
+	struct job		*finished; //completed deletes, kept until the queues drain
+	unsigned long	seq; //sequence number of the last scheduled job
+	unsigned long	failed; //oldest job that failed since the failures were last taken (0 if none)
+	off_t			small_size, large_size; //classification thresholds in bytes
+	long			recent; //seconds a file is considered recently edited
+	size_t			chunk; //bytes copied before higher priority work is checked
+	struct throttle *throttle; //rate limits (may be null)
+	struct stats	*stats; //latency histograms (may be null)
+	struct trace	*trace; //trace of copies (may be null)
+	struct remover	*remover; //threads removing deleted trees (may be null)
+	struct uring	*uring; //batches runs of small copies (may be null)
+	struct durable	*durable; //publishes complete copies and flushes them a run at a time (may be null)
+	int				follow; //whether a symbolic link is synced as what it points to
+};
+
+/*
+ * Initialize a scheduler on the heap
+ */
+struct scheduler *init_scheduler(struct throttle *throttle);
+
+/*
+ * Free a scheduler and all its pending jobs from the heap
+ */
+void free_scheduler(struct scheduler *scheduler);
+
+/*
+ * Add a queue for the jobs of a destination, which is written through
+ * a ring if one is given
+ * Returns the index of the queue
+ * Otherwise returns -1
+ */
+int add_queue(struct scheduler *scheduler, struct cache *cache, struct journal *journal, struct ring *ring);
+
+/*
+ * Determine the priority class of a file
+ */
+enum priority classify(struct scheduler *scheduler, char *path, struct stat *st_info);
+
+/*
+ * Queue src to be created or copied at dest
+ * Only the new data is copied if src grew and its old end is unchanged,
+ * only metadata is applied if src kept its size and content
+ * Any pending job for dest is replaced
+ * detected is when the change was found in nanoseconds
+ * Returns 0 if the job was queued
+ * Otherwise returns -1
+ */
+int schedule(struct scheduler *scheduler, int queue, char *src, char *dest, long long detected);
+
+/*
+ * Queue src to be created or copied at several destinations, one job per
+ * destination queue
+ * Copies that are at the same point share every chunk read from src, one
+ * that falls behind carries on by itself
+ * Returns 0 if every job was queued
+ * Otherwise returns -1
+ */
+int schedule_fanout(struct scheduler *scheduler, int *queues, char **dests, int count, char *src, long long detected);
+
+/*
+ * Queue the mode, owner and times of src to be applied to dest
+ * without copying any data
+ * A pending copy of dest already applies them when it finishes
+ * Returns 0 if the job was queued
+ * Otherwise returns -1
+ */
+int schedule_meta(struct scheduler *scheduler, int queue, char *src, char *dest, long long detected);
+
+/*
+ * Queue dest to be deleted
+ * detected is when the deletion was found in nanoseconds
+ * Returns 0 if the job was queued
+ * Otherwise returns -1
+ */
+int schedule_delete(struct scheduler *scheduler, int queue, char *dest, long long detected);
+
+/*
+ * Run pending jobs, highest priority first, for up to budget seconds
+ * Queues with work in the same class take turns one job or chunk at a time,
+ * a run of small copies in a queue goes to the kernel as one batch
+ * Large copies are run in chunks so they can be resumed on the next call
+ * Returns 0 if every job that ran succeeded
+ * Otherwise returns -1
+ */
+int run_scheduler(struct scheduler *scheduler, double budget);
+
+/*
+ * Check if the scheduler has jobs waiting to run
+ */
+int pending(struct scheduler *scheduler);
+
+/*
+ * Get how long until one of the pending jobs can run, copies waiting for
+ * a source that changed while they ran are set aside for a moment
+ * Returns the time in milliseconds, 0 if one can run now
+ * Otherwise returns -1 if there are no pending jobs
+ */
+int next_run(struct scheduler *scheduler);
+
+/*
+ * Get the sequence number of the oldest job waiting to run
+ * Returns 0 if there is none
+ */
+unsigned long oldest_pending(struct scheduler *scheduler);
+
+/*
+ * Get the sequence number of the oldest job that failed since this was
+ * last called, and forget it
+ * Returns 0 if none failed
+ */
+unsigned long take_failed(struct scheduler *scheduler);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct list;
+
+//every file under a root at one point in time, sorted by path so two
+//snapshots can be compared in a single pass, with each field in its
+//own array so comparing one field touches only that field's memory
+struct snapshot {
+	char		*blob; //path names, each ending in a null byte
+	size_t		blob_len, blob_cap; //bytes used and allocated in blob
+	uint32_t	*offsets; //start of each path in blob
+	int64_t		*mtime, *ctime; //modification and inode change times in nanoseconds
+	int64_t		*size; //sizes in bytes
+	uint64_t	*ino; //inodes, which change when a file is replaced by a rename
+	uint32_t	*mode; //types and permissions
+	size_t		count, capacity; //entries used and allocated in each array
+};
+
+/*
+ * Walk the tree under root into a snapshot on the heap, the entries
+ * of each directory follow it, sorted by name, editor temp files are left out
+ * Symbolic links are kept as links unless follow is set, then a link back
+ * up to a directory above it is left out
+ * Returns the snapshot
+ * Otherwise returns 0 if a directory couldn't be read, since its
+ * files would look deleted
+ */
+struct snapshot *take_snapshot(char *root, int follow);
+
+/*
+ * Free a snapshot from the heap
+ */
+void free_snapshot(struct snapshot *snapshot);
+
+/*
+ * Get the path name of entry i
+ */
+char *snapshot_path(struct snapshot *snapshot, size_t i);
+
+/*
+ * Fill in stat info from the fields of entry i that a snapshot keeps
+ */
+void snapshot_stat(struct snapshot *snapshot, size_t i, struct stat *st_info);
+
+/*
+ * Find the entry of a path with a binary search
+ * Returns the index of the entry
+ * Otherwise returns -1
+ */
+long find_path(struct snapshot *snapshot, char *path);
+
+/*
+ * Compare two path names in snapshot order, where a directory comes
+ * right before everything in it
+ */
+int compare_paths(char *a, char *b);
+
+/*
+ * Compare the snapshots of the same root with one merge over both,
+ * appending new paths to the insert list, regular files whose content
+ * changed to the update list, paths with only new metadata to the meta
+ * list and paths that are gone to the delete list (a deleted directory
+ * is one deletion for everything in it)
+ * Returns 0 if every change was appended
+ * Otherwise returns -1
+ */
+int diff_snapshots(struct snapshot *old, struct snapshot *new, struct list *insert_list, struct list *update_list, struct list *meta_list, struct list *delete_list);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+#include "scheduler.h"
+
+//each power of two range is split into 2^HIST_SUB_BITS linear buckets
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+//log-linear latency histogram with roughly 6% precision
+struct histogram {
+	unsigned long	counts[HIST_BUCKETS]; //samples per bucket
+	unsigned long	total; //number of samples
+	long long		min, max; //smallest and largest samples
+};
+
+//points in a change's life that latencies are measured between
+enum stage {
+	STAGE_QUEUE, //detected -> queued
+	STAGE_TRANSFER, //queued -> applied at the destination
+	STAGE_TOTAL, //detected -> applied at the destination
+	STAGE_SAVE, //saved (source mtime) -> applied at the destination
+	STAGE_COUNT,
+};
+
+//latency histograms per stage and priority class
+struct stats {
+	struct histogram latency[STAGE_COUNT][PRIORITY_COUNT];
+};
+
+/*
+ * Initialize empty stats on the heap
+ */
+struct stats *init_stats();
+
+/*
+ * Free stats from the heap
+ */
+void free_stats(struct stats *stats);
+
+/*
+ * Add a latency sample in microseconds to a histogram
+ */
+void record(struct histogram *histogram, long long usec);
+
+/*
+ * Add a latency sample in microseconds for a stage and priority class
+ */
+void record_latency(struct stats *stats, enum stage stage, enum priority priority, long long usec);
+
+/*
+ * Get the value in microseconds below which a fraction of samples fall
+ */
+long long percentile(struct histogram *histogram, double fraction);
+
+/*
+ * Print a summary of every non-empty histogram
+ * Nothing is printed if no changes have been recorded
+ */
+void print_stats(struct stats *stats, FILE *fp);
+
+/*
+ * Get the current wall clock time in nanoseconds
+ */
+long long now_ns();
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stddef.h>
+#include <signal.h>
+
+//token bucket limiting how fast a resource can be used
+struct bucket {
+	double rate; //tokens added per second (0 means unlimited)
+	double burst; //maximum tokens that can be saved up
+	double tokens; //tokens currently available
+	double last; //time of the last refill in seconds
+};
+
+//rate limits applied to the transfer paths
+struct throttle {
+	struct bucket bytes; //bandwidth limit
+	struct bucket ops; //file operation limit
+	char *config; //limits file re-read on reload (may be null)
+	volatile sig_atomic_t reload; //set when the limits file should be re-read
+};
+
+/*
+ * Initialize a throttle on the heap
+ * A rate of 0 disables that limit
+ */
+struct throttle *init_throttle(double bytes_rate, double ops_rate);
+
+/*
+ * Free a throttle from the heap
+ */
+void free_throttle(struct throttle *throttle);
+
+/*
+ * Change the rate limits of a throttle
+ * A burst of 0 allows one second worth of tokens to be saved up
+ */
+void set_limits(struct throttle *throttle, double bytes_rate, double bytes_burst, double ops_rate, double ops_burst);
+
+/*
+ * Read rate limits from a limits file and apply them
+ * Returns 0 if the limits were applied
+ * Otherwise returns -1
+ */
+int load_limits(struct throttle *throttle, char *path);
+
+/*
+ * Wait until n bytes can be transferred
+ */
+void take_bytes(struct throttle *throttle, size_t n);
+
+/*
+ * Wait until a file operation can be performed
+ */
+void take_op(struct throttle *throttle);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+//lanes spans are drawn in, copies get one lane per priority class after these
+enum lane {
+	LANE_SCAN,
+	LANE_SYNC,
+	LANE_COPY,
+};
+
+//Chrome trace-event JSON writer
+struct trace {
+	FILE		*fp; //file events are written to
+	long long	start; //time the trace started in nanoseconds
+	int			events; //number of events written so far
+};
+
+/*
+ * Start a trace written to path
+ * Returns 0 if the file couldn't be created
+ */
+struct trace *init_trace(char *path);
+
+/*
+ * Finish the trace file and free the trace from the heap
+ */
+void free_trace(struct trace *trace);
+
+/*
+ * Add a complete span between two times in nanoseconds
+ */
+void trace_span(struct trace *trace, char *name, char *category, int lane, long long start, long long end);
+
+#endif
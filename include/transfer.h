@@ -0,0 +1,171 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct throttle;
+struct ring;
+
+//files at least this big are preallocated on the destination
+#define PREALLOCATE_SIZE (1024 * 1024)
+
+//bytes before the end of a copy that are fingerprinted to detect appends
+#define TAIL_SIZE 4096
+
+//starting value of a content fingerprint (FNV-1a)
+#define FINGERPRINT_INIT 14695981039346656037UL
+
+//bytes a copy is fingerprinted in, so only the blocks a writer changed
+//while it ran are copied again
+#define TRANSFER_BLOCK 65536
+
+//times a copy is brought up to date with a source that keeps changing
+//before it is left to the next scan
+#define TRANSFER_RETRIES 4
+
+//milliseconds a writer gets before a changed source is looked at again,
+//doubled on every retry, the copy is set aside in the meantime
+#define TRANSFER_BACKOFF 10
+
+//a file being copied from a source to a destination in chunks
+struct transfer {
+	int		r_fd, w_fd; //source and destination descriptors
+	off_t	offset, size; //position of the copy, size of the source when opened
+	off_t	data_end; //end of the data range being copied from a sparse source
+	int		sparse; //whether holes in the source are skipped
+	int		preallocated; //whether destination space was reserved up front
+	int		frozen; //whether the source is read from a clone writers can't change
+	int		hashing; //whether every byte up to offset went through hash
+	unsigned long hash; //running fingerprint of the content copied so far
+	off_t	start; //offset the copy started at
+	unsigned long base; //fingerprint of the content before start
+	struct stat	source; //stat info of the source when its content was last read
+	unsigned long *blocks; //fingerprint of the bytes read from every TRANSFER_BLOCK
+	size_t	block_count; //number of fingerprinted blocks
+	int		retries; //times the source was found changed once the copy reached its end
+	long long	due; //when a source found changed is looked at again in nanoseconds (0 if it isn't waited on)
+	off_t	reread, reread_end; //position of a pass over the source from start, rewriting the blocks that changed (-1 if there's none), and where the copy ended before it
+	char	*staged; //destination a temporary file is written for, until it is complete (may be null)
+	int		unnamed; //whether the temporary file has no name yet
+	struct ring	*ring; //receiver the destination is written through (may be null)
+	uint64_t	handle; //stream of the destination on the receiver (0 once closed)
+	char	*passed; //destination the receiver copies the source to a range at a time, until it is complete (may be null)
+};
+
+/*
+ * Open a transfer from src to dest, creating or truncating dest with mode
+ * Sparse sources only have their data ranges copied, large dense sources
+ * have their space reserved on the destination first
+ * A source bigger than a block is read from a clone if its filesystem can
+ * share blocks, so writers can't change it during the copy
+ * Returns 0 if both files were opened
+ * Otherwise returns -1
+ */
+int open_transfer(struct transfer *transfer, char *src, char *dest, mode_t mode);
+
+/*
+ * Open a transfer from src to a temporary file for dest that readers
+ * can't see, unnamed (O_TMPFILE) if the filesystem allows it and under
+ * the staged name of dest otherwise
+ * Once complete it is left under the staged name to be published
+ * Returns 0 if both files were opened
+ * Otherwise returns -1
+ */
+int open_staged(struct transfer *transfer, char *src, char *dest, mode_t mode);
+
+/*
+ * Open a transfer that only copies what was appended to src after its
+ * first offset bytes, which dest must already hold
+ * hash is the fingerprint of those bytes (0 if unknown)
+ * Returns 0 if both files were opened and dest is offset bytes long
+ * Otherwise returns -1
+ */
+int open_append(struct transfer *transfer, char *src, char *dest, off_t offset, unsigned long hash);
+
+/*
+ * Open a transfer from src to dest on the other side of a ring
+ * Dense sources are handed to the receiver to copy in the kernel, the
+ * first RING_COPY_RANGE bytes here and the rest one range per step,
+ * anything it can't copy is streamed through the ring
+ * With exclusive an existing dest is left alone
+ * Returns 0 if the transfer was opened (complete if the receiver made
+ * the whole copy or dest already existed)
+ * Otherwise returns -1
+ */
+int open_ring_transfer(struct transfer *transfer, struct ring *ring, char *src, char *dest, mode_t mode, int exclusive);
+
+/*
+ * Fingerprint the TAIL_SIZE bytes of a file before end
+ */
+unsigned long tail_fingerprint(int fd, off_t end);
+
+/*
+ * Fingerprint the whole content of a file
+ * Returns 0 if the file couldn't be read
+ */
+unsigned long content_fingerprint(char *path);
+
+/*
+ * Fingerprint n bytes held in memory, the same way a file holding
+ * them would be
+ */
+unsigned long buffer_fingerprint(char *buf, size_t n);
+
+/*
+ * Get the content fingerprint of a finished transfer
+ * Returns 0 if not every byte was fingerprinted
+ */
+unsigned long transfer_fingerprint(struct transfer *transfer);
+
+/*
+ * Give dest the mode, owner and times of a source's stat info
+ * The owner is only changed when running as root
+ * Returns 0 if the metadata was applied
+ * Otherwise returns -1
+ */
+int apply_metadata(char *dest, struct stat *st_info);
+
+/*
+ * Make dest a symbolic link to target, replacing whatever is there
+ * except a directory, with the owner and times of st_info if it is set
+ * Returns 0 if the link was made
+ * Otherwise returns -1
+ */
+int make_link(char *target, char *dest, struct stat *st_info);
+
+/*
+ * Copy up to chunk bytes of a transfer
+ * Once the end is reached a dense source that changed during the copy is
+ * given a moment, during which the transfer copies nothing, then the copy
+ * carries on from the end if the source only grew or passes over it again
+ * in chunks, rewriting only the blocks that differ, until it holds still
+ * or TRANSFER_RETRIES ran out, then the destination gets the mode and times
+ * the source had when it was last read
+ * Returns the number of bytes copied (chunk while it waits until due),
+ * less than chunk once the transfer is complete
+ * Otherwise returns -1
+ */
+ssize_t step_transfer(struct transfer *transfer, size_t chunk, struct throttle *throttle);
+
+/*
+ * Copy up to chunk bytes of a transfer, writing every buffer read from its
+ * source to the mirrors as well
+ * Mirrors must copy the same source from the same offset, a mirror whose
+ * write fails is set to 0 and left where it was
+ * Mirrors are rewritten with the blocks that differ from what was written
+ * to them when the source is passed over again
+ * Returns the number of bytes copied (chunk while it waits until due),
+ * less than chunk once the transfer is complete
+ * Otherwise returns -1
+ */
+ssize_t fan_transfer(struct transfer *transfer, struct transfer **mirrors, int count, size_t chunk, struct throttle *throttle);
+
+/*
+ * Close the files of a transfer, removing the temporary file of a staged
+ * one that didn't complete
+ */
+void close_transfer(struct transfer *transfer);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct statx;
+
+//most files copied by one batch, each gets a registered buffer and two
+//registered file slots
+#define URING_SLOTS 32
+
+//bytes of a registered buffer, files up to this size are copied in one read
+#define URING_BUF_SIZE (64 * 1024)
+
+//operations submitted at most by one system call
+#define URING_DEPTH 256
+
+//an io_uring instance set up through the raw system calls
+struct uring {
+	int			fd; //descriptor of the ring
+	void		*sq_ring, *cq_ring; //mapped submission and completion rings
+	size_t		sq_size, cq_size; //bytes mapped for the rings
+	struct io_uring_sqe	*sqes; //mapped submission entries
+	unsigned	*sq_head, *sq_tail, *sq_mask, *sq_array; //submission ring fields
+	unsigned	*cq_head, *cq_tail, *cq_mask; //completion ring fields
+	struct io_uring_cqe	*cqes; //completion entries
+	unsigned	tail; //submission tail not yet published to the kernel
+	char		*buffers; //registered buffers, URING_SLOTS of URING_BUF_SIZE
+	struct statx	*statx_bufs; //results of the stats of a batch
+	int			*res; //results of the operations of a batch
+	int			broken; //set when a batch couldn't be finished, later calls don't use the ring
+};
+
+//a small file copied by a batch
+struct uring_copy {
+	char		*src, *dest; //source and destination path names
+	mode_t		mode; //mode to create the destination with
+	off_t		size; //bytes expected in the source
+	int			result; //0 if the whole file was copied, otherwise -1
+	struct stat	st_info; //stat info of the source when it was opened
+	char		*data; //bytes copied, valid until the next batch
+};
+
+/*
+ * Set up an io_uring instance with registered buffers and file slots
+ * on the heap
+ * Returns the instance
+ * Otherwise returns 0 if the kernel can't run the batches, in which case
+ * callers pass a null uring and the work is done one call at a time
+ */
+struct uring *init_uring();
+
+/*
+ * Close an io_uring instance and free it from the heap
+ */
+void free_uring(struct uring *uring);
+
+/*
+ * Stat count paths, submitting URING_DEPTH of them per system call
+ * results[i] is set to 0 and st_info[i] filled in if path i could be stat'ed,
+ * otherwise results[i] is set to -1
+ * A symbolic link is only followed if follow is set and it points to something
+ * A null uring stats the paths one at a time
+ */
+void uring_stat(struct uring *uring, char **paths, int count, struct stat *st_info, int *results, int follow);
+
+/*
+ * Copy up to URING_SLOTS files no bigger than URING_BUF_SIZE, each through
+ * a linked stat, open, open, read, write, close chain, with one system call
+ * for the whole batch
+ * The destination is created or truncated, its metadata is left alone
+ * A copy whose source doesn't hold exactly size bytes fails
+ * Returns 0 if the batch ran (each copy has its own result)
+ * Otherwise returns -1 and the copies are left to the caller
+ */
+int uring_copy(struct uring *uring, struct uring_copy *copies, int count);
+
+#endif
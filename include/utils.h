@@ -2,6 +2,17 @@
 #define UTILS_H
 
 #include <stddef.h>
+#include <sys/types.h>
+
+struct throttle;
+
+//directories on the way down from where a walk started, so a symbolic
+//link back up to one of them isn't followed forever (zeroed to start)
+struct walk {
+	dev_t	*devs; //device of each directory
+	ino_t	*inos; //inode of each directory
+	size_t	depth, capacity; //directories entered and room for them
+};
 
 /*
  * Join two strings together in a destination buffer
@@ -18,6 +29,11 @@ size_t mod_exp(size_t base, size_t exp, size_t mod);
  */
 void filename(char *result, char *path, size_t maxlen);
 
+/*
+ * Get the directory a path name is in ("." for a bare name)
+ */
+void parent_dir(char *result, char *path, size_t maxlen);
+
 /*
  * Get the relative file name of a full path compared to parent
  */
@@ -26,8 +42,9 @@ void relative(char *result, char *path, char *parent, size_t maxlen);
 /*
  * Copy the file stored at the r_fd file descriptor to the file
  * stored at the w_fd descriptor
+ * If throttle is not null, the copy is limited to its bandwidth
  */
-int copy(int w_fd, int r_fd, int bufsize);
+int copy(int w_fd, int r_fd, int bufsize, struct throttle *throttle);
 
 /*
  * Remove a file or directory recursively
@@ -44,4 +61,26 @@ int ascending(char *a, char *b);
  */
 int descending(char *a, char *b);
 
+/*
+ * Check if a directory is on the way down of a walk, by device and inode
+ */
+int in_walk(struct walk *walk, dev_t dev, ino_t ino);
+
+/*
+ * Enter a directory on a walk, by device and inode
+ * Returns 0 if it was entered, 1 if it is already on the way down
+ * Otherwise returns -1
+ */
+int enter_dir(struct walk *walk, dev_t dev, ino_t ino);
+
+/*
+ * Leave the directory entered last on a walk
+ */
+void leave_dir(struct walk *walk);
+
+/*
+ * Free the memory of a walk, which can be used again after
+ */
+void free_walk(struct walk *walk);
+
 #endif
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+
+//bytes paged out at a time
+#define TRIM_CHUNK (1024 * 1024)
+
+//bytes checked for residency, and at most paged out, per check
+#define TRIM_WINDOW (64UL * 1024 * 1024)
+
+/*
+ * Round a size up to its 16 byte class
+ */
+static size_t class_size(size_t size) {
+	return size < 16 ? 16 : (size + 15) & ~(size_t)15;
+}
+
+/*
+ * Map more of the file until size more bytes fit after the used part
+ * Returns 0 if they fit
+ * Otherwise returns -1
+ */
+static int grow(struct arena *arena, size_t size) {
+	while(arena->used + size > arena->mapped) {
+		if(arena->mapped + ARENA_GROW > ARENA_RESERVE || ftruncate(arena->fd, arena->mapped + ARENA_GROW) < 0)
+			return -1;
+
+		//the new part goes right after the old one, so nothing moves
+		void *ptr = mmap(arena->base + arena->mapped, ARENA_GROW, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, arena->fd, arena->mapped);
+		if(ptr == MAP_FAILED)
+			return -1;
+
+		//the new chunks haven't been seen resident yet
+		size_t chunks = (arena->mapped + ARENA_GROW) / TRIM_CHUNK;
+		unsigned short *counts = (unsigned short *)realloc(arena->counts, chunks * sizeof(unsigned short));
+		if(counts == 0)
+			return -1;
+		memset(counts + arena->mapped / TRIM_CHUNK, 0, (chunks - arena->mapped / TRIM_CHUNK) * sizeof(unsigned short));
+		arena->counts = counts;
+		arena->mapped += ARENA_GROW;
+	}
+	return 0;
+}
+
+/*
+ * Check the residency of the next window of the mapping, updating the
+ * counts of its chunks and the resident total
+ */
+static void refresh(struct arena *arena) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t offset = arena->scan;
+	size_t len = arena->mapped - offset < TRIM_WINDOW ? arena->mapped - offset : TRIM_WINDOW;
+	arena->scan = offset + len >= arena->mapped ? 0 : offset + len;
+	if(mincore(arena->base + offset, len, arena->vec) < 0)
+		return;
+
+	for(size_t chunk = offset / TRIM_CHUNK; chunk < (offset + len) / TRIM_CHUNK; chunk++) {
+		unsigned short count = 0;
+		for(size_t i = (chunk * TRIM_CHUNK - offset) / page; i < ((chunk + 1) * TRIM_CHUNK - offset) / page; i++)
+			count += arena->vec[i] & 1;
+		arena->resident = arena->resident - arena->counts[chunk] * page + count * page;
+		arena->counts[chunk] = count;
+	}
+}
+
+/*
+ * Write back and drop pages, starting where the last trim stopped,
+ * until half the budget is resident or a window has been gone through
+ * The resident total is only as fresh as the last pass of the checks
+ * over the mapping, so the cost of a check doesn't grow with the cache
+ */
+static void trim(struct arena *arena) {
+	if(arena->mapped == 0)
+		return;
+	refresh(arena);
+	if(arena->resident <= arena->budget)
+		return;
+
+	//leave room below the budget so this doesn't run on every check
+	size_t page = sysconf(_SC_PAGESIZE);
+	for(size_t done = 0; arena->resident > arena->budget / 2 && done < TRIM_WINDOW; done += TRIM_CHUNK) {
+		size_t chunk = arena->clock / TRIM_CHUNK;
+		arena->clock = arena->clock + TRIM_CHUNK >= arena->mapped ? 0 : arena->clock + TRIM_CHUNK;
+		if(arena->counts[chunk] == 0)
+			continue;
+
+		//without MADV_PAGEOUT the pages are only unmapped, and the
+		//kernel writes them back on its own
+		if(madvise(arena->base + chunk * TRIM_CHUNK, TRIM_CHUNK, MADV_PAGEOUT) < 0)
+			madvise(arena->base + chunk * TRIM_CHUNK, TRIM_CHUNK, MADV_DONTNEED);
+		arena->resident -= arena->counts[chunk] * page;
+		arena->counts[chunk] = 0;
+	}
+}
+
+struct arena *init_arena(char *dir, size_t budget) {
+	struct arena *arena = (struct arena *)calloc(1, sizeof(struct arena));
+	if(arena == 0)
+		return 0;
+	arena->budget = budget;
+
+	//an access pages in a few pages at most (bucket, node, name), so
+	//checking this often keeps the overshoot within the budget
+	arena->interval = budget / (4 * sysconf(_SC_PAGESIZE));
+	if(arena->interval == 0)
+		arena->interval = 1;
+	arena->base = MAP_FAILED;
+	if((arena->vec = (unsigned char *)malloc(TRIM_WINDOW / sysconf(_SC_PAGESIZE))) == 0) {
+		free(arena);
+		return 0;
+	}
+
+	//the file is never linked, so it goes away with the process
+	if((arena->fd = open(dir, O_TMPFILE | O_RDWR, 0600)) < 0) {
+		char path[4096];
+		snprintf(path, 4096, "%s/sentinel-cache-XXXXXX", dir);
+		if((arena->fd = mkstemp(path)) >= 0)
+			unlink(path);
+	}
+
+	//the whole range is reserved once so the file can grow under it
+	if(arena->fd >= 0)
+		arena->base = mmap(0, ARENA_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(arena->fd < 0 || arena->base == MAP_FAILED) {
+		free_arena(arena);
+		return 0;
+	}
+	return arena;
+}
+
+void free_arena(struct arena *arena) {
+	if(arena != 0) {
+		if(arena->base != MAP_FAILED)
+			munmap(arena->base, ARENA_RESERVE);
+		if(arena->fd >= 0)
+			close(arena->fd);
+		free(arena->counts);
+		free(arena->vec);
+		free(arena);
+	}
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+	size = class_size(size);
+
+	//reuse a freed block of the same class or size
+	void *ptr = 0;
+	if(size <= ARENA_SMALL) {
+		void **list = &arena->free_lists[size / 16 - 1];
+		if((ptr = *list) != 0)
+			*list = *(void **)ptr;
+	}
+	else {
+		for(struct arena_block **block = &arena->large; *block != 0; block = &(*block)->next) {
+			if((*block)->size == size) {
+				ptr = *block;
+				*block = (*block)->next;
+				break;
+			}
+		}
+	}
+	if(ptr != 0) {
+		memset(ptr, 0, size);
+		return ptr;
+	}
+
+	//new space in the file is already zero
+	if(grow(arena, size) < 0)
+		return 0;
+	ptr = arena->base + arena->used;
+	arena->used += size;
+	return ptr;
+}
+
+void arena_free(struct arena *arena, void *ptr, size_t size) {
+	if(ptr == 0)
+		return;
+
+	size = class_size(size);
+	if(size <= ARENA_SMALL) {
+		void **list = &arena->free_lists[size / 16 - 1];
+		*(void **)ptr = *list;
+		*list = ptr;
+	}
+	else {
+		struct arena_block *block = (struct arena_block *)ptr;
+		block->size = size;
+		block->next = arena->large;
+		arena->large = block;
+	}
+}
+
+char *arena_strdup(struct arena *arena, char *str) {
+	size_t len = strlen(str) + 1;
+	char *copy = (char *)arena_alloc(arena, len);
+	if(copy != 0)
+		memcpy(copy, str, len);
+	return copy;
+}
+
+void arena_touch(struct arena *arena) {
+	if(++arena->ops < arena->interval)
+		return;
+	arena->ops = 0;
+	trim(arena);
+}
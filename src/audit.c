@@ -0,0 +1,556 @@
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "audit.h"
+#include "saves.h"
+#include "snapshot.h"
+#include "stats.h"
+
+//ioprio_set has no wrapper, these are from linux/ioprio.h
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+//time between saves of the audit's place
+#define SAVE_INTERVAL 10000000000LL
+
+/*
+ * Put the calling thread's reads behind everyone else's
+ */
+static void lower_priority() {
+	//0 is the calling thread
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+}
+
+/*
+ * Wait until the audit is idle or stopping, the lock must be held
+ * Returns 0 once it is idle
+ * Otherwise returns -1 if it is stopping
+ */
+static int wait_idle(struct audit *audit) {
+	while(!audit->idle && !audit->stop)
+		pthread_cond_wait(&audit->ready, &audit->lock);
+	return audit->stop ? -1 : 0;
+}
+
+/*
+ * Write the audit's place to its progress file, replacing the old one
+ * in one step so a crash leaves one or the other, the lock must be held
+ */
+static void save_progress(struct audit *audit) {
+	audit->saved = now_ns();
+	if(audit->progress_path == 0)
+		return;
+
+	char tmp[4096];
+	snprintf(tmp, 4096, "%s.tmp", audit->progress_path);
+	FILE *file = fopen(tmp, "w");
+	if(file == 0) {
+		fprintf(stderr, "Error in audit - Couldn't write file: %s\n", tmp);
+		return;
+	}
+
+	//the destination is saved too, so a changed config starts over
+	char *dest = audit->root < audit->root_count ? audit->roots[audit->root].dest : "";
+	fprintf(file, "%ld\t%d\t%s\t%s\n", audit->next, audit->root, dest, audit->cursor);
+	if(fclose(file) != 0 || rename(tmp, audit->progress_path) < 0)
+		fprintf(stderr, "Error in audit - Couldn't write file: %s\n", audit->progress_path);
+}
+
+/*
+ * Read the audit's place from its progress file, before the roots are added
+ * the root is only checked once they are
+ */
+static void load_progress(struct audit *audit, char *dest) {
+	char line[8192];
+	FILE *file = fopen(audit->progress_path, "r");
+	if(file == 0)
+		return;
+
+	if(fgets(line, 8192, file) != 0) {
+		line[strcspn(line, "\n")] = 0;
+		char *next = strtok(line, "\t");
+		char *root = strtok(0, "\t");
+		char *saved_dest = strtok(0, "\t");
+		char *cursor = strtok(0, "\t");
+		if(next != 0 && root != 0 && saved_dest != 0) {
+			audit->next = atol(next);
+			audit->root = atoi(root);
+			strncpy(dest, saved_dest, 4095);
+			strncpy(audit->cursor, cursor != 0 ? cursor : "", 4095);
+		}
+	}
+	fclose(file);
+}
+
+/*
+ * Add drift to be repaired, the lock must be held
+ */
+static void add_drift(struct audit *audit, char *path, enum drift_kind kind) {
+	struct drift *drift = (struct drift *)calloc(1, sizeof(struct drift));
+	if(drift == 0 || (drift->path = strndup(path, 4096)) == 0) {
+		fprintf(stderr, "Error in audit - Couldn't record drift: %s\n", path);
+		if(drift != 0)
+			free(drift);
+		return;
+	}
+	drift->root = audit->root;
+	drift->kind = kind;
+	if(audit->tail == 0)
+		audit->head = drift;
+	else
+		audit->tail->next = drift;
+	audit->tail = drift;
+	audit->drifted++;
+}
+
+/*
+ * Compare the content of two files of the same size a chunk at a time,
+ * pausing between chunks while the audit isn't idle
+ * Returns 1 if they differ
+ * Otherwise returns 0 if they match or the audit stopped, and -1 if
+ * the source couldn't be read
+ */
+static int compare_content(struct audit *audit, char *src, char *dest, char *buf) {
+	int src_fd, dest_fd;
+	if((src_fd = open(src, O_RDONLY | O_NOATIME)) < 0 && (src_fd = open(src, O_RDONLY)) < 0)
+		return -1;
+	if((dest_fd = open(dest, O_RDONLY | O_NOATIME)) < 0 && (dest_fd = open(dest, O_RDONLY)) < 0) {
+		close(src_fd);
+		return 1;
+	}
+
+	//the pages aren't needed again, so they're dropped as they're
+	//compared instead of pushing out ones that are
+	posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(dest_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	int result = 0;
+	for(off_t offset = 0;; offset += AUDIT_CHUNK) {
+		pthread_mutex_lock(&audit->lock);
+		int stopped = wait_idle(audit);
+		pthread_mutex_unlock(&audit->lock);
+		if(stopped < 0)
+			break;
+
+		ssize_t n = pread(src_fd, buf, AUDIT_CHUNK, offset);
+		ssize_t m = pread(dest_fd, buf + AUDIT_CHUNK, AUDIT_CHUNK, offset);
+		if(n < 0) {
+			result = -1;
+			break;
+		}
+
+		//glibc's memcmp already compares a vector at a time
+		if(m != n || memcmp(buf, buf + AUDIT_CHUNK, n) != 0) {
+			result = 1;
+			break;
+		}
+		posix_fadvise(src_fd, offset, n, POSIX_FADV_DONTNEED);
+		posix_fadvise(dest_fd, offset, n, POSIX_FADV_DONTNEED);
+		if(n < AUDIT_CHUNK)
+			break;
+	}
+	close(src_fd);
+	close(dest_fd);
+	return result;
+}
+
+/*
+ * Compare the files of batches as they are handed out until the audit stops
+ */
+static void *compare_files(void *arg) {
+	struct audit *audit = (struct audit *)arg;
+	char src[4096], dest[4096];
+	lower_priority();
+
+	//one chunk of each file
+	char *buf = (char *)malloc(2 * AUDIT_CHUNK);
+	if(buf == 0)
+		return 0;
+
+	pthread_mutex_lock(&audit->lock);
+	while(!audit->stop) {
+		if(audit->batch_next == audit->batch_count) {
+			pthread_cond_wait(&audit->ready, &audit->lock);
+			continue;
+		}
+
+		//the root doesn't change until the batch is finished
+		int i = audit->batch_next++;
+		struct audit_root *root = &audit->roots[audit->root];
+		snprintf(src, 4096, "%s/%s", root->src, audit->batch[i]);
+		snprintf(dest, 4096, "%s/%s", root->dest, audit->batch[i]);
+		pthread_mutex_unlock(&audit->lock);
+
+		int differs = compare_content(audit, src, dest, buf);
+
+		pthread_mutex_lock(&audit->lock);
+		audit->differs[i] = differs > 0;
+		audit->batch_left--;
+		pthread_cond_broadcast(&audit->done);
+	}
+	pthread_mutex_unlock(&audit->lock);
+	free(buf);
+	return 0;
+}
+
+/*
+ * Hand the batch to the content threads and wait for them to finish it,
+ * then record what differs and where the pass got to
+ * Returns 0 if the batch was compared
+ * Otherwise returns -1 if the audit stopped
+ */
+static int flush_batch(struct audit *audit, char *path) {
+	pthread_mutex_lock(&audit->lock);
+	audit->batch_next = 0;
+	audit->batch_count = audit->batch_left = audit->batch_fill;
+	pthread_cond_broadcast(&audit->ready);
+	while(audit->batch_left > 0 && !audit->stop)
+		pthread_cond_wait(&audit->done, &audit->lock);
+
+	int result = audit->stop ? -1 : 0;
+	for(int i = 0; i < audit->batch_count; i++) {
+		if(result == 0 && audit->differs[i])
+			add_drift(audit, audit->batch[i], DRIFT_COPY);
+		free(audit->batch[i]);
+	}
+	audit->checked += audit->batch_count;
+	audit->batch_fill = audit->batch_count = audit->batch_next = 0;
+
+	//everything up to path was compared
+	if(result == 0) {
+		if(path != audit->cursor)
+			strncpy(audit->cursor, path, 4095);
+		if(now_ns() - audit->saved > SAVE_INTERVAL)
+			save_progress(audit);
+	}
+	pthread_mutex_unlock(&audit->lock);
+	return result;
+}
+
+/*
+ * Check if two symbolic links point to the same place
+ */
+static int same_link(char *a, char *b) {
+	char target_a[4096], target_b[4096];
+	ssize_t n = readlink(a, target_a, 4096);
+	ssize_t m = readlink(b, target_b, 4096);
+	return n >= 0 && n == m && memcmp(target_a, target_b, n) == 0;
+}
+
+/*
+ * Sort directory entries by name, which walks a tree in snapshot order
+ */
+static int by_name(const struct dirent **a, const struct dirent **b) {
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/*
+ * Skip the current and parent directories and editor temp files
+ */
+static int listed(const struct dirent *ep) {
+	return strcmp(ep->d_name, ".") != 0 && strcmp(ep->d_name, "..") != 0 && !is_temp_file((char *)ep->d_name);
+}
+
+/*
+ * Compare one directory of a root with its destination and everything
+ * under it, skipping what the pass already compared
+ * Returns 0 if the directory was compared
+ * Otherwise returns -1 if the audit stopped
+ */
+static int audit_dir(struct audit *audit, char *path) {
+	struct audit_root *root = &audit->roots[audit->root];
+	char src[8192], dest[8192];
+	struct dirent **src_names = 0, **dest_names = 0;
+	snprintf(src, 8192, "%s/%s", root->src, path);
+	snprintf(dest, 8192, "%s/%s", root->dest, path);
+
+	//a source directory that can't be read is left alone, a missing
+	//destination one was just scheduled to be made
+	int src_count = scandir(src, &src_names, listed, by_name);
+	if(src_count < 0)
+		return 0;
+	int dest_count = scandir(dest, &dest_names, listed, by_name);
+	if(dest_count < 0)
+		dest_count = 0;
+
+	//both lists are sorted, so they're merged in one pass
+	int result = 0, i = 0, j = 0;
+	while(result == 0 && (i < src_count || j < dest_count)) {
+		int c = i == src_count ? 1 : j == dest_count ? -1 : strcmp(src_names[i]->d_name, dest_names[j]->d_name);
+		char *name = c <= 0 ? src_names[i]->d_name : dest_names[j]->d_name;
+		char rel[4096];
+		snprintf(rel, 4096, "%s%s%s", path, *path != 0 ? "/" : "", name);
+		snprintf(src, 8192, "%s/%s", root->src, rel);
+		snprintf(dest, 8192, "%s/%s", root->dest, rel);
+		if(c <= 0)
+			i++;
+		if(c >= 0)
+			j++;
+
+		//compared already, or a directory the pass stopped in
+		size_t len = strlen(rel);
+		int done = audit->cursor[0] != 0 && compare_paths(rel, audit->cursor) <= 0;
+		int inside = done && strncmp(audit->cursor, rel, len) == 0 && audit->cursor[len] == '/';
+		if(done && !inside)
+			continue;
+
+		pthread_mutex_lock(&audit->lock);
+		result = wait_idle(audit);
+		pthread_mutex_unlock(&audit->lock);
+		if(result < 0)
+			break;
+
+		struct stat src_info, dest_info;
+		int src_ok = c <= 0 && ((audit->follow && stat(src, &src_info) == 0) || lstat(src, &src_info) == 0);
+		int dest_ok = c >= 0 && lstat(dest, &dest_info) == 0;
+
+		//only regular files, directories and links are synced, and
+		//never a link back up to a directory above
+		if(src_ok && !S_ISREG(src_info.st_mode) && !S_ISDIR(src_info.st_mode) && !S_ISLNK(src_info.st_mode))
+			continue;
+		if(src_ok && S_ISDIR(src_info.st_mode) && in_walk(&audit->dirs, src_info.st_dev, src_info.st_ino))
+			continue;
+
+		pthread_mutex_lock(&audit->lock);
+		if(!src_ok) {
+			if(dest_ok && !done)
+				add_drift(audit, rel, DRIFT_DELETE);
+			pthread_mutex_unlock(&audit->lock);
+			continue;
+		}
+		if(dest_ok && (src_info.st_mode & S_IFMT) != (dest_info.st_mode & S_IFMT)) {
+			add_drift(audit, rel, DRIFT_DELETE);
+			dest_ok = 0;
+		}
+		if(!done && !dest_ok)
+			add_drift(audit, rel, DRIFT_COPY);
+		else if(!done && S_ISLNK(src_info.st_mode) && !same_link(src, dest))
+			add_drift(audit, rel, DRIFT_COPY);
+		else if(!done && ((src_info.st_mode & 07777) != (dest_info.st_mode & 07777) ||
+			(geteuid() == 0 && (src_info.st_uid != dest_info.st_uid || src_info.st_gid != dest_info.st_gid)))) {
+			add_drift(audit, rel, DRIFT_META);
+		}
+		pthread_mutex_unlock(&audit->lock);
+
+		if(S_ISDIR(src_info.st_mode)) {
+			if((result = enter_dir(&audit->dirs, src_info.st_dev, src_info.st_ino)) == 0) {
+				result = audit_dir(audit, rel);
+				leave_dir(&audit->dirs);
+			}
+			continue;
+		}
+		if(S_ISLNK(src_info.st_mode))
+			continue;
+
+		//copies keep the source's mtime, so a file with the same size
+		//and mtime should have the same content
+		if(!dest_ok || src_info.st_size != dest_info.st_size || src_info.st_mtime != dest_info.st_mtime) {
+			if(dest_ok) {
+				pthread_mutex_lock(&audit->lock);
+				add_drift(audit, rel, DRIFT_COPY);
+				pthread_mutex_unlock(&audit->lock);
+			}
+			continue;
+		}
+		if((audit->batch[audit->batch_fill] = strndup(rel, 4096)) == 0)
+			continue;
+		if(++audit->batch_fill == AUDIT_BATCH)
+			result = flush_batch(audit, rel);
+	}
+
+	for(int k = 0; k < src_count; k++)
+		free(src_names[k]);
+	for(int k = 0; k < dest_count; k++)
+		free(dest_names[k]);
+	if(src_names != 0)
+		free(src_names);
+	if(dest_names != 0)
+		free(dest_names);
+	return result;
+}
+
+/*
+ * Run passes over every root while the audit is idle until it stops
+ */
+static void *walk_roots(void *arg) {
+	struct audit *audit = (struct audit *)arg;
+	lower_priority();
+
+	pthread_mutex_lock(&audit->lock);
+	while(!audit->stop) {
+		//the time is checked again every second
+		if(!audit->idle || time(0) < audit->next) {
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec++;
+			pthread_cond_timedwait(&audit->ready, &audit->lock, &until);
+			continue;
+		}
+		if(audit->root >= audit->root_count) {
+			audit->root = 0;
+			audit->cursor[0] = 0;
+			audit->checked = audit->drifted = 0;
+		}
+		pthread_mutex_unlock(&audit->lock);
+
+		struct stat st_info;
+		int result = 0;
+		if(stat(audit->roots[audit->root].src, &st_info) == 0 && (result = enter_dir(&audit->dirs, st_info.st_dev, st_info.st_ino)) == 0) {
+			result = audit_dir(audit, "");
+			leave_dir(&audit->dirs);
+		}
+		if(result == 0 && audit->batch_fill > 0)
+			result = flush_batch(audit, audit->cursor);
+
+		pthread_mutex_lock(&audit->lock);
+		if(result < 0)
+			break;
+		printf("Audited %s -> %s (%lu files compared, %lu drifted).\n", audit->roots[audit->root].src, audit->roots[audit->root].dest, audit->checked, audit->drifted);
+		audit->checked = audit->drifted = 0;
+		audit->cursor[0] = 0;
+
+		//the next pass is counted from the end of this one
+		if(++audit->root == audit->root_count)
+			audit->next = time(0) + audit->interval;
+		save_progress(audit);
+	}
+
+	//a pass cut short starts from the last finished batch next time
+	for(int i = 0; i < audit->batch_fill; i++)
+		free(audit->batch[i]);
+	audit->batch_fill = 0;
+	pthread_mutex_unlock(&audit->lock);
+	return 0;
+}
+
+struct audit *init_audit(double hours, char *progress_path, int threads) {
+	struct audit *audit = (struct audit *)calloc(1, sizeof(struct audit));
+	if(audit == 0)
+		return 0;
+
+	audit->interval = hours * 3600;
+	audit->count = threads < 1 ? 1 : threads;
+	audit->threads = (pthread_t *)calloc(audit->count, sizeof(pthread_t));
+	if(audit->threads == 0 || (progress_path != 0 && (audit->progress_path = strndup(progress_path, 4096)) == 0)) {
+		free_audit(audit);
+		return 0;
+	}
+	pthread_mutex_init(&audit->lock, 0);
+	pthread_cond_init(&audit->ready, 0);
+	pthread_cond_init(&audit->done, 0);
+
+	//the destinations were just migrated, so the first pass waits a full interval
+	audit->next = time(0) + audit->interval;
+	return audit;
+}
+
+void free_audit(struct audit *audit) {
+	if(audit == 0)
+		return;
+
+	if(audit->started) {
+		pthread_mutex_lock(&audit->lock);
+		audit->stop = 1;
+		pthread_cond_broadcast(&audit->ready);
+		pthread_cond_broadcast(&audit->done);
+		pthread_mutex_unlock(&audit->lock);
+		pthread_join(audit->walker, 0);
+		for(int i = 0; i < audit->count; i++)
+			pthread_join(audit->threads[i], 0);
+		save_progress(audit);
+	}
+
+	free_drift(audit->head);
+	for(int i = 0; i < audit->root_count; i++) {
+		free(audit->roots[i].src);
+		free(audit->roots[i].dest);
+	}
+	if(audit->roots != 0)
+		free(audit->roots);
+	if(audit->threads != 0)
+		free(audit->threads);
+	if(audit->progress_path != 0)
+		free(audit->progress_path);
+	free_walk(&audit->dirs);
+	free(audit);
+}
+
+int add_audit_root(struct audit *audit, char *src, char *dest, int pair, int target) {
+	struct audit_root *roots = (struct audit_root *)realloc(audit->roots, (audit->root_count + 1) * sizeof(struct audit_root));
+	if(roots == 0)
+		return -1;
+	audit->roots = roots;
+
+	struct audit_root *root = &roots[audit->root_count];
+	root->src = strndup(src, 4096);
+	root->dest = strndup(dest, 4096);
+	if(root->src == 0 || root->dest == 0) {
+		if(root->src != 0)
+			free(root->src);
+		if(root->dest != 0)
+			free(root->dest);
+		return -1;
+	}
+	root->pair = pair;
+	root->target = target;
+	return audit->root_count++;
+}
+
+int start_audit(struct audit *audit) {
+	//a saved place only counts if it is in the same root
+	if(audit->progress_path != 0) {
+		char dest[4096];
+		memset(dest, 0, 4096);
+		load_progress(audit, dest);
+		if(audit->root >= audit->root_count || strcmp(dest, audit->roots[audit->root].dest) != 0) {
+			audit->root = 0;
+			audit->cursor[0] = 0;
+		}
+	}
+
+	int count = 0;
+	if(pthread_create(&audit->walker, 0, walk_roots, audit) != 0)
+		return -1;
+	for(; count < audit->count; count++) {
+		if(pthread_create(&audit->threads[count], 0, compare_files, audit) != 0)
+			break;
+	}
+	audit->count = count;
+	audit->started = 1;
+	return count > 0 ? 0 : -1;
+}
+
+void set_idle(struct audit *audit, int idle) {
+	pthread_mutex_lock(&audit->lock);
+	if(idle != audit->idle) {
+		audit->idle = idle;
+		pthread_cond_broadcast(&audit->ready);
+	}
+	pthread_mutex_unlock(&audit->lock);
+}
+
+struct drift *take_drift(struct audit *audit) {
+	pthread_mutex_lock(&audit->lock);
+	struct drift *drift = audit->head;
+	audit->head = audit->tail = 0;
+	pthread_mutex_unlock(&audit->lock);
+	return drift;
+}
+
+void free_drift(struct drift *drift) {
+	while(drift != 0) {
+		struct drift *next = drift->next;
+		free(drift->path);
+		free(drift);
+		drift = next;
+	}
+}
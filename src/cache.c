@@ -8,20 +8,20 @@
 #include <stdio.h>
 
 #include "cache.h"
+#include "arena.h"
+#include "list.h"
 #include "utils.h"
 
 struct filenode *init_filenode(char *filename) {
-	int fd, st_res; //results for system calls
 	struct stat st_info; //stat info
 	
-	if((fd = open(filename, O_RDONLY)) < 0)
+	if(lstat(filename, &st_info) < 0)
 		return 0;
-	
-	if((st_res = fstat(fd, &st_info)) < 0) {
-		close(fd);
-		return 0;
-	}
 
+	return stat_filenode(filename, &st_info);
+}
+
+struct filenode *stat_filenode(char *filename, struct stat *st_info) {
 	//create the filenode
 	struct filenode *node = (struct filenode *)malloc(sizeof(struct filenode));
 	if(node == 0)
@@ -35,17 +35,29 @@ struct filenode *init_filenode(char *filename) {
 	}
 
 	//copy data to filenode struct
-	node->last_modify_time = st_info.st_mtime;
-	node->size = st_info.st_size;
-	if(S_ISREG(st_info.st_mode))
+	node->last_modify_time = st_info->st_mtim.tv_sec * 1000000000LL + st_info->st_mtim.tv_nsec;
+	node->size = st_info->st_size;
+	node->change_time = st_info->st_ctime;
+	node->mode = st_info->st_mode;
+	node->ino = st_info->st_ino;
+	node->dev = st_info->st_dev;
+	if(S_ISREG(st_info->st_mode))
 		node->type = FILE_TYPE_FILE;
-	else if(S_ISDIR(st_info.st_mode))
+	else if(S_ISDIR(st_info->st_mode))
 		node->type = FILE_TYPE_DIR;	
+	else if(S_ISLNK(st_info->st_mode))
+		node->type = FILE_TYPE_LINK;
+	node->from_index = 0;
+	node->detected = 0;
+	node->synced_size = 0;
+	node->synced_tail = 0;
+	node->synced_hash = 0;
+	node->generation = 0;
+	node->dir_mtime = 0;
+	node->children = 0;
+	node->next_scan = node->interval = 0;
 	node->next = 0;
 
-	//cleanup
-	close(fd);
-
 	return node;
 }
 
@@ -55,6 +67,8 @@ void free_node(struct filenode *node) {
 		//check if the filename is not null
 		if(node->filename != 0)
 			free(node->filename);
+		if(node->children != 0)
+			free_list(node->children);
 		free(node);
 	}
 }
@@ -68,6 +82,8 @@ struct cache *init_cache(size_t initial_capacity) {
 
 	//initialize cache
 	cache->capacity = initial_capacity;
+	cache->arena = 0;
+	cache->count = 0;
 	cache->values = (struct filenode **)malloc(initial_capacity * sizeof(struct filenode *));
 	
 	//check if hash table malloc didn't work
@@ -81,7 +97,91 @@ struct cache *init_cache(size_t initial_capacity) {
 	return cache;
 }
 
+struct cache *init_arena_cache(size_t initial_capacity, struct arena *arena) {
+	struct cache *cache = (struct cache *)calloc(1, sizeof(struct cache));
+	if(cache == 0)
+		return 0;
+
+	//the arena's memory is already zero
+	cache->capacity = initial_capacity;
+	cache->arena = arena;
+	cache->values = (struct filenode **)arena_alloc(arena, initial_capacity * sizeof(struct filenode *));
+	if(cache->values == 0) {
+		free(cache);
+		return 0;
+	}
+	return cache;
+}
+
+/*
+ * Bytes an arena copy of a list takes, with its values and names packed after it
+ */
+static size_t children_size(struct list *list) {
+	size_t size = sizeof(struct list) + list->length * sizeof(char *);
+	for(size_t i = 0; i < list->length; i++)
+		size += strlen(list->values[i]) + 1;
+	return size;
+}
+
+/*
+ * Free a directory's entries from wherever the cache keeps them
+ */
+static void free_children(struct cache *cache, struct list *children) {
+	if(children == 0)
+		return;
+	if(cache->arena != 0)
+		arena_free(cache->arena, children, children_size(children));
+	else
+		free_list(children);
+}
+
+void discard_node(struct cache *cache, struct filenode *node) {
+	if(node == 0)
+		return;
+	if(cache->arena == 0) {
+		free_node(node);
+		return;
+	}
+
+	free_children(cache, node->children);
+	arena_free(cache->arena, node->filename, strlen(node->filename) + 1);
+	arena_free(cache->arena, node, sizeof(struct filenode));
+	cache->count--;
+}
+
+int set_children(struct cache *cache, struct filenode *node, struct list *children) {
+	struct list *copy = children;
+
+	//one block holds the list, its values and the names
+	if(cache->arena != 0) {
+		if((copy = (struct list *)arena_alloc(cache->arena, children_size(children))) == 0) {
+			free_list(children);
+			return -1;
+		}
+		copy->length = copy->capacity = children->length;
+		copy->values = (char **)(copy + 1);
+		char *name = (char *)(copy->values + children->length);
+		for(size_t i = 0; i < children->length; i++) {
+			size_t len = strlen(children->values[i]) + 1;
+			memcpy(name, children->values[i], len);
+			copy->values[i] = name;
+			name += len;
+		}
+		free_list(children);
+	}
+
+	free_children(cache, node->children);
+	node->children = copy;
+	return 0;
+}
+
 void free_cache(struct cache *cache) {
+	//an arena's memory goes away with the arena
+	if(cache != 0 && cache->arena != 0) {
+		free(cache);
+		return;
+	}
+
 	//free the cache and its hash table if they are not null
 	if(cache != 0) {
 		if(cache->values != 0) {
@@ -105,6 +205,15 @@ void free_cache(struct cache *cache) {
 }
 
 size_t hash(struct cache *cache, char *filename) {
+	//an arena's table is rehashed as it grows, which needs a cheaper
+	//hash (FNV-1a)
+	if(cache->arena != 0) {
+		size_t hash = 14695981039346656037UL;
+		for(unsigned char *ptr = (unsigned char *)filename; *ptr != 0; ptr++)
+			hash = (hash ^ *ptr) * 1099511628211UL;
+		return hash % cache->capacity;
+	}
+
 	//this is a rolling polynomial hash function
 	long p = 67;
 	long i = 0;
@@ -115,22 +224,92 @@ size_t hash(struct cache *cache, char *filename) {
 }
 
 int insert(struct cache *cache, char *filename) {
-	//create key and value
-	size_t h = hash(cache, filename);
-	struct filenode *filenode = init_filenode(filename);
+	return insert_node(cache, init_filenode(filename));
+}
+
+int insert_stat(struct cache *cache, char *filename, struct stat *st_info) {
+	return insert_node(cache, stat_filenode(filename, st_info));
+}
+
+/*
+ * Double an arena cache's table, moving every entry to its new bucket
+ * Returns 0 if the table grew
+ * Otherwise returns -1
+ */
+static int grow_cache(struct cache *cache) {
+	size_t capacity = cache->capacity * 2;
+	struct filenode **values = (struct filenode **)arena_alloc(cache->arena, capacity * sizeof(struct filenode *));
+	if(values == 0)
+		return -1;
 
+	struct filenode **old = cache->values;
+	size_t old_capacity = cache->capacity;
+	cache->values = values;
+	cache->capacity = capacity;
+	for(size_t i = 0; i < old_capacity; i++) {
+		struct filenode *ptr = old[i];
+		while(ptr != 0) {
+			struct filenode *tmp = ptr->next;
+			size_t h = hash(cache, ptr->filename);
+			ptr->next = values[h];
+			values[h] = ptr;
+			ptr = tmp;
+		}
+	}
+	arena_free(cache->arena, old, old_capacity * sizeof(struct filenode *));
+	return 0;
+}
+
+/*
+ * Move a new filenode from the heap into a cache's arena and link it in
+ * Returns 0 if the node was inserted
+ * Otherwise returns -1
+ */
+static int insert_arena(struct cache *cache, struct filenode *filenode) {
+	struct filenode *node = (struct filenode *)arena_alloc(cache->arena, sizeof(struct filenode));
+	char *name = arena_strdup(cache->arena, filenode->filename);
+	if(node == 0 || name == 0 || (cache->count >= cache->capacity && grow_cache(cache) < 0)) {
+		arena_free(cache->arena, node, sizeof(struct filenode));
+		if(name != 0)
+			arena_free(cache->arena, name, strlen(name) + 1);
+		free_node(filenode);
+		return -1;
+	}
+	*node = *filenode;
+	node->filename = name;
+	node->children = 0;
+	free_node(filenode);
+
+	//order within a bucket doesn't matter, so new entries go first
+	size_t h = hash(cache, name);
+	node->next = cache->values[h];
+	cache->values[h] = node;
+	cache->count++;
+	return 0;
+}
+
+int insert_node(struct cache *cache, struct filenode *filenode) {
 	//indicate failure if we couldn't create the node
 	if(filenode == 0)
 		return -1;
 
+	//create key
+	char *filename = filenode->filename;
+	size_t h = hash(cache, filename);
+
 	//there is already an entry for the key filename
 	struct filenode *existing = get(cache, filename);
 	if(existing != 0) {
 		existing->last_modify_time = filenode->last_modify_time;
 		existing->size = filenode->size;
+		existing->change_time = filenode->change_time;
+		existing->mode = filenode->mode;
+		existing->ino = filenode->ino;
 		free_node(filenode);
 		return 0;
 	}
+	if(cache->arena != 0)
+		return insert_arena(cache, filenode);
 
 	//there is not an entry for the key filename
 	struct filenode *ptr, *prev;
@@ -154,6 +333,9 @@ int insert(struct cache *cache, char *filename) {
 }
 
 struct filenode *get(struct cache *cache, char *filename) {
+	if(cache->arena != 0)
+		arena_touch(cache->arena);
+
 	//index into the hash table
 	size_t h = hash(cache, filename);
 
@@ -195,6 +377,6 @@ int delete(struct cache *cache, char *filename) {
 	else
 		prev->next = ptr->next;
 
-	free_node(ptr);
+	discard_node(cache, ptr);
 	return 0;
 }
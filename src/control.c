@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "stats.h"
+
+/*
+ * Write a line to a client, which may be gone already
+ */
+static void reply(struct waiter *waiter, char *line) {
+	send(waiter->fd, line, strlen(line), MSG_NOSIGNAL);
+}
+
+/*
+ * Close a client's connection and free it
+ */
+static void drop_waiter(struct control *control, struct waiter *waiter) {
+	for(struct waiter **ptr = &control->waiters; *ptr != 0; ptr = &(*ptr)->next) {
+		if(*ptr == waiter) {
+			*ptr = waiter->next;
+			break;
+		}
+	}
+	close(waiter->fd);
+	free(waiter);
+}
+
+/*
+ * Read what a client sent, acting on a full command
+ * Returns 1 if the client asked to wait, 0 if it didn't (yet)
+ * Otherwise returns -1 if the client is gone or sent something else
+ */
+static int read_command(struct waiter *waiter, unsigned long scan) {
+	//a client that already asked only ever closes the connection
+	if(waiter->asked) {
+		char buf[CONTROL_LINE];
+		ssize_t n = read(waiter->fd, buf, CONTROL_LINE);
+		return n > 0 || (n < 0 && errno == EINTR) ? 0 : -1;
+	}
+
+	ssize_t n = read(waiter->fd, waiter->line + waiter->len, CONTROL_LINE - 1 - waiter->len);
+	if(n <= 0)
+		return n < 0 && errno == EINTR ? 0 : -1;
+	waiter->len += n;
+	waiter->line[waiter->len] = 0;
+	char *end = strchr(waiter->line, '\n');
+	if(end == 0)
+		return waiter->len == CONTROL_LINE - 1 ? -1 : 0;
+	*end = 0;
+	if(end > waiter->line && end[-1] == '\r')
+		end[-1] = 0;
+
+	if(strcmp(waiter->line, "WAIT") != 0) {
+		reply(waiter, "ERR unknown command\n");
+		return -1;
+	}
+	waiter->asked = 1;
+	waiter->since = now_ns();
+	waiter->scan = scan;
+	return 1;
+}
+
+struct control *init_control(char *path) {
+	struct sockaddr_un addr;
+	struct control *control = (struct control *)calloc(1, sizeof(struct control));
+	if(control == 0)
+		return 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	//a socket left by a sentinel that didn't exit cleanly is replaced,
+	//and only the owner can connect to the new one
+	control->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	unlink(path);
+	mode_t mask = umask(0177);
+	int bound = control->fd >= 0 ? bind(control->fd, (struct sockaddr *)&addr, sizeof(addr)) : -1;
+	umask(mask);
+	if(bound < 0 || listen(control->fd, 16) < 0 ||
+		(control->path = strndup(path, 4096)) == 0) {
+		fprintf(stderr, "Error in control - Couldn't listen on socket: %s\n", path);
+		free_control(control);
+		return 0;
+	}
+	return control;
+}
+
+void free_control(struct control *control) {
+	if(control != 0) {
+		while(control->waiters != 0)
+			drop_waiter(control, control->waiters);
+		if(control->fd >= 0)
+			close(control->fd);
+		if(control->path != 0) {
+			unlink(control->path);
+			free(control->path);
+		}
+		free(control);
+	}
+}
+
+int poll_control(struct control *control, int timeout, unsigned long scan) {
+	if(control == 0) {
+		if(timeout > 0)
+			poll(0, 0, timeout);
+		return 0;
+	}
+
+	//the listening socket goes first, then every client
+	size_t count = 1;
+	for(struct waiter *ptr = control->waiters; ptr != 0; ptr = ptr->next)
+		count++;
+	struct pollfd *fds = (struct pollfd *)malloc(count * sizeof(struct pollfd));
+	if(fds == 0) {
+		poll(0, 0, timeout);
+		return 0;
+	}
+	fds[0].fd = control->fd;
+	fds[0].events = POLLIN;
+	size_t i = 1;
+	for(struct waiter *ptr = control->waiters; ptr != 0; ptr = ptr->next, i++) {
+		fds[i].fd = ptr->fd;
+		fds[i].events = POLLIN;
+	}
+
+	int asked = 0;
+	if(poll(fds, count, timeout) > 0) {
+		//clients are matched to their slots before new ones are added
+		struct waiter *ptr = control->waiters;
+		for(i = 1; i < count; i++) {
+			struct waiter *waiter = ptr;
+			ptr = ptr->next;
+			if(fds[i].revents == 0)
+				continue;
+			int result = read_command(waiter, scan);
+			if(result < 0)
+				drop_waiter(control, waiter);
+			else
+				asked += result;
+		}
+
+		if(fds[0].revents & POLLIN) {
+			int fd = accept4(control->fd, 0, 0, SOCK_CLOEXEC);
+			struct waiter *waiter = fd >= 0 ? (struct waiter *)calloc(1, sizeof(struct waiter)) : 0;
+			if(waiter != 0) {
+				waiter->fd = fd;
+				waiter->next = control->waiters;
+				control->waiters = waiter;
+			}
+			else if(fd >= 0)
+				close(fd);
+		}
+	}
+	free(fds);
+	return asked;
+}
+
+void answer_waiters(struct control *control, unsigned long scans, unsigned long seq, unsigned long oldest, long long held, unsigned long failed) {
+	if(control == 0)
+		return;
+
+	struct waiter *ptr = control->waiters;
+	while(ptr != 0) {
+		struct waiter *waiter = ptr;
+		ptr = ptr->next;
+		if(!waiter->asked)
+			continue;
+
+		//a job that failed after the client asked counts against it
+		//unless it was queued after the client's scan
+		if(failed != 0 && (!waiter->queued || failed <= waiter->seq))
+			waiter->failed = 1;
+		if(scans < waiter->scan)
+			continue;
+
+		//the jobs for what the scan found are the ones queued up to now
+		if(!waiter->queued) {
+			waiter->queued = 1;
+			waiter->seq = seq;
+		}
+
+		//newer jobs don't hold a client up, a deletion held back from
+		//before it asked does
+		if((oldest != 0 && oldest <= waiter->seq) || (held != 0 && held <= waiter->since))
+			continue;
+		char line[64];
+		snprintf(line, 64, "%s %lu\n", waiter->failed ? "ERR" : "OK", scans);
+		reply(waiter, line);
+		drop_waiter(control, waiter);
+	}
+}
+
+int wait_sync(char *path) {
+	struct sockaddr_un addr;
+	char line[CONTROL_LINE];
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Error in control - Couldn't connect to socket: %s\n", path);
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if(send(fd, "WAIT\n", 5, MSG_NOSIGNAL) != 5) {
+		fprintf(stderr, "Error in control - Couldn't send command: %s\n", path);
+		close(fd);
+		return -1;
+	}
+
+	//the answer only comes once everything is synced
+	size_t len = 0;
+	ssize_t n;
+	while(len < CONTROL_LINE - 1 && (n = read(fd, line + len, CONTROL_LINE - 1 - len)) != 0) {
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0)
+			break;
+		len += n;
+		if(memchr(line, '\n', len) != 0)
+			break;
+	}
+	close(fd);
+	line[len] = 0;
+
+	unsigned long scan;
+	if(sscanf(line, "ERR %lu", &scan) == 1) {
+		fprintf(stderr, "Error in control - Some changes couldn't be synced by scan %lu: %s\n", scan, path);
+		return -1;
+	}
+	if(sscanf(line, "OK %lu", &scan) != 1) {
+		fprintf(stderr, "Error in control - Sync didn't finish: %s\n", path);
+		return -1;
+	}
+	printf("%lu\n", scan);
+	return 0;
+}
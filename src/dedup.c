@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "transfer.h"
+#include "durable.h"
+
+//bytes read at a time when comparing two files
+#define COMPARE_SIZE 65536
+
+/*
+ * Remove an entry from its bucket and free it
+ */
+static void drop_content(struct dedup *dedup, struct content **ptr) {
+	struct content *content = *ptr;
+	*ptr = content->next;
+	free(content->path);
+	free(content);
+	dedup->count--;
+}
+
+/*
+ * Double the table, moving every entry to its new bucket
+ * Returns 0 if the table grew
+ * Otherwise returns -1
+ */
+static int grow_dedup(struct dedup *dedup) {
+	size_t capacity = dedup->capacity * 2;
+	struct content **values = (struct content **)calloc(capacity, sizeof(struct content *));
+	if(values == 0)
+		return -1;
+
+	for(size_t i = 0; i < dedup->capacity; i++) {
+		struct content *ptr = dedup->values[i];
+		while(ptr != 0) {
+			struct content *tmp = ptr->next;
+			ptr->next = values[ptr->size % capacity];
+			values[ptr->size % capacity] = ptr;
+			ptr = tmp;
+		}
+	}
+	free(dedup->values);
+	dedup->values = values;
+	dedup->capacity = capacity;
+	return 0;
+}
+
+/*
+ * Check if two files hold the same bytes
+ */
+static int same_content(char *a, char *b) {
+	char buf_a[COMPARE_SIZE], buf_b[COMPARE_SIZE];
+	int fd_a, fd_b;
+	ssize_t n, m;
+
+	if((fd_a = open(a, O_RDONLY)) < 0)
+		return 0;
+	if((fd_b = open(b, O_RDONLY)) < 0) {
+		close(fd_a);
+		return 0;
+	}
+
+	int same = 1;
+	do {
+		n = read(fd_a, buf_a, COMPARE_SIZE);
+		m = read(fd_b, buf_b, COMPARE_SIZE);
+		if(n < 0 || n != m || memcmp(buf_a, buf_b, n) != 0)
+			same = 0;
+	} while(same && n > 0);
+	close(fd_a);
+	close(fd_b);
+	return same;
+}
+
+/*
+ * Copy a file's content into a new file, sharing its blocks if the
+ * filesystem can and copying them in the kernel if not
+ * Returns 0 if every byte was copied
+ * Otherwise returns -1
+ */
+static int clone_file(char *from, int fd, off_t size) {
+	int from_fd = open(from, O_RDONLY);
+	if(from_fd < 0)
+		return -1;
+
+	int result = 0;
+	if(ioctl(fd, FICLONE, from_fd) < 0) {
+		for(off_t left = size; left > 0;) {
+			ssize_t n = copy_file_range(from_fd, 0, fd, 0, left, 0);
+			if(n <= 0) {
+				result = -1;
+				break;
+			}
+			left -= n;
+		}
+	}
+	close(from_fd);
+	return result;
+}
+
+/*
+ * Make dest from a file with the same content through a temporary name
+ * next to it, so dest is replaced in one step
+ * Returns 0 if dest was made
+ * Otherwise returns -1
+ */
+static int make_file(struct dedup *dedup, char *from, char *dest, struct stat *st_info) {
+	struct stat from_info;
+	char tmp[4096];
+	staged_name(dest, tmp, 4096);
+	unlink(tmp);
+
+	//a link shares the metadata too, so the other file must already have it
+	if(dedup->mode == DEDUP_HARDLINK && lstat(from, &from_info) == 0 && from_info.st_mode == st_info->st_mode &&
+		from_info.st_uid == st_info->st_uid && from_info.st_gid == st_info->st_gid &&
+		from_info.st_mtim.tv_sec == st_info->st_mtim.tv_sec && from_info.st_mtim.tv_nsec == st_info->st_mtim.tv_nsec) {
+		if(link(from, tmp) == 0 && rename(tmp, dest) == 0)
+			return 0;
+		unlink(tmp);
+	}
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, st_info->st_mode & 07777);
+	if(fd < 0)
+		return -1;
+
+	struct timespec times[2] = { st_info->st_atim, st_info->st_mtim };
+	int result = clone_file(from, fd, st_info->st_size);
+	if(result == 0 && (fchmod(fd, st_info->st_mode & 07777) < 0 || futimens(fd, times) < 0))
+		result = -1;
+	if(result == 0 && geteuid() == 0 && fchown(fd, st_info->st_uid, st_info->st_gid) < 0)
+		result = -1;
+	if(close(fd) < 0 || result < 0 || rename(tmp, dest) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+struct dedup *init_dedup(enum dedup_mode mode) {
+	struct dedup *dedup = (struct dedup *)calloc(1, sizeof(struct dedup));
+	if(dedup == 0)
+		return 0;
+
+	dedup->mode = mode;
+	dedup->capacity = 400;
+	if((dedup->values = (struct content **)calloc(dedup->capacity, sizeof(struct content *))) == 0) {
+		free(dedup);
+		return 0;
+	}
+	return dedup;
+}
+
+void free_dedup(struct dedup *dedup) {
+	if(dedup != 0) {
+		for(size_t i = 0; i < dedup->capacity; i++) {
+			while(dedup->values[i] != 0)
+				drop_content(dedup, &dedup->values[i]);
+		}
+		free(dedup->values);
+		free(dedup);
+	}
+}
+
+int add_content(struct dedup *dedup, char *path, off_t size, unsigned long hash) {
+	if(size < DEDUP_MIN || hash == 0)
+		return 0;
+
+	//an older entry for the path is replaced, entries left under
+	//other sizes are dropped when they fail to match
+	struct content **ptr = &dedup->values[size % dedup->capacity];
+	while(*ptr != 0 && strcmp((*ptr)->path, path) != 0)
+		ptr = &(*ptr)->next;
+	if(*ptr != 0) {
+		(*ptr)->hash = hash;
+		return 0;
+	}
+
+	if(dedup->count >= dedup->capacity && grow_dedup(dedup) < 0)
+		return -1;
+	struct content *content = (struct content *)malloc(sizeof(struct content));
+	if(content == 0 || (content->path = strndup(path, 4096)) == 0) {
+		if(content != 0)
+			free(content);
+		return -1;
+	}
+	content->size = size;
+	content->hash = hash;
+	content->next = dedup->values[size % dedup->capacity];
+	dedup->values[size % dedup->capacity] = content;
+	dedup->count++;
+	return 0;
+}
+
+int has_size(struct dedup *dedup, off_t size) {
+	struct content *ptr = dedup->values[size % dedup->capacity];
+	while(ptr != 0 && ptr->size != size)
+		ptr = ptr->next;
+	return ptr != 0;
+}
+
+int dedup_file(struct dedup *dedup, char *src, char *dest, struct stat *st_info) {
+	off_t size = st_info->st_size;
+	if(size < DEDUP_MIN)
+		return -1;
+
+	//the source is only read if some file has the same size
+	struct content **ptr = &dedup->values[size % dedup->capacity];
+	while(*ptr != 0 && (*ptr)->size != size)
+		ptr = &(*ptr)->next;
+	if(*ptr == 0)
+		return -1;
+
+	unsigned long hash = content_fingerprint(src);
+	if(hash == 0)
+		return -1;
+
+	while(*ptr != 0) {
+		struct content *content = *ptr;
+		if(content->size != size || content->hash != hash || strcmp(content->path, dest) == 0) {
+			ptr = &content->next;
+			continue;
+		}
+
+		//a file that was changed or removed since it was copied is forgotten
+		if(!same_content(src, content->path)) {
+			drop_content(dedup, ptr);
+			continue;
+		}
+		if(make_file(dedup, content->path, dest, st_info) < 0)
+			return -1;
+		add_content(dedup, dest, size, hash);
+		return 0;
+	}
+	return -1;
+}
+
+int break_link(struct dedup *dedup, char *dest) {
+	struct stat st_info;
+	if(dedup == 0 || dedup->mode != DEDUP_HARDLINK || lstat(dest, &st_info) < 0 || !S_ISREG(st_info.st_mode) || st_info.st_nlink < 2)
+		return 0;
+	return unlink(dest) == 0;
+}
@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "durable.h"
+#include "utils.h"
+
+//filesystems a batch remembers having synced, later ones are synced again
+#define DURABLE_DEVS 16
+
+/*
+ * Sync the filesystem of every destination in a batch once, by the
+ * temporary names of staged files until they are renamed, marking the
+ * destinations on a filesystem that couldn't be synced as failed
+ * Returns 0 if every filesystem was synced
+ * Otherwise returns -1
+ */
+static int sync_filesystems(struct durable *durable, int renamed) {
+	dev_t devs[DURABLE_DEVS];
+	int failed[DURABLE_DEVS];
+	int count = 0, result = 0;
+	char path[4096];
+
+	for(struct published *ptr = durable->head; ptr != 0; ptr = ptr->next) {
+		struct stat st_info;
+		if(ptr->failed)
+			continue;
+		if(ptr->staged && !renamed)
+			staged_name(ptr->dest, path, 4096);
+		else
+			snprintf(path, 4096, "%s", ptr->dest);
+		if(lstat(path, &st_info) < 0) {
+			//a staged file that is gone has nothing to publish
+			ptr->failed = ptr->staged && !renamed;
+			continue;
+		}
+
+		int seen = -1;
+		for(int i = 0; i < count && seen < 0; i++)
+			seen = devs[i] == st_info.st_dev ? i : -1;
+		if(seen >= 0) {
+			ptr->failed = failed[seen];
+			continue;
+		}
+
+		//a link can't be opened, the directory it is in is on the same filesystem
+		int fd = S_ISLNK(st_info.st_mode) ? -1 : open(path, O_RDONLY | O_NONBLOCK);
+		if(fd < 0) {
+			parent_dir(path, ptr->dest, 4096);
+			fd = open(path, O_RDONLY | O_DIRECTORY);
+		}
+		if(fd < 0 || syncfs(fd) < 0) {
+			fprintf(stderr, "Error in durability - Couldn't sync filesystem: %s\n", path);
+			ptr->failed = 1;
+			result = -1;
+		}
+		if(fd >= 0)
+			close(fd);
+		if(count < DURABLE_DEVS) {
+			failed[count] = ptr->failed;
+			devs[count++] = st_info.st_dev;
+		}
+	}
+	return result;
+}
+
+/*
+ * Fsync the files of a batch, starting the writeback of all of them
+ * before waiting for any so the disk sees them together, marking the
+ * ones that couldn't be synced as failed
+ * Returns 0 if every file was synced
+ * Otherwise returns -1
+ */
+static int sync_files(struct durable *durable) {
+	char path[4096];
+	int result = 0;
+
+	for(struct published *ptr = durable->head; ptr != 0; ptr = ptr->next) {
+		if(ptr->staged)
+			staged_name(ptr->dest, path, 4096);
+		else
+			snprintf(path, 4096, "%s", ptr->dest);
+
+		//a link has no data of its own, its name is synced with its directory,
+		//but a staged file that can't be opened has nothing to publish
+		ptr->fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+		if(ptr->fd >= 0)
+			sync_file_range(ptr->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+		else if(ptr->staged) {
+			fprintf(stderr, "Error in durability - Couldn't open file: %s\n", path);
+			ptr->failed = 1;
+			result = -1;
+		}
+	}
+
+	for(struct published *ptr = durable->head; ptr != 0; ptr = ptr->next) {
+		if(ptr->fd < 0)
+			continue;
+		if(fsync(ptr->fd) < 0) {
+			fprintf(stderr, "Error in durability - Couldn't sync file: %s\n", ptr->dest);
+			ptr->failed = 1;
+			result = -1;
+		}
+		close(ptr->fd);
+		ptr->fd = -1;
+	}
+	return result;
+}
+
+/*
+ * Fsync every directory a name in a batch was put in, once each, marking
+ * the destinations in a directory that couldn't be synced as failed
+ * Returns 0 if every directory was synced
+ * Otherwise returns -1
+ */
+static int sync_dirs(struct durable *durable) {
+	char dir[4096], other[4096];
+	int result = 0;
+
+	for(struct published *ptr = durable->head; ptr != 0; ptr = ptr->next) {
+		if(ptr->failed)
+			continue;
+		parent_dir(dir, ptr->dest, 4096);
+
+		//a directory with several new names is synced for the first
+		int seen = 0;
+		for(struct published *prev = durable->head; prev != ptr && !seen; prev = prev->next) {
+			parent_dir(other, prev->dest, 4096);
+			seen = !prev->failed && strcmp(dir, other) == 0;
+		}
+		if(seen)
+			continue;
+
+		int fd = open(dir, O_RDONLY | O_DIRECTORY);
+		if(fd < 0 || fsync(fd) < 0) {
+			fprintf(stderr, "Error in durability - Couldn't sync directory: %s\n", dir);
+			result = -1;
+			for(struct published *next = ptr; next != 0; next = next->next) {
+				parent_dir(other, next->dest, 4096);
+				if(strcmp(dir, other) == 0)
+					next->failed = 1;
+			}
+		}
+		if(fd >= 0)
+			close(fd);
+	}
+	return result;
+}
+
+/*
+ * Rename a staged file into place
+ * Returns 0 if it was renamed
+ * Otherwise returns -1 and the staged file is removed
+ */
+static int rename_staged(char *dest) {
+	char tmp[4096];
+	staged_name(dest, tmp, 4096);
+	if(rename(tmp, dest) < 0) {
+		fprintf(stderr, "Error in durability - Couldn't publish file: %s\n", dest);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+struct durable *init_durable(enum durability mode) {
+	struct durable *durable = (struct durable *)calloc(1, sizeof(struct durable));
+	if(durable == 0)
+		return 0;
+
+	durable->mode = mode;
+	return durable;
+}
+
+void free_durable(struct durable *durable) {
+	if(durable != 0) {
+		flush_durable(durable);
+		while(durable->done != 0) {
+			struct published *tmp = durable->done->next;
+			free_published(durable->done);
+			durable->done = tmp;
+		}
+		free(durable);
+	}
+}
+
+void staged_name(char *dest, char *tmp, size_t n) {
+	snprintf(tmp, n, "%s.sentinel-%d", dest, getpid());
+}
+
+void sweep_staged(char *dir) {
+	DIR *dp = opendir(dir);
+	struct dirent *ep;
+	if(dp == 0)
+		return;
+
+	while((ep = readdir(dp)) != 0) {
+		//the name staged_name gives, with the id of the sentinel that wrote it
+		char *suffix = 0;
+		for(char *ptr = strstr(ep->d_name, ".sentinel-"); ptr != 0; ptr = strstr(ptr + 1, ".sentinel-"))
+			suffix = ptr;
+		if(ep->d_type == DT_DIR || suffix == 0 || suffix == ep->d_name || suffix[10] == 0 || strspn(suffix + 10, "0123456789") != strlen(suffix + 10))
+			continue;
+
+		//a sentinel still running may be about to publish it
+		pid_t pid = (pid_t)atol(suffix + 10);
+		if(pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH)
+			continue;
+		if(unlinkat(dirfd(dp), ep->d_name, 0) < 0)
+			fprintf(stderr, "Error in durability - Couldn't remove temporary file: %s/%s\n", dir, ep->d_name);
+	}
+	closedir(dp);
+}
+
+int publish(struct durable *durable, char *dest, int staged, void *owner) {
+	if(durable == 0 || durable->mode == DURABLE_NONE)
+		return 0;
+	if(durable->mode == DURABLE_ATOMIC)
+		return staged ? rename_staged(dest) : 0;
+
+	struct published *published = (struct published *)malloc(sizeof(struct published));
+	if(published == 0 || (published->dest = strndup(dest, 4096)) == 0) {
+		if(published != 0)
+			free(published);
+		if(staged) {
+			char tmp[4096];
+			staged_name(dest, tmp, 4096);
+			unlink(tmp);
+		}
+		return -1;
+	}
+	published->staged = staged;
+	published->fd = -1;
+	published->failed = 0;
+	published->owner = owner;
+	published->next = 0;
+	if(durable->tail != 0)
+		durable->tail->next = published;
+	else
+		durable->head = published;
+	durable->tail = published;
+
+	//a long run of copies isn't held back until the run ends, an entry
+	//that fails to flush is reported through its owner
+	if(++durable->count >= DURABLE_BATCH)
+		flush_durable(durable);
+	return 1;
+}
+
+int flush_durable(struct durable *durable) {
+	if(durable == 0 || durable->head == 0)
+		return 0;
+
+	//the data goes out before any name points at it
+	int result = durable->mode == DURABLE_SYNCFS ? sync_filesystems(durable, 0) : sync_files(durable);
+
+	//a file whose data may not have made it stays under its temporary
+	//name only until it is removed, the old version is kept
+	for(struct published *ptr = durable->head; ptr != 0; ptr = ptr->next) {
+		if(ptr->staged && ptr->failed) {
+			char tmp[4096];
+			staged_name(ptr->dest, tmp, 4096);
+			unlink(tmp);
+		}
+		else if(ptr->staged && rename_staged(ptr->dest) < 0) {
+			ptr->failed = 1;
+			result = -1;
+		}
+	}
+
+	//then the names themselves
+	if((durable->mode == DURABLE_SYNCFS ? sync_filesystems(durable, 1) : sync_dirs(durable)) < 0)
+		result = -1;
+
+	//entries with an owner are kept, in order, for the owner to take
+	struct published **done = &durable->done;
+	while(*done != 0)
+		done = &(*done)->next;
+	while(durable->head != 0) {
+		struct published *tmp = durable->head->next;
+		if(durable->head->owner != 0) {
+			durable->head->next = 0;
+			*done = durable->head;
+			done = &durable->head->next;
+		}
+		else
+			free_published(durable->head);
+		durable->head = tmp;
+	}
+	durable->tail = 0;
+	durable->count = 0;
+	return result;
+}
+
+struct published *take_published(struct durable *durable) {
+	if(durable == 0)
+		return 0;
+	struct published *done = durable->done;
+	durable->done = 0;
+	return done;
+}
+
+void free_published(struct published *published) {
+	free(published->dest);
+	free(published);
+}
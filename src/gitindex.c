@@ -0,0 +1,446 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "gitindex.h"
+#include "list.h"
+#include "utils.h"
+
+//header of an entry up to the flags, extended flags follow in version 3+
+#define ENTRY_HEADER 62
+
+//flags of an index entry
+#define FLAG_EXTENDED 0x4000
+#define FLAG_NAME_MASK 0x0fff
+#define FLAG_SKIP_WORKTREE 0x4000 //extended
+#define FLAG_INTENT_TO_ADD 0x2000 //extended
+
+//size of the checksum at the end of the index
+#define INDEX_CHECKSUM 20
+
+//a memory buffer being parsed
+struct reader {
+	unsigned char	*data;
+	size_t			size, pos;
+};
+
+/*
+ * Read a big-endian 32 bit integer
+ */
+static uint32_t be32(unsigned char *ptr) {
+	return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 8) | ptr[3];
+}
+
+/*
+ * Read a big-endian 64 bit integer
+ */
+static uint64_t be64(unsigned char *ptr) {
+	return ((uint64_t)be32(ptr) << 32) | be32(ptr + 4);
+}
+
+/*
+ * Read the prefix length of a version 4 path
+ * Returns -1 if the buffer ran out
+ */
+static long read_varint(struct reader *reader) {
+	if(reader->pos >= reader->size)
+		return -1;
+
+	unsigned char c = reader->data[reader->pos++];
+	long value = c & 127;
+	while(c & 128) {
+		if(reader->pos >= reader->size)
+			return -1;
+		c = reader->data[reader->pos++];
+		value = ((value + 1) << 7) | (c & 127);
+	}
+	return value;
+}
+
+/*
+ * Hash a relative path (FNV-1a)
+ */
+static size_t hash_index(struct git_index *index, char *path) {
+	size_t h = 14695981039346656037UL;
+	for(char *ptr = path; *ptr != 0; ptr++) {
+		h ^= (unsigned char)*ptr;
+		h *= 1099511628211UL;
+	}
+	return h % index->capacity;
+}
+
+/*
+ * Get the entry of a relative path
+ */
+static struct index_entry *find_entry(struct git_index *index, char *path) {
+	if(index->values == 0)
+		return 0;
+
+	struct index_entry *ptr = index->values[hash_index(index, path)];
+	while(ptr != 0 && strcmp(ptr->path, path) != 0)
+		ptr = ptr->next;
+	return ptr;
+}
+
+/*
+ * Free a hash table of entries
+ */
+static void free_entries(struct index_entry **values, size_t capacity) {
+	if(values != 0) {
+		for(size_t i = 0; i < capacity; i++) {
+			struct index_entry *ptr = values[i];
+			while(ptr != 0) {
+				struct index_entry *tmp = ptr->next;
+				free(ptr->path);
+				free(ptr);
+				ptr = tmp;
+			}
+		}
+		free(values);
+	}
+}
+
+/*
+ * Mark the entries set in an fsmonitor bitmap (EWAH compressed) as untrusted,
+ * git sets a bit for every entry that may have changed since its last query
+ * Returns 0 if the bitmap was read
+ * Otherwise returns -1
+ */
+static int read_fsmonitor(struct reader *reader, struct index_entry **entries, size_t count) {
+	if(reader->size - reader->pos < 4)
+		return -1;
+	uint32_t version = be32(reader->data + reader->pos);
+	reader->pos += 4;
+
+	//skip the token of the last query
+	if(version == 1)
+		reader->pos += 8;
+	else if(version == 2) {
+		while(reader->pos < reader->size && reader->data[reader->pos] != 0)
+			reader->pos++;
+		reader->pos++;
+	}
+	else
+		return -1;
+
+	//bitmap size, bit count and word count
+	if(reader->pos + 12 > reader->size)
+		return -1;
+	reader->pos += 8;
+	uint32_t words = be32(reader->data + reader->pos);
+	reader->pos += 4;
+	if(words > (reader->size - reader->pos) / 8)
+		return -1;
+
+	//each run-length word is followed by its literal words
+	unsigned char *ptr = reader->data + reader->pos;
+	size_t bit = 0;
+	for(uint32_t i = 0; i < words;) {
+		uint64_t rlw = be64(ptr + 8 * i++);
+		uint64_t run = (rlw >> 1) & 0xffffffffUL;
+		uint64_t literals = rlw >> 33;
+
+		if(rlw & 1) {
+			for(uint64_t b = 0; b < run * 64 && bit + b < count; b++)
+				entries[bit + b]->trusted = 0;
+		}
+		bit += run * 64;
+
+		for(uint64_t j = 0; j < literals && i < words; j++, i++) {
+			uint64_t word = be64(ptr + 8 * i);
+			for(int b = 0; b < 64; b++) {
+				if((word >> b) & 1 && bit + b < count)
+					entries[bit + b]->trusted = 0;
+			}
+			bit += 64;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read the entries and extensions of an index file into the hash table
+ * Returns 0 if the index was read
+ * Otherwise returns -1
+ */
+static int read_index(struct git_index *index) {
+	struct stat st_info;
+	int fd;
+
+	if((fd = open(index->path, O_RDONLY)) < 0)
+		return -1;
+	if(fstat(fd, &st_info) < 0 || st_info.st_size < 12 + INDEX_CHECKSUM) {
+		close(fd);
+		return -1;
+	}
+
+	struct reader reader = { malloc(st_info.st_size), st_info.st_size, 0 };
+	if(reader.data == 0 || read(fd, reader.data, reader.size) != (ssize_t)reader.size) {
+		free(reader.data);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	index->mtime = st_info.st_mtim;
+	index->size = st_info.st_size;
+	index->ino = st_info.st_ino;
+	index->fsmonitor = 0;
+
+	uint32_t version = be32(reader.data + 4);
+	uint32_t count = be32(reader.data + 8);
+	if(memcmp(reader.data, "DIRC", 4) != 0 || version < 2 || version > 4 || count > reader.size / ENTRY_HEADER) {
+		free(reader.data);
+		return -1;
+	}
+	reader.size -= INDEX_CHECKSUM;
+	reader.pos = 12;
+
+	index->count = 0;
+	index->capacity = count + 1;
+	index->values = (struct index_entry **)calloc(index->capacity, sizeof(struct index_entry *));
+	struct index_entry **entries = (struct index_entry **)calloc(count + 1, sizeof(struct index_entry *));
+	char path[4096];
+	size_t path_len = 0;
+	if(index->values == 0 || entries == 0)
+		goto fail;
+
+	for(uint32_t i = 0; i < count; i++) {
+		size_t start = reader.pos;
+		if(reader.pos + ENTRY_HEADER > reader.size)
+			goto fail;
+		unsigned char *ptr = reader.data + reader.pos;
+		uint16_t flags = (ptr[60] << 8) | ptr[61];
+		uint16_t extended = 0;
+		reader.pos += ENTRY_HEADER;
+		if(version >= 3 && (flags & FLAG_EXTENDED)) {
+			if(reader.pos + 2 > reader.size)
+				goto fail;
+			extended = (reader.data[reader.pos] << 8) | reader.data[reader.pos + 1];
+			reader.pos += 2;
+		}
+
+		//version 4 paths only hold what differs from the previous path
+		if(version == 4) {
+			long strip = read_varint(&reader);
+			if(strip < 0 || (size_t)strip > path_len)
+				goto fail;
+			path_len -= strip;
+		}
+		else
+			path_len = 0;
+
+		char *name = (char *)reader.data + reader.pos;
+		size_t name_len = strnlen(name, reader.size - reader.pos);
+		if(reader.pos + name_len >= reader.size || path_len + name_len >= sizeof(path))
+			goto fail;
+		memcpy(path + path_len, name, name_len + 1);
+		path_len += name_len;
+
+		//a name length that doesn't match means the entry layout is unknown
+		if((flags & FLAG_NAME_MASK) != FLAG_NAME_MASK && version != 4 && (flags & FLAG_NAME_MASK) != name_len)
+			goto fail;
+
+		//versions 2 and 3 pad entries with nuls to a multiple of 8 bytes
+		if(version == 4)
+			reader.pos += name_len + 1;
+		else
+			reader.pos = start + ((reader.pos - start + name_len + 8) & ~7UL);
+
+		struct index_entry *entry = (struct index_entry *)malloc(sizeof(struct index_entry));
+		if(entry == 0)
+			goto fail;
+		if((entry->path = strndup(path, 4096)) == 0) {
+			free(entry);
+			goto fail;
+		}
+		entry->ctime = be32(ptr);
+		entry->mtime = be32(ptr + 8);
+		entry->mtime_nsec = be32(ptr + 12);
+		entry->ino = be32(ptr + 20);
+		entry->mode = be32(ptr + 24);
+		entry->size = be32(ptr + 36);
+		memcpy(entry->oid, ptr + 40, 20);
+
+		//racily clean entries were changed in the same second git wrote
+		//the index, so their stat data can't be relied on
+		entry->trusted = S_ISREG(entry->mode) && !(extended & (FLAG_SKIP_WORKTREE | FLAG_INTENT_TO_ADD)) &&
+			(entry->mtime < index->mtime.tv_sec || (entry->mtime == index->mtime.tv_sec && entry->mtime_nsec < index->mtime.tv_nsec));
+
+		size_t h = hash_index(index, entry->path);
+		entry->next = index->values[h];
+		index->values[h] = entry;
+		entries[index->count++] = entry;
+	}
+
+	//extensions follow the entries until the checksum
+	while(reader.pos + 8 <= reader.size) {
+		unsigned char *sig = reader.data + reader.pos;
+		uint32_t size = be32(sig + 4);
+		reader.pos += 8;
+		if(size > reader.size - reader.pos)
+			goto fail;
+
+		//of the optional extensions only fsmonitor's dirty marks are used,
+		//the others (untracked cache, trees, ...) are skipped
+		struct reader ext = { reader.data, reader.pos + size, reader.pos };
+		if(memcmp(sig, "FSMN", 4) == 0) {
+			if(read_fsmonitor(&ext, entries, index->count) == 0)
+				index->fsmonitor = 1;
+		}
+		//a split index keeps most entries in a shared index that isn't read
+		else if(memcmp(sig, "link", 4) == 0)
+			goto fail;
+		reader.pos += size;
+	}
+
+	free(entries);
+	free(reader.data);
+	return 0;
+
+fail:
+	free_entries(index->values, index->capacity);
+	index->values = 0;
+	index->count = 0;
+	if(entries != 0)
+		free(entries);
+	free(reader.data);
+	return -1;
+}
+
+struct git_index *open_git_index(char *root) {
+	char git_path[4096], path[4096];
+	struct stat st_info;
+	memset(git_path, 0, 4096);
+	memset(path, 0, 4096);
+	join(git_path, root, ".git", 4095);
+
+	if(stat(git_path, &st_info) < 0)
+		return 0;
+
+	//linked worktrees and submodules have a .git file pointing at the repository
+	if(S_ISREG(st_info.st_mode)) {
+		char line[4096];
+		memset(line, 0, 4096);
+		FILE *fp = fopen(git_path, "r");
+		if(fp == 0)
+			return 0;
+		int found = fgets(line, 4096, fp) != 0 && strncmp(line, "gitdir: ", 8) == 0;
+		fclose(fp);
+		if(!found)
+			return 0;
+		line[strcspn(line, "\n")] = 0;
+
+		memset(git_path, 0, 4096);
+		if(line[8] == '/')
+			strncpy(git_path, line + 8, 4095);
+		else
+			join(git_path, root, line + 8, 4095);
+	}
+	join(path, git_path, "index", 4095);
+
+	struct git_index *index = (struct git_index *)calloc(1, sizeof(struct git_index));
+	if(index == 0)
+		return 0;
+
+	index->path = strndup(path, 4096);
+	index->root = strndup(root, 4096);
+	if(index->path == 0 || index->root == 0 || read_index(index) < 0) {
+		free_git_index(index);
+		return 0;
+	}
+	return index;
+}
+
+void free_git_index(struct git_index *index) {
+	if(index != 0) {
+		free_entries(index->values, index->capacity);
+		if(index->path != 0)
+			free(index->path);
+		if(index->root != 0)
+			free(index->root);
+		free(index);
+	}
+}
+
+struct index_entry *lookup_index(struct git_index *index, char *path) {
+	char relative_filename[4096];
+	memset(relative_filename, 0, 4096);
+	relative(relative_filename, path, index->root, 4095);
+
+	return find_entry(index, relative_filename);
+}
+
+int index_stat(struct git_index *index, char *path, struct stat *st_info) {
+	struct index_entry *entry = lookup_index(index, path);
+	if(entry == 0 || !entry->trusted)
+		return -1;
+
+	memset(st_info, 0, sizeof(struct stat));
+	st_info->st_mode = entry->mode;
+	st_info->st_size = entry->size;
+	st_info->st_ino = entry->ino;
+	st_info->st_mtim.tv_sec = entry->mtime;
+	st_info->st_mtim.tv_nsec = entry->mtime_nsec;
+	st_info->st_ctime = entry->ctime;
+	return 0;
+}
+
+int diff_git_index(struct git_index *index, struct list *changed, struct list *removed) {
+	struct stat st_info;
+	int added = 0;
+
+	//git replaces the index with a rename whenever it writes it
+	if(stat(index->path, &st_info) < 0)
+		return -1;
+	if(st_info.st_ino == index->ino && st_info.st_size == index->size &&
+		st_info.st_mtim.tv_sec == index->mtime.tv_sec && st_info.st_mtim.tv_nsec == index->mtime.tv_nsec)
+		return 0;
+
+	struct git_index old = *index;
+	if(read_index(index) < 0) {
+		//keep the last good index, git may be halfway through writing it
+		index->values = old.values;
+		index->capacity = old.capacity;
+		index->count = old.count;
+		return -1;
+	}
+
+	for(size_t i = 0; i < index->capacity; i++) {
+		for(struct index_entry *ptr = index->values[i]; ptr != 0; ptr = ptr->next) {
+			struct index_entry *prev = find_entry(&old, ptr->path);
+			if(prev != 0 && prev->mode == ptr->mode && memcmp(prev->oid, ptr->oid, 20) == 0)
+				continue;
+
+			char full_filename[4096];
+			memset(full_filename, 0, 4096);
+			join(full_filename, index->root, ptr->path, 4095);
+			if(append(changed, full_filename) < 0)
+				added = -1;
+			else if(added >= 0)
+				added++;
+		}
+	}
+
+	for(size_t i = 0; i < old.capacity; i++) {
+		for(struct index_entry *ptr = old.values[i]; ptr != 0; ptr = ptr->next) {
+			if(find_entry(index, ptr->path) != 0)
+				continue;
+
+			char full_filename[4096];
+			memset(full_filename, 0, 4096);
+			join(full_filename, index->root, ptr->path, 4095);
+			if(append(removed, full_filename) < 0)
+				added = -1;
+			else if(added >= 0)
+				added++;
+		}
+	}
+
+	free_entries(old.values, old.capacity);
+	return added;
+}
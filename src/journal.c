@@ -0,0 +1,436 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#include "journal.h"
+#include "list.h"
+#include "utils.h"
+
+//compaction is skipped until the journal is at least this big
+#define JOURNAL_MIN_COMPACT (1024 * 1024)
+
+//last record seen for a path that hasn't been completed
+struct entry {
+	char			*path; //path relative to the roots
+	char			op; //I, U, A or D
+	struct entry	*next; //used to resolve hashing collisions
+};
+
+//hash table of pending paths built when reading a journal
+struct table {
+	struct entry	**values;
+	size_t			capacity, count;
+};
+
+/*
+ * Hash a relative path (FNV-1a)
+ */
+static size_t hash_entry(struct table *table, char *path) {
+	size_t h = 14695981039346656037UL;
+	for(char *ptr = path; *ptr != 0; ptr++) {
+		h ^= (unsigned char)*ptr;
+		h *= 1099511628211UL;
+	}
+	return h % table->capacity;
+}
+
+/*
+ * Initialize an empty table of pending paths
+ */
+static struct table *init_table(size_t capacity) {
+	struct table *table = (struct table *)malloc(sizeof(struct table));
+	if(table == 0)
+		return 0;
+
+	table->capacity = capacity;
+	table->count = 0;
+	table->values = (struct entry **)calloc(capacity, sizeof(struct entry *));
+	if(table->values == 0) {
+		free(table);
+		return 0;
+	}
+	return table;
+}
+
+/*
+ * Free a table of pending paths
+ */
+static void free_table(struct table *table) {
+	if(table != 0) {
+		for(size_t i = 0; i < table->capacity; i++) {
+			struct entry *ptr = table->values[i];
+			while(ptr != 0) {
+				struct entry *tmp = ptr->next;
+				free(ptr->path);
+				free(ptr);
+				ptr = tmp;
+			}
+		}
+		free(table->values);
+		free(table);
+	}
+}
+
+/*
+ * Record the latest op for a path, an op of C removes the path
+ */
+static int set_entry(struct table *table, char *path, char op) {
+	struct entry **ptr = &table->values[hash_entry(table, path)];
+	while(*ptr != 0 && strcmp((*ptr)->path, path) != 0)
+		ptr = &(*ptr)->next;
+
+	//completed, nothing left to redo for the path
+	if(op == 'C') {
+		if(*ptr != 0) {
+			struct entry *tmp = *ptr;
+			*ptr = tmp->next;
+			free(tmp->path);
+			free(tmp);
+			table->count--;
+		}
+		return 0;
+	}
+
+	if(*ptr != 0) {
+		(*ptr)->op = op;
+		return 0;
+	}
+
+	struct entry *entry = (struct entry *)malloc(sizeof(struct entry));
+	if(entry == 0)
+		return -1;
+	if((entry->path = strndup(path, 4096)) == 0) {
+		free(entry);
+		return -1;
+	}
+	entry->op = op;
+	entry->next = 0;
+	*ptr = entry;
+	table->count++;
+	return 0;
+}
+
+/*
+ * Write a path to a journal file, escaping newlines and backslashes
+ */
+static size_t write_path(FILE *fp, char *path) {
+	size_t written = 0;
+	for(char *ptr = path; *ptr != 0; ptr++) {
+		if(*ptr == '\n')
+			written += fprintf(fp, "\\n");
+		else if(*ptr == '\\')
+			written += fprintf(fp, "\\\\");
+		else {
+			fputc(*ptr, fp);
+			written++;
+		}
+	}
+	return written;
+}
+
+/*
+ * Undo the escaping of write_path in place
+ */
+static void unescape(char *path) {
+	char *dest = path;
+	for(char *src = path; *src != 0; src++) {
+		if(*src == '\\' && src[1] == 'n') {
+			*dest++ = '\n';
+			src++;
+		}
+		else if(*src == '\\' && src[1] == '\\') {
+			*dest++ = '\\';
+			src++;
+		}
+		else
+			*dest++ = *src;
+	}
+	*dest = 0;
+}
+
+/*
+ * Write one record to a journal file
+ */
+static size_t write_record(FILE *fp, char op, char *path) {
+	size_t written = fprintf(fp, "%c ", op);
+	written += write_path(fp, path);
+	fputc('\n', fp);
+	return written + 1;
+}
+
+/*
+ * Write the header naming the roots of a journal
+ */
+static size_t write_header(FILE *fp, char *src, char *dest) {
+	return write_record(fp, 'S', src) + write_record(fp, 'T', dest);
+}
+
+/*
+ * Read the pending paths of a journal file written for src and dest
+ * Returns 0 if the file is missing or belongs to different roots
+ */
+static struct table *read_journal(char *path, char *src, char *dest, int *migrated) {
+	FILE *fp;
+	char *line = 0;
+	size_t cap = 0;
+	ssize_t len;
+	int lineno = 0;
+
+	*migrated = 0;
+	if((fp = fopen(path, "r")) == 0)
+		return 0;
+
+	struct table *table = init_table(400);
+	if(table == 0) {
+		fclose(fp);
+		return 0;
+	}
+
+	while((len = getline(&line, &cap, fp)) > 0) {
+		//a torn final record from a crash is ignored
+		if(line[len-1] != '\n')
+			break;
+		line[len-1] = 0;
+		lineno++;
+
+		if(len < 2)
+			continue;
+		char op = line[0];
+		char *rest = len > 2 ? line + 2 : line + 1;
+		unescape(rest);
+
+		//the header has to match the roots being synced
+		if(lineno == 1 || lineno == 2) {
+			if(op != (lineno == 1 ? 'S' : 'T') || strcmp(rest, lineno == 1 ? src : dest) != 0) {
+				free_table(table);
+				table = 0;
+				break;
+			}
+			continue;
+		}
+
+		if(op == 'M')
+			*migrated = 1;
+		else if(op == 'I' || op == 'U' || op == 'A' || op == 'D' || op == 'C')
+			set_entry(table, rest, op);
+	}
+
+	if(line != 0)
+		free(line);
+	fclose(fp);
+
+	//a file without a header was never a valid journal
+	if(table != 0 && lineno < 2) {
+		free_table(table);
+		table = 0;
+	}
+	return table;
+}
+
+/*
+ * Flush a file and the directory holding it to disk
+ */
+static int sync_file(FILE *fp, char *path) {
+	if(fflush(fp) != 0 || fdatasync(fileno(fp)) < 0)
+		return -1;
+
+	char buf[4096];
+	memset(buf, 0, 4096);
+	strncpy(buf, path, 4095);
+	int dir_fd = open(dirname(buf), O_RDONLY | O_DIRECTORY);
+	if(dir_fd >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	return 0;
+}
+
+struct journal *open_journal(char *path, char *src, char *dest) {
+	struct journal *journal = (struct journal *)calloc(1, sizeof(struct journal));
+
+	if(journal == 0)
+		return 0;
+
+	journal->path = strndup(path, 4096);
+	journal->src = strndup(src, 4096);
+	journal->dest = strndup(dest, 4096);
+	if(journal->path == 0 || journal->src == 0 || journal->dest == 0) {
+		close_journal(journal);
+		return 0;
+	}
+
+	//keep an existing journal for the same roots, otherwise start over
+	int migrated;
+	struct table *table = read_journal(path, src, dest, &migrated);
+	if(table != 0) {
+		struct stat st_info;
+		free_table(table);
+		journal->migrated = migrated;
+		if(stat(path, &st_info) == 0)
+			journal->written = st_info.st_mtim.tv_sec * 1000000000LL + st_info.st_mtim.tv_nsec;
+		journal->fp = fopen(path, "a");
+	}
+	else {
+		journal->fp = fopen(path, "w");
+		if(journal->fp != 0)
+			write_header(journal->fp, src, dest);
+		journal->dirty = 1;
+	}
+
+	if(journal->fp == 0) {
+		close_journal(journal);
+		return 0;
+	}
+
+	journal->size = journal->compacted = ftell(journal->fp);
+	return journal;
+}
+
+void close_journal(struct journal *journal) {
+	if(journal != 0) {
+		if(journal->fp != 0) {
+			sync_journal(journal);
+			fclose(journal->fp);
+		}
+		if(journal->path != 0)
+			free(journal->path);
+		if(journal->src != 0)
+			free(journal->src);
+		if(journal->dest != 0)
+			free(journal->dest);
+		free(journal);
+	}
+}
+
+int replay_journal(struct journal *journal, struct list *insert_list, struct list *update_list, struct list *delete_list) {
+	int migrated, added = 0;
+
+	//make sure everything buffered is part of the replay
+	if(fflush(journal->fp) != 0)
+		return -1;
+
+	struct table *table = read_journal(journal->path, journal->src, journal->dest, &migrated);
+	if(table == 0)
+		return 0;
+
+	for(size_t i = 0; i < table->capacity; i++) {
+		for(struct entry *ptr = table->values[i]; ptr != 0; ptr = ptr->next) {
+			char src_filename[4096], dest_filename[4096];
+			memset(src_filename, 0, 4096);
+			memset(dest_filename, 0, 4096);
+			join(src_filename, journal->src, ptr->path, 4095);
+			join(dest_filename, journal->dest, ptr->path, 4095);
+
+			//the source may have changed again since the record was
+			//written, so bring the destination in line with what is there now
+			int in_src = access(src_filename, F_OK) == 0;
+			int in_dest = access(dest_filename, F_OK) == 0;
+			int result = 0;
+			if(in_src && in_dest)
+				result = append(update_list, src_filename);
+			else if(in_src)
+				result = append(insert_list, src_filename);
+			else if(in_dest)
+				result = append(delete_list, src_filename);
+			else
+				continue;
+
+			if(result < 0) {
+				free_table(table);
+				return -1;
+			}
+			added++;
+		}
+	}
+
+	free_table(table);
+	return added;
+}
+
+int journal_change(struct journal *journal, char op, char *path) {
+	char relative_filename[4096];
+	memset(relative_filename, 0, 4096);
+	relative(relative_filename, path, journal->src, 4095);
+
+	journal->size += write_record(journal->fp, op, relative_filename);
+	journal->dirty = 1;
+	return ferror(journal->fp) ? -1 : 0;
+}
+
+int journal_done(struct journal *journal, char *path) {
+	char relative_filename[4096];
+	memset(relative_filename, 0, 4096);
+	relative(relative_filename, path, journal->dest, 4095);
+
+	journal->size += write_record(journal->fp, 'C', relative_filename);
+	journal->dirty = 1;
+	return ferror(journal->fp) ? -1 : 0;
+}
+
+int journal_migrated(struct journal *journal) {
+	journal->size += fprintf(journal->fp, "M\n");
+	journal->migrated = 1;
+	journal->dirty = 1;
+	return ferror(journal->fp) ? -1 : 0;
+}
+
+int sync_journal(struct journal *journal) {
+	if(!journal->dirty)
+		return 0;
+
+	//one flush for every record since the last sync
+	if(sync_file(journal->fp, journal->path) < 0)
+		return -1;
+	journal->dirty = 0;
+
+	//compact once the journal has doubled since it was last compacted
+	if(journal->size >= JOURNAL_MIN_COMPACT && journal->size >= 2 * journal->compacted)
+		return compact_journal(journal);
+	return 0;
+}
+
+int compact_journal(struct journal *journal) {
+	int migrated;
+	char tmp_path[4096];
+	memset(tmp_path, 0, 4096);
+	snprintf(tmp_path, 4096, "%s.tmp", journal->path);
+
+	if(fflush(journal->fp) != 0)
+		return -1;
+
+	struct table *table = read_journal(journal->path, journal->src, journal->dest, &migrated);
+	if(table == 0)
+		return -1;
+
+	FILE *fp = fopen(tmp_path, "w");
+	if(fp == 0) {
+		free_table(table);
+		return -1;
+	}
+
+	//write the header, the migration marker and the pending paths
+	size_t size = write_header(fp, journal->src, journal->dest);
+	if(migrated)
+		size += fprintf(fp, "M\n");
+	for(size_t i = 0; i < table->capacity; i++) {
+		for(struct entry *ptr = table->values[i]; ptr != 0; ptr = ptr->next)
+			size += write_record(fp, ptr->op, ptr->path);
+	}
+	free_table(table);
+
+	//the new journal has to be on disk before it replaces the old one
+	if(ferror(fp) || sync_file(fp, tmp_path) < 0 || rename(tmp_path, journal->path) < 0) {
+		fclose(fp);
+		unlink(tmp_path);
+		return -1;
+	}
+	sync_file(fp, journal->path);
+
+	fclose(journal->fp);
+	journal->fp = fp;
+	journal->size = journal->compacted = size;
+	return 0;
+}
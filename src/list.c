@@ -56,25 +56,36 @@ int append(struct list *list, char *src) {
     if(list == 0 || list->values == 0)
         return -1;
 
-    struct list *listptr = list;
     //if we have reached capacity, double the size of the list
+    //in place so callers keep a valid pointer
     if(list->length == list->capacity) {
-        struct list *newlist = init_list(list->capacity * 2);
+        char **values = (char **)realloc(list->values, list->capacity * 2 * sizeof(char *));
 
-        if(newlist == 0)
+        if(values == 0)
             return -1;
 
-        //copy the old list
-        for(size_t i = 0; i < list->length; i++)
-            append(newlist, list->values[i]);
-        listptr = newlist;
-        free_list(list);
+        list->values = values;
+        list->capacity *= 2;
     }
 
     //copy the string to the list values
-    list->values[listptr->length++] = strndup(src, 4096);
-    list = listptr;
+    if((list->values[list->length] = strndup(src, 4096)) == 0)
+        return -1;
+    list->length++;
+
+    return 0;
+}
+
+int discard(struct list *list, size_t i) {
+    //check if item exists
+    if(list == 0 || list->values == 0 || i >= list->length)
+        return -1;
 
+    //move the last item into the hole
+    free(list->values[i]);
+    list->values[i] = list->values[list->length-1];
+    list->values[list->length-1] = 0;
+    list->length--;
     return 0;
 }
 
@@ -5,45 +5,149 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <libgen.h>
+#include <poll.h>
 
 #include "cache.h"
 #include "list.h"
 #include "utils.h"
+#include "throttle.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "trace.h"
+#include "journal.h"
+#include "saves.h"
+#include "gitindex.h"
+#include "remover.h"
+#include "pair.h"
+#include "ring.h"
+#include "uring.h"
+#include "snapshot.h"
+#include "arena.h"
+#include "audit.h"
+#include "dedup.h"
+#include "durable.h"
+#include "control.h"
 
 /*
  * Build a cache from a path
  * If the path is a directory add all subfiles
  * and subdirectories to the cache recursively
  */
-int build_cache(char *path);
+int build_cache(struct pair *pair, char *path);
+
+/*
+ * Stat a path, following a symbolic link only in follow mode and only
+ * if it points to something
+ * Returns 0 if the path was stat'ed
+ * Otherwise returns -1
+ */
+int stat_path(char *path, struct stat *st_info);
 
 /*
  * Update the cache from a path
  * Remove all deleted files, add any new files, update metadata of existing
  * files
  */
-int update_cache(char *path);
+int update_cache(struct pair *pair, char *path);
+
+/*
+ * Update the cache from a path that was just stat'ed, st_info is 0 if
+ * the path is gone
+ */
+int update_stat(struct pair *pair, char *path, struct stat *st_info);
+
+/*
+ * Update the cache from the entries of a cached directory
+ * The entries are only listed again if the directory changed (relist),
+ * its files are only stat'ed if it is due to be checked (due),
+ * subdirectories are checked on their own schedules
+ */
+int scan_dir(struct pair *pair, char *path, struct filenode *filenode, int due, int relist);
+
+/*
+ * Read the names of a directory's entries into its filenode
+ * Returns 0 if the directory was listed
+ * Otherwise returns -1
+ */
+int list_dir(struct pair *pair, char *path, struct filenode *filenode);
+
+/*
+ * Remove every file the last scan didn't visit from the cache and add it
+ * to the delete list, a deleted directory is one deletion for everything in it
+ */
+void sweep_cache(struct pair *pair);
+
+/*
+ * Migrate a src to destinations on the same physical filesystem,
+ * or on receivers through their rings (null for a local destination),
+ * each file is read once for all of them, and a file whose content a
+ * local destination already has is made from there if it has a
+ * content index (null if not)
+ */
+int migrate_phy(struct pair *pair, char *src, char **dests, struct ring **rings, struct dedup **dedups, int count);
+
+/*
+ * Compare a src with a local destination that was already migrated,
+ * adding what differs to the pair's lists and skipping what matches,
+ * so changes made while sentinel wasn't running are synced
+ * Only entries whose mtime or ctime is since or later are looked up on
+ * the destination, with 0 everything is
+ * Returns 0 if the trees were compared
+ * Otherwise returns -1
+ */
+int compare_phy(struct pair *pair, char *src, char *dest, long long since);
+
+/*
+ * Queue any files on dest that were deleted in src
+ */
+int delete_phy(struct pair *pair);
+
+/*
+ * Queue any files on dest that were updated in src
+ */
+int update_phy(struct pair *pair);
+
+/*
+ * Queue any files on dest that were inserted in src
+ */
+int insert_phy(struct pair *pair);
 
 /*
- * Remove all files from the cache that no longer exist
+ * Queue the metadata of any files on dest whose metadata changed in src
  */
-void clean_cache();
+int meta_phy(struct pair *pair);
 
 /*
- * Migrate a src to a destination on the same physical filesystem
+ * Queue the changes of a pair's last scan to be synchronized
  */
-int migrate_phy(char *src, char *dest);
+int sync_phy(struct pair *pair);
 
 /*
- * Delete any files on dest that were deleted in src
+ * Set up a pair, then bring its destinations up to date by migrating
+ * or replaying their journals
+ * With snapshot its changes are found by diffing snapshots of the source,
+ * with dedup (a dedup_mode, -1 for none) its local destinations get a
+ * content index
+ * Returns 0 if the pair is ready to be synced
+ * Otherwise returns -1
  */
-int delete_phy(char *src, char *dest);
+int start_pair(struct pair *pair, int git, int snapshot, int dedup, long window);
 
 /*
- * Synchronize two folders on the same physical filesystem
+ * Find the changes made to a pair's source since its last scan
  */
-int sync_phy(char *src, char *dest);
+void scan_pair(struct pair *pair);
+
+/*
+ * Find the changes made to a pair's source by diffing a new snapshot
+ * against the last one, updating the cache entries of the changed files
+ * Returns 0 if the changes were found
+ * Otherwise returns -1 and the last snapshot is kept
+ */
+int scan_snapshot(struct pair *pair);
 
 /*
  * Frees all used memory and file descriptors
@@ -51,67 +155,632 @@ int sync_phy(char *src, char *dest);
 void cleanup();
 
 /*
- * Used to ensure the program exits gracefully (frees all memory)
- * when killed
+ * Used to stop the main loop when killed, so the program exits
+ * gracefully (frees all memory)
  */
 void handle_signal(int sig);
 
-struct cache *cache = 0;
-struct list *insert_list = 0;
-struct list *delete_list = 0;
-struct list *update_list = 0;
-int r_fd, w_fd = -1;
+/*
+ * Used to re-read the limits file without restarting
+ */
+void handle_reload(int sig);
+
+/*
+ * Used to print the latency histograms without stopping
+ */
+void handle_dump(int sig);
+
+/*
+ * Get the time a change to a cached file was found
+ */
+long long detected_at(struct pair *pair, char *path);
+
+/*
+ * Write the detected changes to the journals and make them durable
+ */
+int record_changes(struct pair *pair);
+
+/*
+ * Update the cache from the paths git changed in its index
+ * Returns the number of paths git changed, 0 if the index wasn't rewritten
+ * Otherwise returns -1
+ */
+int refresh_git(struct pair *pair);
+
+/*
+ * Queue what the audit found to differ to be repaired on its destination
+ */
+void repair_drift();
+
+/*
+ * Get when the oldest deletion still held back in case an editor is
+ * saving was found, in nanoseconds
+ * Returns 0 if there is none
+ */
+long long oldest_held();
+
+struct pair **pairs = 0;
+int pair_count = 0;
+struct throttle *throttle = 0;
+struct scheduler *scheduler = 0;
+struct stats *stats = 0;
+struct trace *trace = 0;
+struct remover *remover = 0;
+struct uring *uring = 0;
+struct arena *arena = 0;
+struct audit *audit = 0;
+struct control *control = 0;
+struct durable *durable = 0;
+long long revalidate_interval = 0; //longest time between checks of an unchanged directory
+int follow = 0; //whether symbolic links are synced as what they point to
+struct walk dirs; //directories being scanned, so a link back up to one is skipped
+int force_scan = 0; //set while every directory has to be checked, because a client is waiting on the scan
+unsigned long scans = 0; //number of scans started, which clients waiting for a sync are told
+volatile sig_atomic_t dump = 0; //set when the histograms should be printed
+volatile sig_atomic_t stopping = 0; //set when sentinel was asked to stop
 
 int main(int argc, char *argv[]) {
-	if(argc != 3) {
-		printf("Usage: sentinel [src_path] [dest_path]\n");
+	int opt;
+	double bytes_rate, ops_rate;
+	char *limits = 0;
+	char *trace_file = 0;
+	char *journal_file = 0;
+	char *config = 0;
+	char *receive = 0;
+	long window = 2000;
+	int git = 0;
+	int snapshot = 0;
+	double revalidate = 0;
+	double memory = 0;
+	double audit_hours = 0;
+	char *progress_file = 0;
+	char *control_socket = 0;
+	int dedup = -1;
+	int durability = DURABLE_NONE;
+
+	//a client only waits for a running sentinel to catch up
+	if(argc >= 2 && strcmp(argv[1], "wait") == 0) {
+		if(argc != 3) {
+			printf("Usage: sentinel wait control_socket\n");
+			return -1;
+		}
+		return wait_sync(argv[2]);
+	}
+
+	//transfers are unlimited unless asked otherwise
+	bytes_rate = ops_rate = 0;
+	while((opt = getopt(argc, argv, "b:o:l:t:j:w:gr:sm:a:A:d:D:LC:c:R:")) != -1) {
+		switch(opt) {
+			case 'b':
+				bytes_rate = atof(optarg);
+				break;
+			case 'o':
+				ops_rate = atof(optarg);
+				break;
+			case 'l':
+				limits = optarg;
+				break;
+			case 't':
+				trace_file = optarg;
+				break;
+			case 'j':
+				journal_file = optarg;
+				break;
+			case 'w':
+				window = atol(optarg);
+				break;
+			case 'g':
+				git = 1;
+				break;
+			case 'r':
+				revalidate = atof(optarg);
+				break;
+			case 's':
+				snapshot = 1;
+				break;
+			case 'm':
+				memory = atof(optarg);
+				break;
+			case 'a':
+				audit_hours = atof(optarg);
+				break;
+			case 'A':
+				progress_file = optarg;
+				break;
+			case 'd':
+				dedup = strcmp(optarg, "hardlink") == 0 ? DEDUP_HARDLINK : strcmp(optarg, "reflink") == 0 ? DEDUP_REFLINK : -2;
+				break;
+			case 'D':
+				durability = strcmp(optarg, "atomic") == 0 ? DURABLE_ATOMIC : strcmp(optarg, "fsync") == 0 ? DURABLE_FSYNC : strcmp(optarg, "syncfs") == 0 ? DURABLE_SYNCFS : -1;
+				break;
+			case 'L':
+				follow = 1;
+				break;
+			case 'C':
+				control_socket = optarg;
+				break;
+			case 'c':
+				config = optarg;
+				break;
+			case 'R':
+				receive = optarg;
+				break;
+			default:
+				argc = 0;
+				break;
+		}
+	}
+
+	//a receiver only applies what senders hand it
+	if(receive != 0 && argc - optind == 1 && config == 0)
+		return serve_ring(receive, argv[optind]);
+
+	//pairs come from either the config file or the command line
+	if(receive != 0 || dedup == -2 || durability < 0 || (config == 0 && argc - optind < 2) || (config != 0 && (argc - optind != 0 || journal_file != 0))) {
+		printf("Usage: sentinel [-b bytes_per_sec] [-o ops_per_sec] [-l limits_file] [-t trace_file] [-j journal_file[,journal_file...]] [-w save_window_ms] [-g] [-r revalidate_secs] [-s] [-m cache_megabytes] [-a audit_hours] [-A progress_file] [-d reflink|hardlink] [-D atomic|fsync|syncfs] [-L] [-C control_socket] [src_path] [dest_path...]\n");
+		printf("       sentinel [-b bytes_per_sec] [-o ops_per_sec] [-l limits_file] [-t trace_file] [-w save_window_ms] [-g] [-r revalidate_secs] [-s] [-m cache_megabytes] [-a audit_hours] [-A progress_file] [-d reflink|hardlink] [-D atomic|fsync|syncfs] [-L] [-C control_socket] -c config_file\n");
+		printf("       sentinel -R socket_path root_path\n");
+		printf("       sentinel wait control_socket\n");
 		return -1;
 	}
+	argc -= optind;
+	argv += optind;
+	revalidate_interval = revalidate * 1000000000LL;
 
 	signal(SIGINT, handle_signal);
 	signal(SIGTERM, handle_signal);
+	signal(SIGHUP, handle_reload);
+	signal(SIGUSR1, handle_dump);
+
+	//set up the rate limits, the limits file overrides the command line
+	//and is re-read on SIGHUP
+	throttle = init_throttle(bytes_rate, ops_rate);
+	if(limits != 0) {
+		throttle->config = strndup(limits, 4096);
+		if(load_limits(throttle, limits) < 0) {
+			free_throttle(throttle);
+			return -1;
+		}
+	}
 
-	//initialize a cache and a 3 lists with a capacity of 400
-	cache = init_cache(400);
-	insert_list = init_list(400);
-	delete_list = init_list(400);
-	update_list = init_list(400);
+	if(config != 0)
+		pairs = load_pairs(config, &pair_count);
+	else if((pairs = (struct pair **)malloc(sizeof(struct pair *))) != 0) {
+		//every path after the source is a destination
+		char dests[65536];
+		memset(dests, 0, 65536);
+		for(int i = 1; i < argc; i++) {
+			if(i > 1)
+				strncat(dests, ",", 65535 - strlen(dests));
+			strncat(dests, argv[i], 65535 - strlen(dests));
+		}
+		if((pairs[0] = init_pair(argv[0], dests, journal_file)) != 0)
+			pair_count = 1;
+	}
+	if(pair_count == 0) {
+		cleanup();
+		return -1;
+	}
 
-	printf("Building cache...");
-	//try to build the cache
-	if(build_cache(argv[1]) < 0) {
-		printf("Failed.\n");
+	//initialize the transfer scheduler and its measurements
+	scheduler = init_scheduler(throttle);
+	scheduler->follow = follow;
+	stats = init_stats();
+	scheduler->stats = stats;
+	if(trace_file != 0) {
+		if((trace = init_trace(trace_file)) == 0) {
+			fprintf(stderr, "Error in tracing - Couldn't create file: %s\n", trace_file);
+			cleanup();
+			return -1;
+		}
+		scheduler->trace = trace;
+	}
+
+	//deleted trees are removed by a thread per core, up to 8
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	remover = init_remover(cores < 1 ? 1 : cores > 8 ? 8 : cores);
+	scheduler->remover = remover;
+
+	//stats and small copies are batched when the kernel has io_uring
+	uring = init_uring();
+	scheduler->uring = uring;
+
+	//copies can be published whole and flushed a run at a time
+	if((durable = init_durable(durability)) == 0) {
 		cleanup();
 		return -1;
 	}
-	printf("OK.\n");
+	scheduler->durable = durable;
+
+	//caches of trees bigger than memory live in a file, with only
+	//the budget of it kept resident
+	if(memory > 0) {
+		char *dir = getenv("TMPDIR");
+		if((arena = init_arena(dir != 0 ? dir : "/var/tmp", memory * 1024 * 1024)) == 0) {
+			fprintf(stderr, "Error in cache - Couldn't create file in: %s\n", dir != 0 ? dir : "/var/tmp");
+			cleanup();
+			return -1;
+		}
+	}
 
-	printf("Migrating files...");
-	if(migrate_phy(argv[1], argv[2]) < 0) {
-		printf("Failed.\n");
+	for(int i = 0; i < pair_count; i++) {
+		if(start_pair(pairs[i], git, snapshot, dedup, window) < 0 || stopping) {
+			cleanup();
+			return stopping ? 0 : -1;
+		}
+	}
+
+	//destinations are compared with their sources while there is
+	//nothing else to sync, a destination at a time
+	if(audit_hours > 0) {
+		if((audit = init_audit(audit_hours, progress_file, cores < 1 ? 1 : cores > 8 ? 8 : cores)) == 0) {
+			fprintf(stderr, "Error in audit - Couldn't create audit\n");
+			cleanup();
+			return -1;
+		}
+		for(int i = 0; i < pair_count; i++) {
+			for(int j = 0; j < pairs[i]->target_count; j++) {
+				//a receiver's tree can't be read from here
+				if(pairs[i]->targets[j].socket_path != 0)
+					continue;
+				if(add_audit_root(audit, pairs[i]->src, pairs[i]->targets[j].dest, i, j) < 0) {
+					cleanup();
+					return -1;
+				}
+			}
+		}
+		audit->follow = follow;
+
+		//with only receivers there is nothing to compare
+		if(audit->root_count == 0) {
+			free_audit(audit);
+			audit = 0;
+		}
+		else if(start_audit(audit) < 0) {
+			fprintf(stderr, "Error in audit - Couldn't start threads\n");
+			cleanup();
+			return -1;
+		}
+	}
+	
+	//build scripts can wait on the socket until their changes are synced
+	if(control_socket != 0 && (control = init_control(control_socket)) == 0) {
 		cleanup();
 		return -1;
 	}
+	
+	//a signal only stops the loop, everything is freed once it is out,
+	//since the threads and locks cleanup waits on may be mid-use
+	while(!stopping) {
+		scans++;
+		for(int i = 0; i < pair_count; i++)
+			scan_pair(pairs[i]);
+
+		if(dump) {
+			dump = 0;
+			print_stats(stats, stderr);
+		}
+
+		//unfinished copies take the place of the wait unless they are all
+		//set aside, a client asking to wait ends it with a scan of
+		//everything, so whatever it changed before asking is found now
+		int wait = next_run(scheduler);
+		if(poll_control(control, wait < 0 ? 1000 : wait, scans + 1) > 0) {
+			scans++;
+			force_scan = 1;
+			for(int i = 0; i < pair_count; i++)
+				scan_pair(pairs[i]);
+			force_scan = 0;
+		}
+
+		long long start = now_ns();
+		for(int i = 0; i < pair_count; i++) {
+			if(sync_phy(pairs[i]) < 0)
+				fprintf(stderr, "Sync failed.\n");
+		}
+
+		//run the queued jobs by priority, taking turns between the
+		//pairs, large copies that don't finish are resumed after
+		//the next scan
+		if(run_scheduler(scheduler, 1) < 0)
+			fprintf(stderr, "Error in physical sync - Couldn't transfer files\n");
+		trace_span(trace, "sync", "sync", LANE_SYNC, start, now_ns());
+
+		//clients are answered once the jobs queued for their scan are done
+		answer_waiters(control, scans, scheduler->seq, oldest_pending(scheduler), oldest_held(), take_failed(scheduler));
+
+		//the audit only runs while no changes are found or copied
+		if(audit != 0) {
+			repair_drift();
+			int changed = 0;
+			for(int i = 0; i < pair_count; i++)
+				changed += pairs[i]->insert_list->length + pairs[i]->delete_list->length + pairs[i]->update_list->length + pairs[i]->meta_list->length;
+			set_idle(audit, changed == 0 && !pending(scheduler));
+		}
+
+		for(int i = 0; i < pair_count; i++) {
+			clear(pairs[i]->insert_list);
+			clear(pairs[i]->delete_list);
+			clear(pairs[i]->update_list);
+			clear(pairs[i]->meta_list);
+		}
+	}
+
+	cleanup();
+	return 0;
+}
 
+int start_pair(struct pair *pair, int git, int snapshot, int dedup, long window) {
+	//deletions are held back for a moment in case an editor is saving,
+	//compared with the first destination that can be looked at from here
+	char *local = 0;
+	for(int i = 0; i < pair->target_count && local == 0; i++) {
+		if(pair->targets[i].socket_path == 0)
+			local = pair->targets[i].dest;
+	}
+	pair->saves = init_saves(window, pair->src, local);
+	if(pair->saves != 0)
+		pair->saves->follow = follow;
+
+	//a git checkout's index already holds the stat data of tracked files
+	if(git && (pair->git_index = open_git_index(pair->src)) == 0)
+		fprintf(stderr, "Error in git index - Couldn't read index of: %s\n", pair->src);
+
+	//every pair's cache shares the one arena
+	if(arena != 0) {
+		struct cache *cache = init_arena_cache(400, arena);
+		if(cache == 0) {
+			fprintf(stderr, "Error in cache - Couldn't allocate table: %s\n", pair->src);
+			return -1;
+		}
+		free_cache(pair->cache);
+		pair->cache = cache;
+	}
+
+	printf("Building cache of %s...", pair->src);
+	//try to build the cache
+	if(build_cache(pair, pair->src) < 0) {
+		printf("Failed.\n");
+		return -1;
+	}
 	printf("OK.\n");
-	
-	while(1) {
-		clean_cache();
-		if(update_cache(argv[1]) < 0)
+
+	//the first snapshot is what later scans are compared with
+	if(snapshot && (pair->snapshot = take_snapshot(pair->src, follow)) == 0) {
+		fprintf(stderr, "Error in snapshot - Couldn't read tree: %s\n", pair->src);
+		return -1;
+	}
+
+	char **dests = (char **)calloc(pair->target_count, sizeof(char *));
+	struct ring **rings = (struct ring **)calloc(pair->target_count, sizeof(struct ring *));
+	struct dedup **dedups = (struct dedup **)calloc(pair->target_count, sizeof(struct dedup *));
+	if(dests == 0 || rings == 0 || dedups == 0) {
+		if(dests != 0)
+			free(dests);
+		if(rings != 0)
+			free(rings);
+		if(dedups != 0)
+			free(dedups);
+		return -1;
+	}
+
+	int count = 0;
+	for(int i = 0; i < pair->target_count; i++) {
+		struct target *target = &pair->targets[i];
+		if(target->journal_file != 0 && (target->journal = open_journal(target->journal_file, pair->src, target->dest)) == 0) {
+			fprintf(stderr, "Error in journaling - Couldn't open file: %s\n", target->journal_file);
+			free(dests);
+			free(rings);
+			free(dedups);
+			return -1;
+		}
+
+		//a destination on a receiver is written through shared memory
+		if(target->socket_path != 0 && (target->ring = connect_ring(target->socket_path)) == 0) {
+			free(dests);
+			free(rings);
+			free(dedups);
+			return -1;
+		}
+
+		//every destination gets its own queue so a slow one
+		//can't hold up the others
+		if((target->queue = add_queue(scheduler, pair->cache, target->journal, target->ring)) < 0) {
+			fprintf(stderr, "Error in scheduling - Couldn't add queue: %s -> %s\n", pair->src, target->dest);
+			free(dests);
+			free(rings);
+			free(dedups);
+			return -1;
+		}
+
+		//files on a local destination can be made from others with
+		//the same content there
+		if(dedup >= 0 && target->ring == 0) {
+			if((target->dedup = init_dedup(dedup)) == 0) {
+				free(dests);
+				free(rings);
+				free(dedups);
+				return -1;
+			}
+			scheduler->queues[target->queue].dedup = target->dedup;
+		}
+
+		//the destination was already migrated, only redo unfinished changes
+		if(target->journal != 0 && target->journal->migrated) {
+			printf("Replaying journal of %s...", target->dest);
+			int replayed = replay_journal(target->journal, pair->insert_list, pair->update_list, pair->delete_list);
+			if(replayed < 0) {
+				printf("Failed.\n");
+				free(dests);
+				free(rings);
+				free(dedups);
+				return -1;
+			}
+			printf("OK (%d changes).\n", replayed);
+
+			//changes made while sentinel wasn't running aren't in the journal,
+			//and only touch what changed after it was last written
+			if(target->ring == 0) {
+				printf("Comparing %s with %s...", pair->src, target->dest);
+				size_t before = pair->insert_list->length + pair->update_list->length + pair->delete_list->length + pair->meta_list->length;
+				long long since = target->journal->written > 0 ? target->journal->written - JOURNAL_SLACK * 1000000000LL : 0;
+				if(compare_phy(pair, pair->src, target->dest, since) < 0) {
+					printf("Failed.\n");
+					free(dests);
+					free(rings);
+					free(dedups);
+					return -1;
+				}
+				printf("OK (%zu changes).\n", pair->insert_list->length + pair->update_list->length + pair->delete_list->length + pair->meta_list->length - before);
+			}
+		}
+		else {
+			rings[count] = target->ring;
+			dedups[count] = target->dedup;
+			dests[count++] = target->dest;
+		}
+	}
+
+	//the rest are migrated together
+	if(count > 0) {
+		printf("Migrating files from %s...", pair->src);
+		if(migrate_phy(pair, pair->src, dests, rings, dedups, count) < 0 || flush_durable(durable) < 0) {
+			printf("Failed.\n");
+			free(dests);
+			free(rings);
+			free(dedups);
+			return -1;
+		}
+
+		for(int i = 0; i < pair->target_count; i++) {
+			struct journal *journal = pair->targets[i].journal;
+			if(journal != 0 && !journal->migrated && (journal_migrated(journal) < 0 || sync_journal(journal) < 0))
+				fprintf(stderr, "Error in journaling - Couldn't write file: %s\n", journal->path);
+		}
+
+		printf("OK.\n");
+	}
+	free(dests);
+	free(rings);
+	free(dedups);
+	return 0;
+}
+
+void scan_pair(struct pair *pair) {
+	//after a checkout only the paths git changed are looked at,
+	//everything else is picked up by the next full scan
+	int changed = 0;
+	long long start;
+	if(pair->git_index != 0 && pair->snapshot == 0 && !force_scan) {
+		start = now_ns();
+		if((changed = refresh_git(pair)) < 0)
+			fprintf(stderr, "Git index failed.\n");
+		trace_span(trace, "git index", "scan", LANE_SCAN, start, now_ns());
+	}
+
+	//the whole tree is compared with its last snapshot in one pass
+	if(pair->snapshot != 0) {
+		start = now_ns();
+		if(scan_snapshot(pair) < 0)
+			fprintf(stderr, "Snapshot failed.\n");
+		trace_span(trace, "snapshot", "scan", LANE_SCAN, start, now_ns());
+	}
+	else if(changed <= 0) {
+		start = now_ns();
+		pair->generation++;
+		int scanned = update_cache(pair, pair->src);
+		if(scanned < 0)
 			fprintf(stderr, "Update failed.\n");
-		sleep(1);
-		if(sync_phy(argv[1], argv[2]) < 0)
-			fprintf(stderr, "Sync failed.\n");
-		clear(insert_list);
-		clear(delete_list);
-		clear(update_list);
+		trace_span(trace, "scan", "scan", LANE_SCAN, start, now_ns());
+
+		//anything the scan didn't reach is gone, unless the scan gave up
+		if(scanned == 0) {
+			start = now_ns();
+			sweep_cache(pair);
+			trace_span(trace, "sweep", "scan", LANE_SCAN, start, now_ns());
+		}
+	}
+
+	//a file deleted and created again was saved through a temp file
+	if(collapse_saves(pair->saves, pair->insert_list, pair->update_list, pair->delete_list) < 0)
+		fprintf(stderr, "Save detection failed.\n");
+
+	if(record_changes(pair) < 0)
+		fprintf(stderr, "Journal failed.\n");
+}
+
+/*
+ * Copy the fields of a changed file's snapshot entry to its cache entry
+ */
+static void refresh_node(struct pair *pair, struct snapshot *snapshot, char *path, long long now) {
+	struct filenode *filenode = get(pair->cache, path);
+	long k = find_path(snapshot, path);
+	if(filenode == 0 || k < 0)
+		return;
+	filenode->last_modify_time = snapshot->mtime[k];
+	filenode->change_time = snapshot->ctime[k] / 1000000000LL;
+	filenode->size = snapshot->size[k];
+	filenode->ino = snapshot->ino[k];
+	filenode->mode = snapshot->mode[k];
+	filenode->from_index = 0;
+	filenode->detected = now;
+}
+
+int scan_snapshot(struct pair *pair) {
+	struct snapshot *old = pair->snapshot;
+	struct snapshot *snapshot = take_snapshot(pair->src, follow);
+	if(snapshot == 0)
+		return -1;
+
+	size_t inserts = pair->insert_list->length, updates = pair->update_list->length;
+	size_t metas = pair->meta_list->length, deletes = pair->delete_list->length;
+	if(diff_snapshots(old, snapshot, pair->insert_list, pair->update_list, pair->meta_list, pair->delete_list) < 0) {
+		free_snapshot(snapshot);
+		return -1;
+	}
+
+	//only the changed files are looked up in the cache, deleted ones
+	//first since a file replaced by a directory is deleted and inserted
+	long long now = now_ns();
+	for(size_t i = deletes; i < pair->delete_list->length; i++) {
+		char *path = pair->delete_list->values[i];
+		size_t len = strlen(path);
+		long k = find_path(old, path);
+		if(k < 0)
+			continue;
+		delete(pair->cache, path);
+
+		//everything under a deleted directory follows it in the old snapshot
+		for(k++; k < old->count; k++) {
+			char *child = snapshot_path(old, k);
+			if(strncmp(child, path, len) != 0 || child[len] != '/')
+				break;
+			delete(pair->cache, child);
+		}
+	}
+	for(size_t i = inserts; i < pair->insert_list->length; i++) {
+		struct stat st_info;
+		long k = find_path(snapshot, pair->insert_list->values[i]);
+		if(k < 0)
+			continue;
+		snapshot_stat(snapshot, k, &st_info);
+		if(insert_stat(pair->cache, pair->insert_list->values[i], &st_info) < 0) {
+			fprintf(stderr, "Error in updating cache - Couldn't insert file: %s\n", pair->insert_list->values[i]);
+			continue;
+		}
+		get(pair->cache, pair->insert_list->values[i])->detected = now;
 	}
+	for(size_t i = updates; i < pair->update_list->length; i++)
+		refresh_node(pair, snapshot, pair->update_list->values[i], now);
+	for(size_t i = metas; i < pair->meta_list->length; i++)
+		refresh_node(pair, snapshot, pair->meta_list->values[i], now);
 
+	free_snapshot(old);
+	pair->snapshot = snapshot;
 	return 0;
 }
 
-int build_cache(char *path) {
-	int insert_result, st_res;
+int build_cache(struct pair *pair, char *path) {
 	struct stat st_info;
 
 	char relative_filename[256];
@@ -120,41 +789,62 @@ int build_cache(char *path) {
 
 	if(strcmp(relative_filename, ".") == 0 || strcmp(relative_filename, "..") == 0)
 		return 0;
-	
-	//try to insert the path into the cache
-	insert_result = insert(cache, path);
 
-	//if failed, show failure for entire operation
-	if(insert_result == -1) {
-		fprintf(stderr, "Error in building cache - Failed to insert %s\n", path);
-		return -1;
-	}
-	
-	//open the file, checking for errors
-	if((r_fd = open(path, O_RDONLY)) < 0) {
-		fprintf(stderr, "Error in building cache - Failed to open %s\n", path);
-		return -1;
+	//editor swap and temp files are never synced
+	if(is_temp_file(path))
+		return 0;
+
+	//tracked files take their stat data from the git index, which
+	//only knows a tracked link as a link
+	if(pair->git_index != 0 && index_stat(pair->git_index, path, &st_info) == 0 && !(follow && S_ISLNK(st_info.st_mode))) {
+		if(insert_stat(pair->cache, path, &st_info) < 0) {
+			fprintf(stderr, "Error in building cache - Failed to insert %s\n", path);
+			return -1;
+		}
+		get(pair->cache, path)->from_index = 1;
+		return 0;
 	}
 	
 	//stat the file, checking for errors
-	if((st_res = fstat(r_fd, &st_info)) < 0) {
+	if(stat_path(path, &st_info) < 0) {
 		fprintf(stderr, "Error in building cache - Failed to stat %s\n", path);
-		close(r_fd);
 		return -1;
 	}
 
-	//cleanup before recursion
-	close(r_fd);
+	//a link back up to a directory being built is left out, the
+	//destination would otherwise get copies of the tree inside itself
+	int entered = S_ISDIR(st_info.st_mode) ? enter_dir(&dirs, st_info.st_dev, st_info.st_ino) : 0;
+	if(entered == 1) {
+		fprintf(stderr, "Error in building cache - Skipping link loop: %s\n", path);
+		return 0;
+	}
+	
+	//try to insert the path into the cache, if failed, show failure
+	//for entire operation
+	if(entered < 0 || insert_stat(pair->cache, path, &st_info) < 0) {
+		fprintf(stderr, "Error in building cache - Failed to insert %s\n", path);
+		if(entered == 0 && S_ISDIR(st_info.st_mode))
+			leave_dir(&dirs);
+		return -1;
+	}
 
 	//if the file is a directory, recursively build the cache
 	//by expanding the directory
 	if(S_ISDIR(st_info.st_mode)) {
 		DIR *dp;
 		struct dirent *ep;
+
+		//remember the entries so unchanged directories aren't listed again
+		struct filenode *filenode = get(pair->cache, path);
+		filenode->dir_mtime = st_info.st_mtim.tv_sec * 1000000000LL + st_info.st_mtim.tv_nsec;
+		struct list *children = init_list(16);
 		
 		dp = opendir(path);
 		if(dp != 0) {
 			while((ep = readdir(dp)) != 0) {
+				if(strcmp(ep->d_name, ".") != 0 && strcmp(ep->d_name, "..") != 0)
+					append(children, ep->d_name);
+
 				//we need absolute path here
 				char buf[4096];
 				memset(buf, 0, 4096);
@@ -162,46 +852,77 @@ int build_cache(char *path) {
 
 				//if any of the build_dir calls fail, fail all
 				//the way up
-				if(build_cache(buf) < 0) {
+				if(build_cache(pair, buf) < 0) {
 					closedir(dp);
+					free_list(children);
+					leave_dir(&dirs);
 					return -1;
 				}
 			}
 			closedir(dp);
 		}
+		leave_dir(&dirs);
+
+		//the directory's node is looked up again, entries below it
+		//may have grown the table since
+		if(children == 0 || set_children(pair->cache, get(pair->cache, path), children) < 0) {
+			fprintf(stderr, "Error in building cache - Failed to list %s\n", path);
+			return -1;
+		}
 	}
 
 	//success
 	return 0; 
 }
 
-void clean_cache() {
-	if(cache == 0 || cache->values == 0)
+void sweep_cache(struct pair *pair) {
+	if(pair->cache == 0 || pair->cache->values == 0)
 		return;
 
+	pair->clean_time = now_ns();
+
+	//only the topmost missing file is deleted, its parent is still there
+	for(size_t i = 0; i < pair->cache->capacity; i++) {
+		for(struct filenode *ptr = pair->cache->values[i]; ptr != 0; ptr = ptr->next) {
+			//the walks page in the whole table, so they count toward trimming
+			if(pair->cache->arena != 0)
+				arena_touch(pair->cache->arena);
+			if(ptr->generation == pair->generation)
+				continue;
+
+			char parent[4096];
+			memset(parent, 0, 4096);
+			strncpy(parent, ptr->filename, 4095);
+			struct filenode *parent_node = get(pair->cache, dirname(parent));
+			if(parent_node == 0 || (parent_node->generation == pair->generation && S_ISDIR(parent_node->mode)))
+				append(pair->delete_list, ptr->filename);
+		}
+	}
+
 	//loop through the hash table
-	for(size_t i = 0; i < cache->capacity; i++) {
+	for(size_t i = 0; i < pair->cache->capacity; i++) {
 		struct filenode *ptr, *prev;
-		ptr = cache->values[i];
+		ptr = pair->cache->values[i];
 		prev = 0;
 
 		//loop through the linked lists
 		while(ptr != 0) {
-			//delete the filenode entry if the file doesn't exist
-			if(access(ptr->filename, F_OK) != 0) {
-				append(delete_list, ptr->filename);
+			if(pair->cache->arena != 0)
+				arena_touch(pair->cache->arena);
 
+			//delete the filenode entry if the scan didn't find the file
+			if(ptr->generation != pair->generation) {
 				struct filenode *tmp = ptr->next;
 
 				//first entry
 				if(prev == 0)
-					cache->values[i] = tmp;
+					pair->cache->values[i] = tmp;
 				//somewhere in the list
 				else 
 					prev->next = tmp;
 
 				//free the filenode and then move to the next
-				free_node(ptr);
+				discard_node(pair->cache, ptr);
 				ptr = tmp;
 			}
 			else {
@@ -213,8 +934,7 @@ void clean_cache() {
 	}
 }
 
-int update_cache(char *path) {
-	int st_res;
+int update_cache(struct pair *pair, char *path) {
 	struct stat st_info;
 
 	char relative_filename[256];
@@ -224,98 +944,264 @@ int update_cache(char *path) {
 	//don't check the current or parent directories
 	if(strcmp(relative_filename, ".") == 0 || strcmp(relative_filename, "..") == 0)
 		return 0;
+
+	//editor swap and temp files are never synced
+	if(is_temp_file(path))
+		return 0;
 	
+	struct filenode *filenode = get(pair->cache, path);
+
+	//already looked at during this scan
+	if(filenode != 0 && filenode->generation == pair->generation)
+		return 0;
+
+	//directories that aren't due are only descended into
+	if(filenode != 0 && S_ISDIR(filenode->mode) && !force_scan && now_ns() < filenode->next_scan) {
+		filenode->generation = pair->generation;
+		return scan_dir(pair, path, filenode, 0, 0);
+	}
+
+	return update_stat(pair, path, stat_path(path, &st_info) == 0 ? &st_info : 0);
+}
+
+int stat_path(char *path, struct stat *st_info) {
+	//a link to nothing is kept as a link even when following
+	if(follow && stat(path, st_info) == 0)
+		return 0;
+	return lstat(path, st_info);
+}
+
+int update_stat(struct pair *pair, char *path, struct stat *st_info) {
+	//deleted files aren't marked, so the sweep finds them
+	if(st_info == 0)
+		return 0;
+
+	//neither is a link back up to a directory being scanned
+	if(S_ISDIR(st_info->st_mode) && in_walk(&dirs, st_info->st_dev, st_info->st_ino))
+		return 0;
+
 	//try to insert the path into the cache
-	struct filenode *filenode = get(cache, path);
+	struct filenode *filenode = get(pair->cache, path);
 
-	//file already in cache
-	if(filenode != 0) {	
-		//open the file, checking for errors
-		if((r_fd = open(path, O_RDONLY)) < 0) {
-			fprintf(stderr, "Error in updating cache - Couldn't open file: %s\n", path);
+	//file not in cache, add it and everything under it
+	if(filenode == 0) {
+		//insert the file into the cache
+		if(insert_stat(pair->cache, path, st_info) < 0) {
+			fprintf(stderr, "Error in updating cache - Couldn't insert file: %s\n", path);
 			return -1;
 		}
-
-		//stat the file, checking for errors
-		if((st_res = fstat(r_fd, &st_info)) < 0) {
-			fprintf(stderr, "Error in updating cache - Couldn't stat file: %s\n", path);
-			close(r_fd);
+		filenode = get(pair->cache, path);
+		filenode->detected = now_ns();
+		filenode->generation = pair->generation;
+		if(append(pair->insert_list, path) < 0) {
+			fprintf(stderr, "Error in updating update list - Could't insert file: %s\n", path);
 			return -1;
 		}
-		//no longer needed
-		close(r_fd);
 
-		//check to see if the entry needs to be updated
-		if(st_info.st_mtime != filenode->last_modify_time || st_info.st_size != filenode->size) {
-			filenode->last_modify_time = st_info.st_mtime;
-			filenode->size = st_info.st_size;
-			if(S_ISREG(st_info.st_mode) && append(update_list, path) < 0) {
-				fprintf(stderr, "Error in updating update list - Couldn't insert file: %s\n", path);
-				return -1;
-			}
+		if(S_ISDIR(st_info->st_mode)) {
+			filenode->dir_mtime = st_info->st_mtim.tv_sec * 1000000000LL + st_info->st_mtim.tv_nsec;
+			return scan_dir(pair, path, filenode, 1, 1);
 		}
+		return 0;
 	}
-	else {
-		//insert the file into the cache
-		if(insert(cache, path) < 0) {
-			fprintf(stderr, "Error in updating cache - Couldn't insert file: %s\n", path);
+	filenode->generation = pair->generation;
+
+	//a file replaced by a directory or the other way around has to be
+	//deleted from the destination before it is created again
+	if((st_info->st_mode & S_IFMT) != (filenode->mode & S_IFMT)) {
+		delete(pair->cache, path);
+		if(append(pair->delete_list, path) < 0) {
+			fprintf(stderr, "Error in updating delete list - Couldn't insert file: %s\n", path);
 			return -1;
 		}
-		if(append(insert_list, path) < 0) {
-			fprintf(stderr, "Error in updating update list - Could't insert file: %s\n", path);
+		return update_stat(pair, path, st_info);
+	}
+
+	//a new mtime, size or inode means the content changed (a rename
+	//over the file replaces the inode), a new mode or ctime alone
+	//means only the metadata did (chmod, chown)
+	long long mtime = st_info->st_mtim.tv_sec * 1000000000LL + st_info->st_mtim.tv_nsec;
+	int content = mtime != filenode->last_modify_time || st_info->st_size != filenode->size || st_info->st_ino != filenode->ino;
+	int metadata = st_info->st_mode != filenode->mode || (S_ISREG(st_info->st_mode) && st_info->st_ctime != filenode->change_time);
+
+	//stat data from the git index has only the low 32 bits of the size,
+	//inode and ctime and a mode of 644 or 755, so until the file's own
+	//stat data replaces it only what the index kept is compared
+	if(filenode->from_index) {
+		content = mtime != filenode->last_modify_time || (uint32_t)st_info->st_size != (uint32_t)filenode->size || (uint32_t)st_info->st_ino != (uint32_t)filenode->ino;
+		metadata = !(st_info->st_mode & S_IXUSR) != !(filenode->mode & S_IXUSR) || (uint32_t)st_info->st_ctime != (uint32_t)filenode->change_time;
+		filenode->size = st_info->st_size;
+		filenode->ino = st_info->st_ino;
+		filenode->dev = st_info->st_dev;
+		filenode->from_index = 0;
+	}
+
+	//check to see if the entry needs to be updated
+	if(content) {
+		filenode->last_modify_time = mtime;
+		filenode->size = st_info->st_size;
+		filenode->ino = st_info->st_ino;
+		filenode->dev = st_info->st_dev;
+		filenode->detected = now_ns();
+
+		//a link that points somewhere else is made again
+		if((S_ISREG(st_info->st_mode) || S_ISLNK(st_info->st_mode)) && append(pair->update_list, path) < 0) {
+			fprintf(stderr, "Error in updating update list - Couldn't insert file: %s\n", path);
 			return -1;
 		}
 	}
-	
-	//we need to also recursively update
-	//its children if it is a directory
+	if(metadata && (!content || !S_ISREG(st_info->st_mode))) {
+		filenode->detected = now_ns();
+		if(append(pair->meta_list, path) < 0) {
+			fprintf(stderr, "Error in updating metadata list - Couldn't insert file: %s\n", path);
+			return -1;
+		}
+	}
+	filenode->change_time = st_info->st_ctime;
+	filenode->mode = st_info->st_mode;
+
+	//a directory's entries are only listed again when its mtime
+	//says one was added, removed or renamed
+	if(S_ISDIR(st_info->st_mode)) {
+		int relist = filenode->children == 0 || mtime != filenode->dir_mtime;
+		filenode->dir_mtime = mtime;
+		return scan_dir(pair, path, filenode, 1, relist);
+	}
 
-	//open the file, checking for errors
-	if((r_fd = open(path, O_RDONLY)) < 0) {
-		fprintf(stderr, "Error in updating cache - Couldn't open file: %s\n", path);
-		return -1;
+	//success
+	return 0;
+}
+
+/*
+ * Update the cache from the entries of a directory that was entered
+ * on the walk, as scan_dir
+ */
+static int scan_entries(struct pair *pair, char *path, struct filenode *filenode, int due, int relist) {
+	long long now = now_ns();
+
+	//a directory that can't be listed keeps its old entries and
+	//is tried again next time
+	if(relist && list_dir(pair, path, filenode) < 0)
+		filenode->dir_mtime = 0;
+	if(filenode->children == 0)
+		return 0;
+
+	//files first, so changes to them can be told apart from changes further down
+	size_t before = pair->insert_list->length + pair->update_list->length + pair->meta_list->length + pair->delete_list->length;
+	size_t length = filenode->children->length;
+	char **paths = (char **)malloc((length + 1) * sizeof(char *));
+	struct stat *st_infos = (struct stat *)malloc((length + 1) * sizeof(struct stat));
+	int *results = (int *)malloc((length + 1) * sizeof(int));
+	int count = 0, result = 0;
+	if(paths == 0 || st_infos == 0 || results == 0)
+		result = -1;
+	for(size_t i = 0; result == 0 && i < length; i++) {
+		char buf[4096];
+		memset(buf, 0, 4096);
+		join(buf, path, filenode->children->values[i], 4095);
+
+		//files that aren't due are assumed to still be there
+		struct filenode *child = get(pair->cache, buf);
+		if(child != 0 && !S_ISDIR(child->mode) && !due)
+			child->generation = pair->generation;
+		if(child != 0 && (S_ISDIR(child->mode) || !due))
+			continue;
+		if(is_temp_file(buf) || (child != 0 && child->generation == pair->generation))
+			continue;
+		if((paths[count] = strndup(buf, 4096)) == 0)
+			result = -1;
+		else
+			count++;
 	}
 
-	//stat the file, checking for errors
-	if((st_res = fstat(r_fd, &st_info)) < 0) {
-		fprintf(stderr, "Error in updating cache - Couldn't stat file: %s\n", path);
-		close(r_fd);
+	//the files that are due are stat'ed together, a batch per system call
+	if(result == 0)
+		uring_stat(uring, paths, count, st_infos, results, follow);
+	for(int i = 0; i < count; i++) {
+		if(result == 0 && update_stat(pair, paths[i], results[i] == 0 ? &st_infos[i] : 0) < 0)
+			result = -1;
+		free(paths[i]);
+	}
+	if(paths != 0)
+		free(paths);
+	if(st_infos != 0)
+		free(st_infos);
+	if(results != 0)
+		free(results);
+	if(result < 0)
 		return -1;
+	size_t after = pair->insert_list->length + pair->update_list->length + pair->meta_list->length + pair->delete_list->length;
+
+	//a directory that changed is checked every scan, one that didn't is
+	//checked half as often each time, up to the revalidation interval
+	if(due) {
+		if(relist || after != before)
+			filenode->interval = 0;
+		else
+			filenode->interval = filenode->interval == 0 ? 1000000000LL : filenode->interval * 2;
+		if(filenode->interval > revalidate_interval)
+			filenode->interval = revalidate_interval;
+		filenode->next_scan = now + filenode->interval;
 	}
 
-	//close before recursion
-	close(r_fd);
+	//subdirectories are checked on their own schedules, unless entries
+	//were added or removed here and one of them may have been replaced
+	for(size_t i = 0; i < filenode->children->length; i++) {
+		char buf[4096];
+		memset(buf, 0, 4096);
+		join(buf, path, filenode->children->values[i], 4095);
+
+		struct filenode *child = get(pair->cache, buf);
+		if(child == 0 || !S_ISDIR(child->mode))
+			continue;
+		if(relist)
+			child->next_scan = 0;
+		if(update_cache(pair, buf) < 0)
+			return -1;
+	}
 
-	//if the file is a directory, update its children
-	if(S_ISDIR(st_info.st_mode)) {
-		DIR *dp;
-		struct dirent *ep;
+	//success
+	return 0;
+}
 
-		dp = opendir(path);
-		if(dp != 0) {
-			while((ep = readdir(dp)) != 0) {
-				//get the full path
-				char buf[4096];
-				memset(buf, 0, 4096);
-				join(buf, path, ep->d_name, 4095);
+int scan_dir(struct pair *pair, char *path, struct filenode *filenode, int due, int relist) {
+	//the directory is on the way down while everything under it is scanned
+	int entered = enter_dir(&dirs, filenode->dev, filenode->ino);
+	if(entered != 0)
+		return entered < 0 ? -1 : 0;
+	int result = scan_entries(pair, path, filenode, due, relist);
+	leave_dir(&dirs);
+	return result;
+}
 
-				//try to update the cache recursively,
-				//if it fails, fail all the way up
-				if(update_cache(buf) < 0) {
-					closedir(dp);
-					return -1;
-				}
-			}
+int list_dir(struct pair *pair, char *path, struct filenode *filenode) {
+	DIR *dp;
+	struct dirent *ep;
+
+	if((dp = opendir(path)) == 0)
+		return -1;
+
+	struct list *children = init_list(16);
+	if(children == 0) {
+		closedir(dp);
+		return -1;
+	}
+
+	while((ep = readdir(dp)) != 0) {
+		if(strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+			continue;
+		if(append(children, ep->d_name) < 0) {
+			free_list(children);
 			closedir(dp);
+			return -1;
 		}
 	}
+	closedir(dp);
 
-	//success
-	return 0;
+	return set_children(pair->cache, filenode, children);
 }
 
-int migrate_phy(char *src, char *dest) {
-	int st_res;
+int migrate_phy(struct pair *pair, char *src, char **dests, struct ring **rings, struct dedup **dedups, int count) {
 	struct stat st_info;
 
 	char relative_filename[256];
@@ -326,225 +1212,456 @@ int migrate_phy(char *src, char *dest) {
 	if(strcmp(relative_filename, ".") == 0 || strcmp(relative_filename, "..") == 0)
 		return 0;
 
-	if((r_fd = open(src, O_RDONLY)) < 0) {
-		fprintf(stderr, "Error in physical migration- Couldn't open file: %s\n", src);
-		return -1;
-	}
+	//editor swap and temp files are never synced
+	if(is_temp_file(src))
+		return 0;
 
-	if((st_res = fstat(r_fd, &st_info)) < 0) {
+	if(stat_path(src, &st_info) < 0) {
 		fprintf(stderr, "Error in physical migration - Could not stat file: %s\n", src);
-		close(r_fd);
 		return -1;
 	}
 
-	//close before recursion
-	close(r_fd);
+	//symbolic link, made again pointing to the same place
+	if(S_ISLNK(st_info.st_mode)) {
+		char target[4096];
+		ssize_t len = readlink(src, target, 4095);
+		if(len < 0) {
+			fprintf(stderr, "Error in physical migration - Could not read link: %s\n", src);
+			return -1;
+		}
+		target[len] = 0;
+
+		struct stat dest_info;
+		for(int i = 0; i < count; i++) {
+			if(rings[i] == 0 && lstat(dests[i], &dest_info) == 0)
+				continue;
+			take_op(throttle);
+			if((rings[i] != 0 ? ring_link(rings[i], dests[i], target, &st_info) : make_link(target, dests[i], &st_info)) < 0) {
+				fprintf(stderr, "Error in physical migration - Could not make link: %s -> %s\n", src, dests[i]);
+				return -1;
+			}
+			if(rings[i] == 0)
+				publish(durable, dests[i], 0, 0);
+		}
+		return 0;
+	}
 
-	//directory
+	//directory, unless a link leads back up to one being migrated
+	int entered = S_ISDIR(st_info.st_mode) ? enter_dir(&dirs, st_info.st_dev, st_info.st_ino) : 0;
+	if(entered == 1)
+		return 0;
+	if(entered < 0)
+		return -1;
 	if(S_ISDIR(st_info.st_mode)) {
-		if(access(dest, F_OK) < 0) {
-			mkdir(dest, st_info.st_mode);
+		for(int i = 0; i < count; i++) {
+			if(rings[i] != 0) {
+				take_op(throttle);
+				ring_mkdir(rings[i], dests[i], st_info.st_mode);
+			}
+			else if(access(dests[i], F_OK) < 0) {
+				take_op(throttle);
+				if(mkdir(dests[i], st_info.st_mode) == 0)
+					publish(durable, dests[i], 0, 0);
+			}
+			else
+				sweep_staged(dests[i]);
 		}
 
+		//the paths inside the directory on every destination
+		char *destbufs = (char *)malloc(count * 4096);
+		char **subdests = (char **)malloc(count * sizeof(char *));
+		if(destbufs == 0 || subdests == 0) {
+			if(destbufs != 0)
+				free(destbufs);
+			if(subdests != 0)
+				free(subdests);
+			leave_dir(&dirs);
+			return -1;
+		}
+		for(int i = 0; i < count; i++)
+			subdests[i] = destbufs + i * 4096;
+
 		DIR *dp;
 		struct dirent *ep;
+		int result = 0;
 
 		dp = opendir(src);
 		if(dp != 0) {
 			while((ep = readdir(dp)) != 0) {
 				//get the full path
-				char srcbuf[4096], destbuf[4096];
+				char srcbuf[4096];
 				memset(srcbuf, 0, 4096);
-				memset(destbuf, 0, 4096);
+				memset(destbufs, 0, count * 4096);
 				join(srcbuf, src, ep->d_name, 4095);
-				join(destbuf, dest, ep->d_name, 4095);
+				for(int i = 0; i < count; i++)
+					join(subdests[i], dests[i], ep->d_name, 4095);
 
 				//try to migrate the directory recursively,
 				//if it fails, fail all the way up
-				if(migrate_phy(srcbuf, destbuf) < 0) {
-					closedir(dp);
-					return -1;
+				if(stopping || migrate_phy(pair, srcbuf, subdests, rings, dedups, count) < 0) {
+					result = -1;
+					break;
 				}
 			}
 			closedir(dp);
 		}
+		free(destbufs);
+		free(subdests);
+		leave_dir(&dirs);
+		return result;
 	}
+
 	//regular file (make sure it doesn't already exist so it doesn't write over existing data in the project)
-	else if(S_ISREG(st_info.st_mode) && access(dest, F_OK) < 0) {
-		if((r_fd = open(src, O_RDONLY)) < 0) {
-			fprintf(stderr, "Error in physical migration - Could not open file: %s\n", src);
+	if(S_ISREG(st_info.st_mode)) {
+		struct transfer *transfers = (struct transfer *)malloc(count * sizeof(struct transfer));
+		struct transfer **mirrors = (struct transfer **)malloc(count * sizeof(struct transfer *));
+		int *which = (int *)malloc(count * sizeof(int));
+		if(transfers == 0 || mirrors == 0 || which == 0) {
+			if(transfers != 0)
+				free(transfers);
+			if(mirrors != 0)
+				free(mirrors);
+			if(which != 0)
+				free(which);
 			return -1;
 		}
-		if((w_fd = open(dest, O_WRONLY | O_CREAT, st_info.st_mode)) < 0) {
-			fprintf(stderr, "Error in physical migration - Could not open file: %s\n", dest);
-			close(r_fd);
-			return -1;
+
+		//the first destination missing the file leads,
+		//the others are written from the same reads
+		int opened = 0, result = 0;
+		for(int i = 0; i < count; i++) {
+			if(rings[i] == 0 && access(dests[i], F_OK) == 0)
+				continue;
+			take_op(throttle);
+
+			//content the destination already has is made from there
+			if(dedups[i] != 0 && dedup_file(dedups[i], src, dests[i], &st_info) == 0) {
+				publish(durable, dests[i], 0, 0);
+				continue;
+			}
+
+			//a receiver checks for the file itself, and may copy it in the kernel,
+			//a local copy is written whole before it is seen if asked to
+			int opened_ok;
+			if(rings[i] != 0)
+				opened_ok = open_ring_transfer(&transfers[opened], rings[i], src, dests[i], st_info.st_mode, 1);
+			else if(durable->mode != DURABLE_NONE)
+				opened_ok = open_staged(&transfers[opened], src, dests[i], st_info.st_mode);
+			else
+				opened_ok = open_transfer(&transfers[opened], src, dests[i], st_info.st_mode);
+
+			//nothing else runs yet, so a receiver copying the source a range
+			//at a time is taken to the end here
+			while(opened_ok == 0 && transfers[opened].passed != 0) {
+				if(step_transfer(&transfers[opened], 1024 * 1024, throttle) < 0) {
+					close_transfer(&transfers[opened]);
+					opened_ok = -1;
+				}
+			}
+			if(opened_ok < 0) {
+				fprintf(stderr, "Error in physical migration - Could not open file: %s -> %s\n", src, dests[i]);
+				result = -1;
+				break;
+			}
+			if(transfers[opened].ring != 0 && transfers[opened].handle == 0) {
+				close_transfer(&transfers[opened]);
+				continue;
+			}
+			which[opened] = i;
+			mirrors[opened] = &transfers[opened];
+			opened++;
 		}
 
-		//copy source to destination
-		if(copy(w_fd, r_fd, 256) < 0) {
-			fprintf(stderr, "Error in physical migration - Could not copy files: %s -> %s\n", src, dest);
-			close(r_fd);
-			close(w_fd);
-			return -1;
+		//copy source to destination, skipping holes in sparse files
+		ssize_t copied = 0;
+		if(result == 0 && opened > 0) {
+			//a short chunk means the transfer is complete
+			while((copied = fan_transfer(&transfers[0], mirrors + 1, opened - 1, 1024 * 1024, throttle)) >= 1024 * 1024) {
+				//nothing else runs yet, so a source still being written is waited for here
+				long long wait = transfers[0].due - now_ns();
+				if(transfers[0].due != 0 && wait > 0)
+					poll(0, 0, (int)((wait + 999999) / 1000000));
+			}
+			for(int i = 1; i < opened; i++) {
+				if(mirrors[i] == 0)
+					copied = -1;
+			}
+			if(copied < 0) {
+				fprintf(stderr, "Error in physical migration - Could not copy files: %s -> %s\n", src, dests[0]);
+				result = -1;
+			}
 		}
 
-		close(r_fd);
-		close(w_fd);
+		//remember how the destinations end so appends can be sent alone
+		struct filenode *filenode = get(pair->cache, src);
+		if(result == 0 && opened > 0 && filenode != 0) {
+			filenode->synced_size = transfers[0].offset;
+			filenode->synced_tail = tail_fingerprint(transfers[0].r_fd, transfers[0].offset);
+			filenode->synced_hash = transfer_fingerprint(&transfers[0]);
+		}
+		for(int i = 0; result == 0 && i < opened; i++) {
+			if(dedups[which[i]] != 0)
+				add_content(dedups[which[i]], dests[which[i]], transfers[0].offset, transfer_fingerprint(&transfers[0]));
+		}
+
+		for(int i = 0; i < opened; i++)
+			close_transfer(&transfers[i]);
+		for(int i = 0; result == 0 && i < opened; i++) {
+			if(rings[which[i]] == 0 && publish(durable, dests[which[i]], durable->mode != DURABLE_NONE, 0) < 0)
+				result = -1;
+		}
+		free(transfers);
+		free(mirrors);
+		free(which);
+		return result;
 	}
 
 	return 0;
 }
 
-int delete_phy(char *src, char *dest) {
+int compare_phy(struct pair *pair, char *src, char *dest, long long since) {
+	struct stat st_info, dest_info;
+
+	char relative_filename[256];
+	memset(relative_filename, 0, 256);
+	filename(relative_filename, src, 255);
+
+	if(strcmp(relative_filename, ".") == 0 || strcmp(relative_filename, "..") == 0 || is_temp_file(src))
+		return 0;
+	if(stat_path(src, &st_info) < 0) {
+		fprintf(stderr, "Error in physical comparison - Could not stat file: %s\n", src);
+		return -1;
+	}
+
+	//what didn't change since the journal was written is in it already,
+	//a directory that did may have lost entries
+	long long mtime = st_info.st_mtim.tv_sec * 1000000000LL + st_info.st_mtim.tv_nsec;
+	long long ctime = st_info.st_ctim.tv_sec * 1000000000LL + st_info.st_ctim.tv_nsec;
+	int changed = mtime >= since || ctime >= since;
+	if(!changed && !S_ISDIR(st_info.st_mode))
+		return 0;
+
+	//a file replaced by a directory or the other way around is deleted
+	//first, and everything under a missing directory is missing too
+	int missing = changed && lstat(dest, &dest_info) < 0;
+	if(changed && !missing && (st_info.st_mode & S_IFMT) != (dest_info.st_mode & S_IFMT)) {
+		if(append(pair->delete_list, src) < 0)
+			return -1;
+		missing = 1;
+	}
+	if(missing && append(pair->insert_list, src) < 0)
+		return -1;
+
+	if(changed && !missing && !S_ISDIR(st_info.st_mode)) {
+		int content = 0;
+		if(S_ISREG(st_info.st_mode))
+			content = st_info.st_size != dest_info.st_size || st_info.st_mtim.tv_sec != dest_info.st_mtim.tv_sec || st_info.st_mtim.tv_nsec != dest_info.st_mtim.tv_nsec;
+		else if(S_ISLNK(st_info.st_mode)) {
+			char target[4096], dest_target[4096];
+			ssize_t len = readlink(src, target, 4095), dest_len = readlink(dest, dest_target, 4095);
+			content = len < 0 || len != dest_len || memcmp(target, dest_target, len) != 0;
+		}
+		if(content && append(pair->update_list, src) < 0)
+			return -1;
+		if(content)
+			return 0;
+	}
+
+	//only the metadata of what matches otherwise
+	if(changed && !missing && !S_ISLNK(st_info.st_mode) && ((st_info.st_mode & 07777) != (dest_info.st_mode & 07777) ||
+		(geteuid() == 0 && (st_info.st_uid != dest_info.st_uid || st_info.st_gid != dest_info.st_gid))) && append(pair->meta_list, src) < 0)
+		return -1;
+	if(!S_ISDIR(st_info.st_mode))
+		return 0;
+
+	//directory, unless a link leads back up to one being compared
+	int entered = enter_dir(&dirs, st_info.st_dev, st_info.st_ino);
+	if(entered != 0)
+		return entered < 0 ? -1 : 0;
+
+	DIR *dp;
+	struct dirent *ep;
+	int result = 0;
+	char srcbuf[4096], destbuf[4096];
+
+	if((dp = opendir(src)) != 0) {
+		while(result == 0 && !stopping && (ep = readdir(dp)) != 0) {
+			memset(srcbuf, 0, 4096);
+			memset(destbuf, 0, 4096);
+			join(srcbuf, src, ep->d_name, 4095);
+			join(destbuf, dest, ep->d_name, 4095);
+			result = compare_phy(pair, srcbuf, destbuf, missing ? 0 : since);
+		}
+		closedir(dp);
+	}
+	else
+		result = -1;
+
+	//files only on the destination were deleted from the source, once
+	//the temporary files left there are gone
+	if(result == 0 && changed && !missing)
+		sweep_staged(dest);
+	if(result == 0 && changed && !missing && (dp = opendir(dest)) != 0) {
+		while(!stopping && (ep = readdir(dp)) != 0) {
+			if(strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+				continue;
+			memset(srcbuf, 0, 4096);
+			join(srcbuf, src, ep->d_name, 4095);
+			if(lstat(srcbuf, &st_info) < 0 && errno == ENOENT && !is_temp_file(srcbuf) && append(pair->delete_list, srcbuf) < 0) {
+				result = -1;
+				break;
+			}
+		}
+		closedir(dp);
+	}
+	leave_dir(&dirs);
+	return stopping ? -1 : result;
+}
+
+int delete_phy(struct pair *pair) {
 	int success = 0;
 
 	//sort list based on length
-	sortlen(delete_list, descending);
+	long long start = now_ns();
+	sortlen(pair->delete_list, descending);
+	trace_span(trace, "sort deletes", "sort", LANE_SYNC, start, now_ns());
 
-	//loop through the list looking at longer filenames first
+	//queue longer filenames first
 	//this will ensure subfiles and subdirectories
 	//get deleted before parent directories
-	for(size_t i = 0; i < delete_list->length; i++) {
+	for(size_t i = 0; i < pair->delete_list->length; i++) {
 		//get the relative file name
 		char relative_filename[4096];
 		memset(relative_filename, 0, 4096);
-		relative(relative_filename, delete_list->values[i], src, 4095);
+		relative(relative_filename, pair->delete_list->values[i], pair->src, 4095);
 
-		//get the full name of the file on the destination
-		char full_filename[4096];
-		memset(full_filename, 0, 4096);
-		join(full_filename, dest, relative_filename, 4095);
+		for(int j = 0; j < pair->target_count; j++) {
+			//get the full name of the file on the destination
+			char full_filename[4096];
+			memset(full_filename, 0, 4096);
+			join(full_filename, pair->targets[j].dest, relative_filename, 4095);
 
-		//delete the file from the destination
-		if(rm(full_filename) < 0) {
-			fprintf(stderr, "Error in physical delete - Couldn't remove file: %s\n", full_filename);
-			success = -1;
+			//queue the file to be deleted from the destination
+			if(schedule_delete(scheduler, pair->targets[j].queue, full_filename, pair->clean_time) < 0)
+				success = -1;
 		}
 	}
 	return success;
 }
 
-int update_phy(char *src, char *dest) {
+/*
+ * Queue the files of a list to be created or copied on every destination
+ * of a pair
+ */
+static int fanout_phy(struct pair *pair, struct list *list) {
 	int success = 0;
 
-	//loop through the list
-	for(size_t i = 0; i < update_list->length; i++) {
+	//the names of a file on every destination
+	char *destbufs = (char *)malloc(pair->target_count * 4096);
+	char **dests = (char **)malloc(pair->target_count * sizeof(char *));
+	int *queues = (int *)malloc(pair->target_count * sizeof(int));
+	if(destbufs == 0 || dests == 0 || queues == 0) {
+		if(destbufs != 0)
+			free(destbufs);
+		if(dests != 0)
+			free(dests);
+		if(queues != 0)
+			free(queues);
+		return -1;
+	}
+	for(int j = 0; j < pair->target_count; j++) {
+		dests[j] = destbufs + j * 4096;
+		queues[j] = pair->targets[j].queue;
+	}
+
+	for(size_t i = 0; i < list->length; i++) {
 		//get the relative file name
 		char relative_filename[4096];
 		memset(relative_filename, 0, 4096);
-		relative(relative_filename, update_list->values[i], src, 4095);
+		relative(relative_filename, list->values[i], pair->src, 4095);
 
-		//get the full name of the file on the destination
-		char full_filename[4096];
-		memset(full_filename, 0, 4096);
-		join(full_filename, dest, relative_filename, 4095);
+		//get the full name of the file on the destinations
+		memset(destbufs, 0, pair->target_count * 4096);
+		for(int j = 0; j < pair->target_count; j++)
+			join(dests[j], pair->targets[j].dest, relative_filename, 4095);
 
-		if((r_fd = open(update_list->values[i], O_RDONLY)) < 0) {
-			fprintf(stderr, "Error in physical update - Couldn't open file: %s\n", update_list->values[i]);
-			return -1;
-		}
-
-		if((w_fd = open(full_filename, O_WRONLY | O_TRUNC)) < 0) {
-			fprintf(stderr, "Error in physical update - Couldn't open file: %s\n", full_filename);
-			close(r_fd);
-			return -1;
-		}
-
-		//update the file in the destination
-		if(copy(w_fd, r_fd, 256) < 0) {
-			fprintf(stderr, "Error in physical update - Couldn't update file: %s -> %s\n", update_list->values[i], full_filename);
+		//queue the file to be copied to every destination, reading it once
+		if(schedule_fanout(scheduler, queues, dests, pair->target_count, list->values[i], detected_at(pair, list->values[i])) < 0)
 			success = -1;
-		}
-		close(r_fd);
-		close(w_fd);
 	}
+
+	free(destbufs);
+	free(dests);
+	free(queues);
 	return success;
 }
 
-int insert_phy(char *src, char *dest) {
-	int success = 0;
+int update_phy(struct pair *pair) {
+	//queue the files to be copied over the destinations
+	return fanout_phy(pair, pair->update_list);
+}
 
+int insert_phy(struct pair *pair) {
 	//sort the list based on length
-	sortlen(insert_list, ascending);
+	long long start = now_ns();
+	sortlen(pair->insert_list, ascending);
+	trace_span(trace, "sort inserts", "sort", LANE_SYNC, start, now_ns());
 
-	//loop through the list looking at shorter filenames first
+	//queue shorter filenames first
 	//this will ensure directories are inserted before subfiles
-	//and subdirectories
-	for(size_t i = 0; i < insert_list->length; i++) {
-		int st_res;
-		struct stat st_info;
-		
+	//and subdirectories in the same priority class
+	return fanout_phy(pair, pair->insert_list);
+}
+
+int meta_phy(struct pair *pair) {
+	int success = 0;
+
+	//loop through the list
+	for(size_t i = 0; i < pair->meta_list->length; i++) {
 		//get the relative file name
 		char relative_filename[4096];
 		memset(relative_filename, 0, 4096);
-		relative(relative_filename, insert_list->values[i], src, 4095);
-
-		//get the full name of the file on the destination
-		char full_filename[4096];
-		memset(full_filename, 0, 4096);
-		join(full_filename, dest, relative_filename, 4095);
-
-		if((r_fd = open(insert_list->values[i], O_RDONLY)) < 0) {
-			fprintf(stderr, "Error in physical insert - Couldn't open file: %s\n", insert_list->values[i]);
-			return -1;
-		}
+		relative(relative_filename, pair->meta_list->values[i], pair->src, 4095);
 
-		if((st_res = fstat(r_fd, &st_info)) < 0) {
-			fprintf(stderr, "Error in physical insert - Couldn't stat file: %s\n", insert_list->values[i]);
-			close(r_fd);
-			return -1;
-		}
-
-		close(r_fd);
-
-		if(S_ISDIR(st_info.st_mode)) {
-			if(mkdir(full_filename, st_info.st_mode) < 0) {
-				fprintf(stderr, "Error in physical insert - Couldn't make directory: %s\n", full_filename);
-			}
-		}
-		else {
-			if((r_fd = open(insert_list->values[i], O_RDONLY)) < 0) {
-				fprintf(stderr, "Error in physical insert - Couldn't open file: %s\n", insert_list->values[i]);
-				return -1;
-			}
-			if((w_fd = open(full_filename, O_WRONLY | O_CREAT, st_info.st_mode)) < 0) {
-				fprintf(stderr, "Error in physical insert - Couldn't open file: %s\n", full_filename);
-				close(r_fd);
-				return -1;
-			}
+		for(int j = 0; j < pair->target_count; j++) {
+			//get the full name of the file on the destination
+			char full_filename[4096];
+			memset(full_filename, 0, 4096);
+			join(full_filename, pair->targets[j].dest, relative_filename, 4095);
 
-			//update the file in the destination
-			if(copy(w_fd, r_fd, 256) < 0) {
-				fprintf(stderr, "Error in physical insert - Couldn't update file: %s -> %s\n", insert_list->values[i], full_filename);
+			//queue the metadata to be applied without copying the file
+			if(schedule_meta(scheduler, pair->targets[j].queue, pair->meta_list->values[i], full_filename, detected_at(pair, pair->meta_list->values[i])) < 0)
 				success = -1;
-			}
-			close(r_fd);
-			close(w_fd);
 		}
-		
 	}
 	return success;
 }
 
-int sync_phy(char *src, char *dest) {
+int sync_phy(struct pair *pair) {
 	int success = 0;
 
-	//insert all new files first
-	if(insert_phy(src, dest) < 0) {
-		fprintf(stderr, "Error in physical sync - Couldn't insert file: %s -> %s\n", src, dest);
+	//queue deleted files first so a file replaced by one of
+	//another type is gone before the new one is created
+	if(delete_phy(pair) < 0) {
+		fprintf(stderr, "Error in physical sync - Couldn't delete file: %s\n", pair->src);
 		success = -1;
 	}
 
-	//update any existing files second
-	if(update_phy(src, dest) < 0) {
-		fprintf(stderr, "Error in physical sync - Couldn't udpate file: %s -> %s\n", src, dest);
+	//queue all new files second
+	if(insert_phy(pair) < 0) {
+		fprintf(stderr, "Error in physical sync - Couldn't insert file: %s\n", pair->src);
 		success = -1;
 	}
 
-	//delete any files last
-	if(delete_phy(src, dest) < 0) {
-		fprintf(stderr, "Error in physical sync - Couldn't delete file: %s -> %s\n", src, dest);
+	//queue any existing files third
+	if(update_phy(pair) < 0) {
+		fprintf(stderr, "Error in physical sync - Couldn't udpate file: %s\n", pair->src);
+		success = -1;
+	}
+
+	//queue any metadata changes last
+	if(meta_phy(pair) < 0) {
+		fprintf(stderr, "Error in physical sync - Couldn't update metadata: %s\n", pair->src);
 		success = -1;
 	}
 
@@ -554,24 +1671,173 @@ int sync_phy(char *src, char *dest) {
 void cleanup() {
 	printf("Stopping...");
 
-	//free up allocated memory
-	free_cache(cache);
-	free_list(insert_list);
-	free_list(update_list);
-	free_list(delete_list);
+	//the audit's threads are stopped first, saving its place
+	free_audit(audit);
+	free_control(control);
 
-	//close read file descriptor
-	if(r_fd != -1 && fcntl(r_fd, F_GETFL) >= 0)	
-		close(r_fd);
-
-	//close write file descriptor
-	if(w_fd != -1 && fcntl(w_fd, F_GETFL) >= 0)	
-		close(w_fd);
+	//free up allocated memory
+	for(int i = 0; i < pair_count; i++)
+		free_pair(pairs[i]);
+	if(pairs != 0)
+		free(pairs);
+	free_scheduler(scheduler);
+	free_durable(durable);
+	free_remover(remover);
+	free_uring(uring);
+	free_arena(arena);
+	free_walk(&dirs);
+	free_throttle(throttle);
+	free_trace(trace);
+
+	//show how long changes took to reach the destination
+	print_stats(stats, stderr);
+	free_stats(stats);
 
 	printf("OK\n");
 }
 
 void handle_signal(int sig) {
-	cleanup(); //clean up
-	exit(0); //exit gracefully
-}
\ No newline at end of file
+	//picked up by the main loop
+	stopping = 1;
+}
+
+void handle_reload(int sig) {
+	//picked up before the next throttled operation
+	if(throttle != 0)
+		throttle->reload = 1;
+}
+
+void handle_dump(int sig) {
+	//picked up after the next scan
+	dump = 1;
+}
+
+int record_changes(struct pair *pair) {
+	int success = 0;
+
+	for(int j = 0; j < pair->target_count; j++) {
+		struct journal *journal = pair->targets[j].journal;
+		if(journal == 0)
+			continue;
+
+		//one record per change, then a single flush for all of them
+		for(size_t i = 0; i < pair->insert_list->length; i++) {
+			if(journal_change(journal, 'I', pair->insert_list->values[i]) < 0)
+				success = -1;
+		}
+		for(size_t i = 0; i < pair->update_list->length; i++) {
+			if(journal_change(journal, 'U', pair->update_list->values[i]) < 0)
+				success = -1;
+		}
+		for(size_t i = 0; i < pair->meta_list->length; i++) {
+			if(journal_change(journal, 'A', pair->meta_list->values[i]) < 0)
+				success = -1;
+		}
+		for(size_t i = 0; i < pair->delete_list->length; i++) {
+			if(journal_change(journal, 'D', pair->delete_list->values[i]) < 0)
+				success = -1;
+		}
+
+		if(sync_journal(journal) < 0) {
+			fprintf(stderr, "Error in journaling - Couldn't sync file: %s\n", journal->path);
+			success = -1;
+		}
+	}
+	return success;
+}
+
+long long detected_at(struct pair *pair, char *path) {
+	struct filenode *filenode = get(pair->cache, path);
+	if(filenode == 0 || filenode->detected == 0)
+		return now_ns();
+	return filenode->detected;
+}
+
+int refresh_git(struct pair *pair) {
+	struct list *changed = init_list(400);
+	struct list *removed = init_list(400);
+	int found = diff_git_index(pair->git_index, changed, removed);
+	pair->generation++;
+
+	//files git stopped tracking are gone unless they were only unstaged
+	pair->clean_time = now_ns();
+	for(size_t i = 0; i < removed->length; i++) {
+		if(access(removed->values[i], F_OK) == 0 || get(pair->cache, removed->values[i]) == 0)
+			continue;
+		delete(pair->cache, removed->values[i]);
+		if(append(pair->delete_list, removed->values[i]) < 0)
+			found = -1;
+	}
+
+	//scan each changed file, starting from the first directory
+	//that isn't cached yet so new directories are created too
+	for(size_t i = 0; i < changed->length; i++) {
+		char buf[4096], parent[4096];
+		memset(buf, 0, 4096);
+		strncpy(buf, changed->values[i], 4095);
+		if(access(buf, F_OK) != 0)
+			continue;
+
+		while(get(pair->cache, buf) == 0) {
+			memset(parent, 0, 4096);
+			strncpy(parent, buf, 4095);
+			dirname(parent);
+			if(strcmp(parent, pair->git_index->root) == 0 || get(pair->cache, parent) != 0)
+				break;
+			strncpy(buf, parent, 4095);
+		}
+
+		if(update_cache(pair, buf) < 0)
+			found = -1;
+	}
+
+	free_list(changed);
+	free_list(removed);
+	return found;
+}
+
+void repair_drift() {
+	struct drift *drift = take_drift(audit);
+	long long now = now_ns();
+
+	for(struct drift *ptr = drift; ptr != 0; ptr = ptr->next) {
+		//receivers have no root, so a root remembers its own target
+		struct audit_root *root = &audit->roots[ptr->root];
+		struct pair *pair = pairs[root->pair];
+		struct target *target = &pair->targets[root->target];
+
+		char src[4096], dest[4096];
+		memset(src, 0, 4096);
+		memset(dest, 0, 4096);
+		join(src, pair->src, ptr->path, 4095);
+		join(dest, target->dest, ptr->path, 4095);
+
+		int result;
+		if(ptr->kind == DRIFT_DELETE)
+			result = schedule_delete(scheduler, target->queue, dest, now);
+		else if(ptr->kind == DRIFT_META)
+			result = schedule_meta(scheduler, target->queue, src, dest, now);
+		else {
+			//the destination no longer holds what was last copied, so
+			//the whole file is copied again
+			struct filenode *filenode = get(pair->cache, src);
+			if(filenode != 0)
+				filenode->synced_size = filenode->synced_hash = 0;
+			result = schedule(scheduler, target->queue, src, dest, now);
+		}
+		if(result < 0)
+			fprintf(stderr, "Error in audit - Couldn't queue repair: %s\n", dest);
+	}
+	free_drift(drift);
+}
+
+long long oldest_held() {
+	long long oldest = 0;
+	for(int i = 0; i < pair_count; i++) {
+		for(struct held *held = pairs[i]->saves != 0 ? pairs[i]->saves->held : 0; held != 0; held = held->next) {
+			if(oldest == 0 || held->since < oldest)
+				oldest = held->since;
+		}
+	}
+	return oldest;
+}
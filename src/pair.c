@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pair.h"
+#include "cache.h"
+#include "dedup.h"
+#include "list.h"
+#include "saves.h"
+#include "gitindex.h"
+#include "journal.h"
+#include "ring.h"
+#include "snapshot.h"
+
+/*
+ * Count the items of a comma separated list
+ */
+static int count_items(char *items) {
+	int count = 1;
+	for(char *ptr = items; *ptr != 0; ptr++) {
+		if(*ptr == ',')
+			count++;
+	}
+	return count;
+}
+
+struct pair *init_pair(char *src, char *dests, char *journal_files) {
+	struct pair *pair = (struct pair *)calloc(1, sizeof(struct pair));
+
+	if(pair == 0)
+		return 0;
+
+	//every destination needs its own journal, since each one
+	//finishes the changes at its own pace
+	int count = count_items(dests);
+	if(journal_files != 0 && count_items(journal_files) != count) {
+		fprintf(stderr, "Error in config - Couldn't match journals to destinations: %s\n", dests);
+		free(pair);
+		return 0;
+	}
+
+	pair->src = strndup(src, 4096);
+	pair->targets = (struct target *)calloc(count, sizeof(struct target));
+	if(pair->src == 0 || pair->targets == 0) {
+		free_pair(pair);
+		return 0;
+	}
+
+	char *dest_list = strndup(dests, 65536);
+	char *journal_list = journal_files != 0 ? strndup(journal_files, 65536) : 0;
+	char *dest_save = 0, *journal_save = 0;
+	char *dest = dest_list != 0 ? strtok_r(dest_list, ",", &dest_save) : 0;
+	char *journal_file = journal_list != 0 ? strtok_r(journal_list, ",", &journal_save) : 0;
+	while(dest != 0 && pair->target_count < count) {
+		struct target *target = &pair->targets[pair->target_count++];
+		target->queue = -1;
+
+		//paths on a receiver are reached through its socket
+		char *split;
+		if(strncmp(dest, "ring:", 5) == 0 && (split = strchr(dest + 5, ':')) != 0) {
+			*split = 0;
+			target->socket_path = strndup(dest + 5, 4096);
+			dest = split + 1;
+			if(target->socket_path == 0)
+				break;
+		}
+		target->dest = strndup(dest, 4096);
+		if(journal_file != 0)
+			target->journal_file = strndup(journal_file, 4096);
+		if(target->dest == 0 || (journal_file != 0 && target->journal_file == 0))
+			break;
+
+		dest = strtok_r(0, ",", &dest_save);
+		if(journal_list != 0)
+			journal_file = strtok_r(0, ",", &journal_save);
+	}
+	if(dest_list != 0)
+		free(dest_list);
+	if(journal_list != 0)
+		free(journal_list);
+
+	//initialize a cache and a 4 lists with a capacity of 400
+	pair->cache = init_cache(400);
+	pair->insert_list = init_list(400);
+	pair->delete_list = init_list(400);
+	pair->update_list = init_list(400);
+	pair->meta_list = init_list(400);
+
+	if(pair->target_count != count || pair->targets[count - 1].dest == 0 || (journal_files != 0 && pair->targets[count - 1].journal_file == 0) ||
+		pair->cache == 0 || pair->insert_list == 0 || pair->delete_list == 0 || pair->update_list == 0 || pair->meta_list == 0) {
+		fprintf(stderr, "Error in config - Couldn't set up pair: %s -> %s\n", src, dests);
+		free_pair(pair);
+		return 0;
+	}
+	return pair;
+}
+
+void free_pair(struct pair *pair) {
+	if(pair != 0) {
+		if(pair->src != 0)
+			free(pair->src);
+		for(int i = 0; i < pair->target_count; i++) {
+			if(pair->targets[i].dest != 0)
+				free(pair->targets[i].dest);
+			if(pair->targets[i].journal_file != 0)
+				free(pair->targets[i].journal_file);
+			if(pair->targets[i].socket_path != 0)
+				free(pair->targets[i].socket_path);
+			close_journal(pair->targets[i].journal);
+			close_ring(pair->targets[i].ring);
+			free_dedup(pair->targets[i].dedup);
+		}
+		if(pair->targets != 0)
+			free(pair->targets);
+		if(pair->cache != 0)
+			free_cache(pair->cache);
+		if(pair->insert_list != 0)
+			free_list(pair->insert_list);
+		if(pair->delete_list != 0)
+			free_list(pair->delete_list);
+		if(pair->update_list != 0)
+			free_list(pair->update_list);
+		if(pair->meta_list != 0)
+			free_list(pair->meta_list);
+		free_saves(pair->saves);
+		free_git_index(pair->git_index);
+		free_snapshot(pair->snapshot);
+		free(pair);
+	}
+}
+
+struct pair **load_pairs(char *path, int *count) {
+	FILE *fp;
+	char *line = 0;
+	size_t cap = 0;
+	int lineno = 0;
+	struct pair **pairs = 0;
+
+	*count = 0;
+	if((fp = fopen(path, "r")) == 0) {
+		fprintf(stderr, "Error in config - Couldn't open file: %s\n", path);
+		return 0;
+	}
+
+	while(getline(&line, &cap, fp) > 0) {
+		lineno++;
+		char *src = strtok(line, " \t\r\n");
+		if(src == 0 || src[0] == '#')
+			continue;
+		char *dests = strtok(0, " \t\r\n");
+		char *journal_files = strtok(0, " \t\r\n");
+
+		if(dests == 0 || strtok(0, " \t\r\n") != 0) {
+			fprintf(stderr, "Error in config - Couldn't parse line %d: %s\n", lineno, path);
+			goto fail;
+		}
+
+		struct pair **grown = (struct pair **)realloc(pairs, (*count + 1) * sizeof(struct pair *));
+		if(grown == 0)
+			goto fail;
+		pairs = grown;
+		if((pairs[*count] = init_pair(src, dests, journal_files)) == 0)
+			goto fail;
+		(*count)++;
+	}
+
+	if(line != 0)
+		free(line);
+	fclose(fp);
+
+	if(*count == 0) {
+		fprintf(stderr, "Error in config - No pairs in file: %s\n", path);
+		free(pairs);
+		return 0;
+	}
+	return pairs;
+
+fail:
+	for(int i = 0; i < *count; i++)
+		free_pair(pairs[i]);
+	if(pairs != 0)
+		free(pairs);
+	if(line != 0)
+		free(line);
+	fclose(fp);
+	*count = 0;
+	return 0;
+}
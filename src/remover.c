@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#include "remover.h"
+
+//size of the buffer directory entries are read into
+#define DENTS_SIZE 32768
+
+//entry returned by getdents64
+struct linux_dirent64 {
+	uint64_t		d_ino;
+	int64_t			d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char			d_name[];
+};
+
+//the subdirectories of one tree being removed
+struct batch {
+	int				pending; //queued or running tasks
+	int				failed; //whether a task couldn't remove its subtree
+};
+
+//a subdirectory to remove, named relative to its parent's descriptor
+struct task {
+	int				dir_fd; //parent directory, kept open until the batch is done
+	char			*name; //name of the subdirectory in the parent
+	struct batch	*batch; //tree the subdirectory belongs to
+	struct task		*next;
+};
+
+static int remove_at(int dir_fd, char *name);
+
+/*
+ * Remove every entry of an open directory
+ * Returns 0 if the directory was emptied
+ * Otherwise returns -1
+ */
+static int empty_dir(int fd) {
+	long n;
+	int result = 0;
+
+	//on the heap so deep trees don't run the worker stacks out
+	char *buf = (char *)malloc(DENTS_SIZE);
+	if(buf == 0)
+		return -1;
+
+	while((n = syscall(SYS_getdents64, fd, buf, DENTS_SIZE)) > 0) {
+		for(long pos = 0; pos < n;) {
+			struct linux_dirent64 *ep = (struct linux_dirent64 *)(buf + pos);
+			pos += ep->d_reclen;
+			if(strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+				continue;
+
+			//only directories need more than one call
+			if(ep->d_type == DT_DIR) {
+				if(remove_at(fd, ep->d_name) < 0)
+					result = -1;
+			}
+			else if(unlinkat(fd, ep->d_name, 0) < 0 && errno != ENOENT) {
+				if(errno != EISDIR || remove_at(fd, ep->d_name) < 0)
+					result = -1;
+			}
+		}
+	}
+	free(buf);
+	return n < 0 ? -1 : result;
+}
+
+/*
+ * Remove a file or directory tree named relative to a directory descriptor
+ * Returns 0 if it is gone
+ * Otherwise returns -1
+ */
+static int remove_at(int dir_fd, char *name) {
+	//anything but a directory goes in one call
+	if(unlinkat(dir_fd, name, 0) == 0 || errno == ENOENT)
+		return 0;
+	if(errno != EISDIR && errno != EPERM)
+		return -1;
+
+	int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if(fd < 0)
+		return -1;
+
+	//entries removed while the directory is read can be skipped
+	//on some filesystems, so it is read again if it isn't empty
+	int result;
+	while((result = empty_dir(fd)) == 0 && unlinkat(dir_fd, name, AT_REMOVEDIR) < 0) {
+		if(errno != ENOTEMPTY || lseek(fd, 0, SEEK_SET) < 0) {
+			result = -1;
+			break;
+		}
+	}
+	close(fd);
+	return result;
+}
+
+/*
+ * Take the next task off the queue, the lock must be held
+ */
+static struct task *next_task(struct remover *remover) {
+	struct task *task = remover->head;
+	if(task != 0) {
+		remover->head = task->next;
+		if(remover->head == 0)
+			remover->tail = 0;
+	}
+	return task;
+}
+
+/*
+ * Remove the subtree of a task and report it to its batch
+ */
+static void run_task(struct remover *remover, struct task *task) {
+	int result = remove_at(task->dir_fd, task->name);
+
+	pthread_mutex_lock(&remover->lock);
+	if(result < 0)
+		task->batch->failed = 1;
+	task->batch->pending--;
+	pthread_cond_broadcast(&remover->done);
+	pthread_mutex_unlock(&remover->lock);
+
+	free(task->name);
+	free(task);
+}
+
+/*
+ * Remove queued subtrees until the remover stops
+ */
+static void *work(void *arg) {
+	struct remover *remover = (struct remover *)arg;
+
+	pthread_mutex_lock(&remover->lock);
+	while(!remover->stop) {
+		struct task *task = next_task(remover);
+		if(task == 0) {
+			pthread_cond_wait(&remover->ready, &remover->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&remover->lock);
+		run_task(remover, task);
+		pthread_mutex_lock(&remover->lock);
+	}
+	pthread_mutex_unlock(&remover->lock);
+	return 0;
+}
+
+struct remover *init_remover(int threads) {
+	struct remover *remover = (struct remover *)calloc(1, sizeof(struct remover));
+
+	if(remover == 0)
+		return 0;
+
+	pthread_mutex_init(&remover->lock, 0);
+	pthread_cond_init(&remover->ready, 0);
+	pthread_cond_init(&remover->done, 0);
+
+	if(threads > 0 && (remover->threads = (pthread_t *)calloc(threads, sizeof(pthread_t))) == 0) {
+		free_remover(remover);
+		return 0;
+	}
+	for(int i = 0; i < threads; i++) {
+		if(pthread_create(&remover->threads[i], 0, work, remover) != 0)
+			break;
+		remover->count++;
+	}
+	return remover;
+}
+
+void free_remover(struct remover *remover) {
+	if(remover != 0) {
+		pthread_mutex_lock(&remover->lock);
+		remover->stop = 1;
+		pthread_cond_broadcast(&remover->ready);
+		pthread_mutex_unlock(&remover->lock);
+
+		for(int i = 0; i < remover->count; i++)
+			pthread_join(remover->threads[i], 0);
+		if(remover->threads != 0)
+			free(remover->threads);
+
+		pthread_mutex_destroy(&remover->lock);
+		pthread_cond_destroy(&remover->ready);
+		pthread_cond_destroy(&remover->done);
+		free(remover);
+	}
+}
+
+int remove_tree(struct remover *remover, char *path) {
+	char parent[4096], name[4096];
+	memset(parent, 0, 4096);
+	memset(name, 0, 4096);
+	strncpy(parent, path, 4095);
+	strncpy(name, path, 4095);
+
+	int parent_fd = open(dirname(parent), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(parent_fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	char *base = basename(name);
+
+	//without a pool the whole tree is removed right here
+	if(remover == 0 || remover->count == 0) {
+		int result = remove_at(parent_fd, base);
+		close(parent_fd);
+		return result;
+	}
+
+	//anything but a directory goes in one call
+	if(unlinkat(parent_fd, base, 0) == 0 || errno == ENOENT) {
+		close(parent_fd);
+		return 0;
+	}
+	if(errno != EISDIR && errno != EPERM) {
+		close(parent_fd);
+		return -1;
+	}
+
+	int fd = openat(parent_fd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if(fd < 0) {
+		close(parent_fd);
+		return -1;
+	}
+
+	//files are removed here while the subdirectories, which don't
+	//depend on each other, are shared out to the workers
+	struct batch batch = { 0, 0 };
+	char buf[DENTS_SIZE];
+	long n;
+	while((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for(long pos = 0; pos < n;) {
+			struct linux_dirent64 *ep = (struct linux_dirent64 *)(buf + pos);
+			pos += ep->d_reclen;
+			if(strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+				continue;
+
+			if(ep->d_type != DT_DIR && (unlinkat(fd, ep->d_name, 0) == 0 || errno == ENOENT))
+				continue;
+			if(ep->d_type != DT_DIR && errno != EISDIR) {
+				batch.failed = 1;
+				continue;
+			}
+
+			struct task *task = (struct task *)malloc(sizeof(struct task));
+			if(task == 0 || (task->name = strdup(ep->d_name)) == 0) {
+				if(task != 0)
+					free(task);
+				batch.failed = 1;
+				continue;
+			}
+			task->dir_fd = fd;
+			task->batch = &batch;
+			task->next = 0;
+
+			pthread_mutex_lock(&remover->lock);
+			if(remover->tail == 0)
+				remover->head = task;
+			else
+				remover->tail->next = task;
+			remover->tail = task;
+			batch.pending++;
+			pthread_cond_signal(&remover->ready);
+			pthread_mutex_unlock(&remover->lock);
+		}
+	}
+	if(n < 0)
+		batch.failed = 1;
+
+	//help with the queue until every subtree of this tree is gone
+	pthread_mutex_lock(&remover->lock);
+	while(batch.pending > 0) {
+		struct task *task = next_task(remover);
+		if(task == 0) {
+			pthread_cond_wait(&remover->done, &remover->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&remover->lock);
+		run_task(remover, task);
+		pthread_mutex_lock(&remover->lock);
+	}
+	pthread_mutex_unlock(&remover->lock);
+
+	//anything skipped while reading is picked up by a sequential pass
+	int result = batch.failed ? -1 : 0;
+	if(result == 0 && unlinkat(parent_fd, base, AT_REMOVEDIR) < 0)
+		result = errno == ENOTEMPTY && lseek(fd, 0, SEEK_SET) == 0 ? remove_at(parent_fd, base) : -1;
+
+	close(fd);
+	close(parent_fd);
+	return result;
+}
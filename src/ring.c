@@ -0,0 +1,824 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ring.h"
+#include "transfer.h"
+#include "remover.h"
+#include "utils.h"
+
+//first bytes of the handshake, so a stray connection isn't mistaken for a sender
+#define RING_MAGIC 0x73656e74696e656cUL
+
+//handshake sent along with the shared memory and the eventfds
+struct ring_hello {
+	uint64_t	magic;
+	uint64_t	size; //bytes of the ring
+};
+
+//directory a receiver applies records under, resolved once before any
+//sender is served
+static char ring_root[4096];
+
+//a file being streamed on the receiver
+struct stream {
+	uint64_t		handle; //seq of the record that opened it
+	int				fd; //destination file (-1 if it couldn't be opened)
+	int				error; //errno of the first failure (0 if none)
+	struct stream	*next;
+};
+
+/*
+ * Round a length up to a multiple of 8
+ */
+static size_t align8(size_t n) {
+	return (n + 7) & ~(size_t)7;
+}
+
+/*
+ * Get the path stored after a record
+ */
+static char *record_path(struct ring_record *rec) {
+	return (char *)rec + sizeof(struct ring_record);
+}
+
+/*
+ * Get the data stored after a record's path
+ */
+static char *record_data(struct ring_record *rec) {
+	return record_path(rec) + align8(rec->path_len);
+}
+
+/*
+ * Send descriptors over a unix socket along with a payload
+ * Returns 0 if the message was sent
+ * Otherwise returns -1
+ */
+static int send_fds(int sock, int *fds, int count, void *payload, size_t len) {
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = { payload, len };
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * Receive descriptors sent with send_fds
+ * Returns 0 if count descriptors and the payload were received
+ * Otherwise returns -1
+ */
+static int recv_fds(int sock, int *fds, int count, void *payload, size_t len) {
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = { payload, len };
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+	if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)len)
+		return -1;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg == 0 || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(count * sizeof(int)))
+		return -1;
+	memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+	return 0;
+}
+
+/*
+ * Wait until an eventfd is signalled or the other side hangs up
+ * Returns 0 if the eventfd was signalled
+ * Otherwise returns -1
+ */
+static int wait_event(int event_fd, int sock) {
+	struct pollfd fds[2] = { { event_fd, POLLIN, 0 }, { sock, POLLRDHUP, 0 } };
+	uint64_t value;
+
+	while(poll(fds, 2, -1) < 0) {
+		if(errno != EINTR)
+			return -1;
+	}
+	if(fds[0].revents & POLLIN)
+		return read(event_fd, &value, sizeof(value)) == sizeof(value) ? 0 : -1;
+	return -1;
+}
+
+/*
+ * Signal an eventfd
+ */
+static void signal_event(int event_fd) {
+	uint64_t value = 1;
+	if(write(event_fd, &value, sizeof(value)) < 0)
+		return;
+}
+
+/*
+ * Make room for a record of length bytes at the head of the ring,
+ * padding out the end of the ring if the record doesn't fit there
+ * Returns the record to fill in
+ * Otherwise returns 0
+ */
+static struct ring_record *reserve_record(struct ring *ring, size_t length) {
+	uint64_t head = ring->header->head;
+	size_t pos = head % RING_SIZE;
+	size_t skip = RING_SIZE - pos < length ? RING_SIZE - pos : 0;
+
+	//the receiver frees space as it applies records
+	while(RING_SIZE - (head - __atomic_load_n(&ring->header->tail, __ATOMIC_ACQUIRE)) < skip + length) {
+		if(wait_event(ring->space_fd, ring->sock) < 0)
+			return 0;
+	}
+
+	//too little room for a record header is skipped without one
+	if(skip >= sizeof(struct ring_record)) {
+		struct ring_record *pad = (struct ring_record *)(ring->data + pos);
+		memset(pad, 0, sizeof(struct ring_record));
+		pad->op = RING_PAD;
+		pad->length = skip;
+	}
+
+	ring->reserved = head + skip;
+	struct ring_record *rec = (struct ring_record *)(ring->data + ring->reserved % RING_SIZE);
+	memset(rec, 0, sizeof(struct ring_record));
+	rec->length = length;
+	return rec;
+}
+
+/*
+ * Reserve a record for an operation on a path
+ * Returns the record to fill in
+ * Otherwise returns 0
+ */
+static struct ring_record *new_record(struct ring *ring, enum ring_op op, char *path, size_t data_len) {
+	size_t path_len = path != 0 ? strlen(path) + 1 : 0;
+	struct ring_record *rec = reserve_record(ring, align8(sizeof(struct ring_record) + align8(path_len) + data_len));
+	if(rec == 0)
+		return 0;
+
+	rec->op = op;
+	rec->path_len = path_len;
+	rec->data_len = data_len;
+	if(path != 0)
+		memcpy(record_path(rec), path, path_len);
+	return rec;
+}
+
+/*
+ * Make the reserved record visible to the receiver
+ * Returns the seq of the record
+ */
+static uint64_t publish(struct ring *ring, struct ring_record *rec) {
+	rec->seq = ++ring->seq;
+	__atomic_store_n(&ring->header->head, ring->reserved + rec->length, __ATOMIC_RELEASE);
+	signal_event(ring->data_fd);
+	return rec->seq;
+}
+
+/*
+ * Wait for the receiver to answer a record
+ * Returns the status of the answer
+ * Otherwise returns -1
+ */
+static int wait_ack(struct ring *ring, uint64_t seq) {
+	struct ring_ack ack;
+
+	if(recv(ring->sock, &ack, sizeof(ack), 0) != sizeof(ack) || ack.seq != seq)
+		return -1;
+	if(ack.status < 0) {
+		errno = ack.error;
+		return -1;
+	}
+	return ack.status;
+}
+
+/*
+ * Copy the mode, owner and times of stat info into a record
+ */
+static void set_meta(struct ring_record *rec, struct stat *st_info) {
+	rec->mode = st_info->st_mode;
+	rec->uid = st_info->st_uid;
+	rec->gid = st_info->st_gid;
+	rec->atime_sec = st_info->st_atim.tv_sec;
+	rec->atime_nsec = st_info->st_atim.tv_nsec;
+	rec->mtime_sec = st_info->st_mtim.tv_sec;
+	rec->mtime_nsec = st_info->st_mtim.tv_nsec;
+}
+
+/*
+ * Read the mode, owner and times of a record back into stat info
+ */
+static void get_meta(struct ring_record *rec, struct stat *st_info) {
+	memset(st_info, 0, sizeof(struct stat));
+	st_info->st_mode = rec->mode;
+	st_info->st_uid = rec->uid;
+	st_info->st_gid = rec->gid;
+	st_info->st_atim.tv_sec = rec->atime_sec;
+	st_info->st_atim.tv_nsec = rec->atime_nsec;
+	st_info->st_mtim.tv_sec = rec->mtime_sec;
+	st_info->st_mtim.tv_nsec = rec->mtime_nsec;
+}
+
+struct ring *connect_ring(char *socket_path) {
+	struct sockaddr_un addr;
+	struct ring *ring = (struct ring *)calloc(1, sizeof(struct ring));
+
+	if(ring == 0)
+		return 0;
+	ring->sock = ring->data_fd = ring->space_fd = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+	if((ring->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0 || connect(ring->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Error in ring - Couldn't connect to receiver: %s\n", socket_path);
+		close_ring(ring);
+		return 0;
+	}
+
+	//the memory and eventfds are created here and handed over,
+	//so the receiver only needs access to the socket
+	size_t size = sizeof(struct ring_header) + RING_SIZE;
+	int memfd = memfd_create("sentinel-ring", MFD_CLOEXEC);
+	void *mem = MAP_FAILED;
+	if(memfd >= 0 && ftruncate(memfd, size) == 0)
+		mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	ring->data_fd = eventfd(0, EFD_CLOEXEC);
+	ring->space_fd = eventfd(0, EFD_CLOEXEC);
+
+	struct ring_hello hello = { RING_MAGIC, RING_SIZE };
+	int fds[3] = { memfd, ring->data_fd, ring->space_fd };
+	if(mem == MAP_FAILED || ring->data_fd < 0 || ring->space_fd < 0 || send_fds(ring->sock, fds, 3, &hello, sizeof(hello)) < 0) {
+		fprintf(stderr, "Error in ring - Couldn't share memory with receiver: %s\n", socket_path);
+		if(memfd >= 0)
+			close(memfd);
+		if(mem != MAP_FAILED)
+			munmap(mem, size);
+		close_ring(ring);
+		return 0;
+	}
+	close(memfd);
+
+	ring->header = (struct ring_header *)mem;
+	ring->data = (char *)mem + sizeof(struct ring_header);
+	return ring;
+}
+
+void close_ring(struct ring *ring) {
+	if(ring != 0) {
+		if(ring->header != 0)
+			munmap(ring->header, sizeof(struct ring_header) + RING_SIZE);
+		if(ring->sock >= 0)
+			close(ring->sock);
+		if(ring->data_fd >= 0)
+			close(ring->data_fd);
+		if(ring->space_fd >= 0)
+			close(ring->space_fd);
+		free(ring);
+	}
+}
+
+int ring_mkdir(struct ring *ring, char *path, mode_t mode) {
+	struct ring_record *rec = new_record(ring, RING_MKDIR, path, 0);
+	if(rec == 0)
+		return -1;
+	rec->mode = mode;
+	return wait_ack(ring, publish(ring, rec)) == 0 ? 0 : -1;
+}
+
+int ring_meta(struct ring *ring, char *path, struct stat *st_info) {
+	struct ring_record *rec = new_record(ring, RING_META, path, 0);
+	if(rec == 0)
+		return -1;
+	set_meta(rec, st_info);
+	return wait_ack(ring, publish(ring, rec)) == 0 ? 0 : -1;
+}
+
+int ring_link(struct ring *ring, char *path, char *target, struct stat *st_info) {
+	size_t len = strlen(target) + 1;
+	struct ring_record *rec = new_record(ring, RING_LINK, path, len);
+	if(rec == 0)
+		return -1;
+	set_meta(rec, st_info);
+	memcpy(record_data(rec), target, len);
+	return wait_ack(ring, publish(ring, rec)) == 0 ? 0 : -1;
+}
+
+int ring_delete(struct ring *ring, char *path) {
+	struct ring_record *rec = new_record(ring, RING_DELETE, path, 0);
+	if(rec == 0)
+		return -1;
+	return wait_ack(ring, publish(ring, rec)) == 0 ? 0 : -1;
+}
+
+int ring_copy(struct ring *ring, int fd, char *path, mode_t mode, int exclusive, off_t offset) {
+	struct ring_record *rec = new_record(ring, RING_COPY, path, 0);
+	if(rec == 0)
+		return -1;
+	rec->mode = mode;
+	rec->exclusive = exclusive;
+	rec->offset = offset;
+
+	//the receiver picks the descriptor up when it gets to the record
+	uint64_t seq = publish(ring, rec);
+	if(send_fds(ring->sock, &fd, 1, &seq, sizeof(seq)) < 0)
+		return -1;
+	return wait_ack(ring, seq);
+}
+
+int ring_open(struct ring *ring, char *path, mode_t mode, int exclusive, uint64_t *handle) {
+	struct ring_record *rec = new_record(ring, RING_OPEN, path, 0);
+	if(rec == 0)
+		return -1;
+	rec->mode = mode;
+	rec->exclusive = exclusive;
+
+	//only an exclusive open is answered, the others report
+	//failures when the stream is closed
+	*handle = publish(ring, rec);
+	return exclusive ? wait_ack(ring, *handle) : 0;
+}
+
+char *ring_reserve(struct ring *ring, size_t n) {
+	if(n > RING_MAX_DATA)
+		return 0;
+	struct ring_record *rec = new_record(ring, RING_DATA, 0, n);
+	return rec != 0 ? record_data(rec) : 0;
+}
+
+int ring_commit(struct ring *ring, uint64_t handle, off_t offset, size_t n) {
+	//less data than was reserved may have come in
+	struct ring_record *rec = (struct ring_record *)(ring->data + ring->reserved % RING_SIZE);
+	rec->length = align8(sizeof(struct ring_record) + n);
+	rec->data_len = n;
+	rec->handle = handle;
+	rec->offset = offset;
+	publish(ring, rec);
+	return 0;
+}
+
+int ring_write(struct ring *ring, uint64_t handle, off_t offset, char *buf, size_t n) {
+	char *data = ring_reserve(ring, n);
+	if(data == 0)
+		return -1;
+	memcpy(data, buf, n);
+	return ring_commit(ring, handle, offset, n);
+}
+
+int ring_close(struct ring *ring, uint64_t handle, off_t size, struct stat *st_info) {
+	struct ring_record *rec = new_record(ring, RING_CLOSE, 0, 0);
+	if(rec == 0)
+		return -1;
+	rec->handle = handle;
+	rec->size = size;
+	set_meta(rec, st_info);
+	return wait_ack(ring, publish(ring, rec)) == 0 ? 0 : -1;
+}
+
+void ring_abort(struct ring *ring, uint64_t handle) {
+	struct ring_record *rec = new_record(ring, RING_ABORT, 0, 0);
+	if(rec != 0) {
+		rec->handle = handle;
+		publish(ring, rec);
+	}
+}
+
+/*
+ * Answer a record on the receiver
+ */
+static void send_ack(int sock, uint64_t seq, int status, int error) {
+	struct ring_ack ack = { seq, status, error };
+	send(sock, &ack, sizeof(ack), MSG_NOSIGNAL);
+}
+
+/*
+ * Give an open file the mode, owner and times of a record
+ * Returns 0 if the metadata was applied
+ * Otherwise returns -1
+ */
+static int finish_fd(int fd, struct ring_record *rec) {
+	struct timespec times[2] = { { rec->atime_sec, rec->atime_nsec }, { rec->mtime_sec, rec->mtime_nsec } };
+
+	if(fchmod(fd, rec->mode & 07777) < 0)
+		return -1;
+	if(geteuid() == 0 && fchown(fd, rec->uid, rec->gid) < 0)
+		return -1;
+	return futimens(fd, times);
+}
+
+/*
+ * Resolve a path a sender named to one under the receiver's root, with
+ * every directory it is in resolved so none of them lead outside it
+ * Returns 0 if the path is under the root
+ * Otherwise returns -1
+ */
+static int confine(char *path, char *resolved) {
+	char dir[4096], real[4096];
+	size_t n = strlen(ring_root);
+
+	//only absolute paths that don't step back up
+	if(path[0] != '/') {
+		errno = EACCES;
+		return -1;
+	}
+	for(char *ptr = path; *ptr != 0;) {
+		size_t len = strcspn(ptr, "/");
+		if((len == 1 && ptr[0] == '.') || (len == 2 && ptr[0] == '.' && ptr[1] == '.')) {
+			errno = EACCES;
+			return -1;
+		}
+		ptr += len;
+		while(*ptr == '/')
+			ptr++;
+	}
+
+	//the last name is used as it is, so a link there is replaced, not followed
+	parent_dir(dir, path, 4096);
+	char *name = strrchr(path, '/') + 1;
+	if(realpath(dir, real) == 0)
+		return -1;
+	if(*name != 0 && (strcmp(real, ring_root) == 0 || (strncmp(real, ring_root, n) == 0 && (real[n] == '/' || strcmp(ring_root, "/") == 0)))) {
+		if(snprintf(resolved, 4096, "%s/%s", strcmp(real, "/") == 0 ? "" : real, name) >= 4096) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		return 0;
+	}
+
+	//the root itself
+	if(realpath(path, real) != 0 && strcmp(real, ring_root) == 0) {
+		snprintf(resolved, 4096, "%s", real);
+		return 0;
+	}
+	errno = EACCES;
+	return -1;
+}
+
+/*
+ * Copy a range of a passed descriptor to a path in the kernel, finishing
+ * the copy once the range reaches the end of the descriptor
+ * Returns 0 if the copy was finished, RING_PARTIAL if the descriptor goes
+ * on past the range, RING_FALLBACK if the kernel can't copy between the
+ * two files
+ * Otherwise returns -1
+ */
+static int copy_fd(int fd, struct ring_record *rec, char *path) {
+	struct stat st_info;
+
+	if(rec->offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(rec->offset == 0 && rec->exclusive && faccessat(AT_FDCWD, path, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+		return RING_EXISTS;
+	if(fstat(fd, &st_info) < 0)
+		return -1;
+
+	//the first range creates the file, the others carry on writing it
+	int out = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC | (rec->offset == 0 ? O_CREAT | O_TRUNC : 0), rec->mode);
+	if(out < 0)
+		return -1;
+
+	//reflinked or copied in the kernel when both files allow it,
+	//otherwise the sender streams the data
+	off_t in_off = rec->offset, out_off = rec->offset;
+	off_t end = st_info.st_size - rec->offset > RING_COPY_RANGE ? rec->offset + RING_COPY_RANGE : st_info.st_size;
+	while(in_off < end) {
+		ssize_t n = copy_file_range(fd, &in_off, out, &out_off, end - in_off, 0);
+		if(n < 0 && in_off == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+			close(out);
+			return RING_FALLBACK;
+		}
+		if(n <= 0)
+			break;
+	}
+	if(in_off < end) {
+		close(out);
+		return -1;
+	}
+	if(end < st_info.st_size)
+		return close(out) < 0 ? -1 : RING_PARTIAL;
+
+	struct ring_record meta;
+	memset(&meta, 0, sizeof(meta));
+	meta.mode = st_info.st_mode;
+	meta.uid = st_info.st_uid;
+	meta.gid = st_info.st_gid;
+	meta.atime_sec = st_info.st_atim.tv_sec;
+	meta.atime_nsec = st_info.st_atim.tv_nsec;
+	meta.mtime_sec = st_info.st_mtim.tv_sec;
+	meta.mtime_nsec = st_info.st_mtim.tv_nsec;
+
+	//a source that shrank between ranges is cut to its size
+	int result = ftruncate(out, st_info.st_size) < 0 || finish_fd(out, &meta) < 0 ? -1 : 0;
+	if(close(out) < 0)
+		result = -1;
+	return result;
+}
+
+/*
+ * Find an open stream on the receiver
+ */
+static struct stream *find_stream(struct stream *streams, uint64_t handle) {
+	while(streams != 0 && streams->handle != handle)
+		streams = streams->next;
+	return streams;
+}
+
+/*
+ * Close and forget a stream on the receiver
+ */
+static void drop_stream(struct stream **streams, uint64_t handle) {
+	struct stream **ptr = streams;
+	while(*ptr != 0 && (*ptr)->handle != handle)
+		ptr = &(*ptr)->next;
+
+	if(*ptr != 0) {
+		struct stream *tmp = *ptr;
+		*ptr = tmp->next;
+		if(tmp->fd >= 0)
+			close(tmp->fd);
+		free(tmp);
+	}
+}
+
+/*
+ * Apply a record on the receiver, checked and copied out of the shared
+ * memory so the sender can't change it while it is applied
+ * Returns 0 if the connection can carry on
+ * Otherwise returns -1
+ */
+static int apply_record(int sock, struct ring_record *rec, struct ring_record *shared, struct stream **streams) {
+	char path[4096], target[4096];
+	int named = rec->op == RING_MKDIR || rec->op == RING_META || rec->op == RING_LINK || rec->op == RING_DELETE || rec->op == RING_COPY || rec->op == RING_OPEN;
+	int result = 0, denied = 0;
+
+	//every path carries its terminator and names something under the root
+	if(rec->path_len > 4096)
+		return -1;
+	if(rec->path_len > 0) {
+		memcpy(path, record_path(shared), rec->path_len);
+		if(path[rec->path_len - 1] != 0)
+			return -1;
+	}
+	if(named && (rec->path_len == 0 || confine(path, target) < 0))
+		denied = rec->path_len == 0 ? EINVAL : errno;
+	if(named && denied == 0)
+		memcpy(path, target, 4096);
+
+	if(rec->op == RING_LINK && denied == 0) {
+		if(rec->data_len == 0 || rec->data_len > 4096)
+			denied = EINVAL;
+		else {
+			memcpy(target, record_data(shared), rec->data_len);
+			if(target[rec->data_len - 1] != 0)
+				denied = EINVAL;
+		}
+	}
+
+	//a refused record is still answered, nothing is left to delete
+	//where there is no parent directory
+	if(denied != 0 && rec->op != RING_COPY && rec->op != RING_OPEN) {
+		if(rec->op == RING_DELETE && denied == ENOENT)
+			send_ack(sock, rec->seq, 0, 0);
+		else
+			send_ack(sock, rec->seq, -1, denied);
+		return 0;
+	}
+
+	switch(rec->op) {
+		case RING_MKDIR:
+			result = mkdir(path, rec->mode) < 0 && errno != EEXIST ? -1 : 0;
+			send_ack(sock, rec->seq, result, errno);
+			break;
+		case RING_META: {
+			struct stat st_info, dest_info;
+			get_meta(rec, &st_info);
+
+			//the mode is set through a link, so only a link's own metadata is set on one
+			if(!S_ISLNK(st_info.st_mode) && lstat(path, &dest_info) == 0 && S_ISLNK(dest_info.st_mode)) {
+				errno = ELOOP;
+				result = -1;
+			}
+			else
+				result = apply_metadata(path, &st_info);
+			send_ack(sock, rec->seq, result, errno);
+			break;
+		}
+		case RING_LINK: {
+			struct stat st_info;
+			get_meta(rec, &st_info);
+			result = make_link(target, path, &st_info);
+			send_ack(sock, rec->seq, result, errno);
+			break;
+		}
+		case RING_DELETE:
+			result = remove_tree(0, path);
+			send_ack(sock, rec->seq, result, errno);
+			break;
+		case RING_COPY: {
+			int fd;
+			uint64_t seq;
+			if(recv_fds(sock, &fd, 1, &seq, sizeof(seq)) < 0 || seq != rec->seq)
+				return -1;
+			if(denied != 0) {
+				result = -1;
+				errno = denied;
+			}
+			else
+				result = copy_fd(fd, rec, path);
+			send_ack(sock, rec->seq, result, errno);
+			close(fd);
+			break;
+		}
+		case RING_OPEN: {
+			struct stream *stream = (struct stream *)calloc(1, sizeof(struct stream));
+			if(stream == 0)
+				return -1;
+			stream->handle = rec->seq;
+			stream->fd = -1;
+			if(denied != 0)
+				stream->error = denied;
+			else if((stream->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC | (rec->exclusive ? O_EXCL : 0), rec->mode)) < 0)
+				stream->error = errno;
+			stream->next = *streams;
+			*streams = stream;
+			if(rec->exclusive) {
+				send_ack(sock, rec->seq, stream->error == EEXIST ? RING_EXISTS : stream->error != 0 ? -1 : 0, stream->error);
+				if(stream->error != 0)
+					drop_stream(streams, rec->seq);
+			}
+			break;
+		}
+		case RING_DATA: {
+			//written straight out of the shared memory
+			struct stream *stream = find_stream(*streams, rec->handle);
+			if(stream != 0 && stream->error == 0 && pwrite(stream->fd, record_data(shared), rec->data_len, rec->offset) != rec->data_len)
+				stream->error = errno != 0 ? errno : EIO;
+			break;
+		}
+		case RING_CLOSE: {
+			struct stream *stream = find_stream(*streams, rec->handle);
+			int error = stream == 0 ? EBADF : stream->error;
+			if(error == 0 && (ftruncate(stream->fd, rec->size) < 0 || finish_fd(stream->fd, rec) < 0))
+				error = errno;
+			send_ack(sock, rec->seq, error != 0 ? -1 : 0, error);
+			drop_stream(streams, rec->handle);
+			break;
+		}
+		case RING_ABORT:
+			drop_stream(streams, rec->handle);
+			break;
+	}
+	return 0;
+}
+
+/*
+ * Apply the records of one sender until it hangs up, then close its socket
+ * Runs on its own thread, with the socket passed as the argument
+ */
+static void *serve_connection(void *arg) {
+	int sock = (int)(intptr_t)arg;
+	struct ring_hello hello;
+	int fds[3];
+
+	if(recv_fds(sock, fds, 3, &hello, sizeof(hello)) < 0) {
+		close(sock);
+		return 0;
+	}
+	if(hello.magic != RING_MAGIC || hello.size != RING_SIZE) {
+		fprintf(stderr, "Error in ring - Couldn't accept sender: wrong handshake\n");
+		for(int i = 0; i < 3; i++)
+			close(fds[i]);
+		close(sock);
+		return 0;
+	}
+
+	size_t size = sizeof(struct ring_header) + RING_SIZE;
+	void *mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	if(mem == MAP_FAILED) {
+		fprintf(stderr, "Error in ring - Couldn't map shared memory: %s\n", strerror(errno));
+		close(fds[1]);
+		close(fds[2]);
+		close(sock);
+		return 0;
+	}
+
+	struct ring_header *header = (struct ring_header *)mem;
+	char *data = (char *)mem + sizeof(struct ring_header);
+	struct stream *streams = 0;
+
+	while(1) {
+		uint64_t tail = header->tail;
+		if(__atomic_load_n(&header->head, __ATOMIC_ACQUIRE) == tail) {
+			//nothing left to apply once the sender is gone
+			if(wait_event(fds[1], sock) < 0)
+				break;
+			continue;
+		}
+
+		size_t pos = tail % RING_SIZE;
+		if(RING_SIZE - pos < sizeof(struct ring_record))
+			tail += RING_SIZE - pos;
+		else {
+			//the header is copied before it is checked, so what was checked is what is used
+			struct ring_record *shared = (struct ring_record *)(data + pos);
+			struct ring_record rec = *shared;
+			if(rec.length < sizeof(struct ring_record) || rec.length > RING_SIZE - pos || sizeof(struct ring_record) + align8(rec.path_len) + rec.data_len > rec.length || apply_record(sock, &rec, shared, &streams) < 0) {
+				fprintf(stderr, "Error in ring - Couldn't apply record: %lu\n", (unsigned long)rec.seq);
+				break;
+			}
+			tail += rec.length;
+		}
+		__atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+		signal_event(fds[2]);
+	}
+
+	while(streams != 0)
+		drop_stream(&streams, streams->handle);
+	munmap(mem, size);
+	close(fds[1]);
+	close(fds[2]);
+	close(sock);
+	return 0;
+}
+
+int serve_ring(char *socket_path, char *root) {
+	struct sockaddr_un addr;
+
+	if(realpath(root, ring_root) == 0) {
+		fprintf(stderr, "Error in ring - Couldn't find receiver root: %s\n", root);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+	//only the owner can connect, the peer is checked again below
+	int lsock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	unlink(socket_path);
+	mode_t mask = umask(0177);
+	int bound = lsock >= 0 ? bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) : -1;
+	umask(mask);
+	if(bound < 0 || listen(lsock, 4) < 0) {
+		fprintf(stderr, "Error in ring - Couldn't listen on socket: %s\n", socket_path);
+		if(lsock >= 0)
+			close(lsock);
+		return -1;
+	}
+
+	//each sender gets its own thread, so one that stays connected
+	//doesn't hold up the others
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while(1) {
+		int sock = accept4(lsock, 0, 0, SOCK_CLOEXEC);
+		if(sock < 0)
+			continue;
+
+		//senders run as the same user as the receiver, or as root
+		struct ucred cred = { 0, -1, -1 };
+		socklen_t len = sizeof(cred);
+		if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || (cred.uid != geteuid() && cred.uid != 0)) {
+			fprintf(stderr, "Error in ring - Couldn't accept sender: uid %d isn't allowed\n", (int)cred.uid);
+			close(sock);
+			continue;
+		}
+
+		pthread_t thread;
+		if(pthread_create(&thread, &attr, serve_connection, (void *)(intptr_t)sock) != 0) {
+			fprintf(stderr, "Error in ring - Couldn't start thread for sender: %s\n", strerror(errno));
+			close(sock);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,246 @@
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "saves.h"
+#include "list.h"
+#include "stats.h"
+#include "utils.h"
+
+//suffixes of swap, backup and temp files written while saving
+static const char *temp_suffixes[] = {
+	".swp", ".swo", ".swx", "~", ".tmp", "___jb_tmp___", "___jb_old___", 0,
+};
+
+//prefixes of lock and temp files
+static const char *temp_prefixes[] = {
+	".#", ".goutputstream-", 0,
+};
+
+/*
+ * Hash a path name for the held index (FNV-1a)
+ */
+static size_t hash_path(struct saves *saves, char *path) {
+	size_t h = 14695981039346656037UL;
+	for(char *ptr = path; *ptr != 0; ptr++) {
+		h ^= (unsigned char)*ptr;
+		h *= 1099511628211UL;
+	}
+	return h % saves->capacity;
+}
+
+/*
+ * Stat a source, following a symbolic link only in follow mode and
+ * only if it points to something
+ * Returns 0 if the source was stat'ed
+ * Otherwise returns -1
+ */
+static int stat_source(struct saves *saves, char *src, struct stat *st_info) {
+	if(saves->follow && stat(src, st_info) == 0)
+		return 0;
+	return lstat(src, st_info);
+}
+
+/*
+ * Find the held deletion of a path
+ */
+static struct held *find_held(struct saves *saves, char *path) {
+	struct held *ptr = saves->index[hash_path(saves, path)];
+	while(ptr != 0 && strcmp(ptr->path, path) != 0)
+		ptr = ptr->hnext;
+	return ptr;
+}
+
+/*
+ * Double the size of the index
+ */
+static int grow_index(struct saves *saves) {
+	struct held **index = (struct held **)calloc(saves->capacity * 2, sizeof(struct held *));
+	if(index == 0)
+		return -1;
+
+	//rehash all the entries
+	free(saves->index);
+	saves->index = index;
+	saves->capacity *= 2;
+	for(struct held *ptr = saves->held; ptr != 0; ptr = ptr->next) {
+		size_t h = hash_path(saves, ptr->path);
+		ptr->hnext = index[h];
+		index[h] = ptr;
+	}
+	return 0;
+}
+
+/*
+ * Hold back the deletion of a path, as the newest one
+ * Returns 0 if it was held back
+ * Otherwise returns -1
+ */
+static int add_held(struct saves *saves, char *path, long long since) {
+	struct held *held = (struct held *)malloc(sizeof(struct held));
+	if(held == 0)
+		return -1;
+	if((held->path = strndup(path, 4096)) == 0) {
+		free(held);
+		return -1;
+	}
+	held->since = since;
+
+	//a full index is only slower, so one that can't grow is kept,
+	//it is grown before the deletion is listed so it isn't rehashed twice
+	if(saves->count >= saves->capacity)
+		grow_index(saves);
+	size_t h = hash_path(saves, path);
+	held->hnext = saves->index[h];
+	saves->index[h] = held;
+	saves->count++;
+
+	held->prev = 0;
+	held->next = saves->held;
+	if(saves->held != 0)
+		saves->held->prev = held;
+	saves->held = held;
+	return 0;
+}
+
+/*
+ * Remove a held deletion from the list and the index and free it
+ */
+static void drop_held(struct saves *saves, struct held *held) {
+	struct held **ptr = &saves->index[hash_path(saves, held->path)];
+	while(*ptr != held)
+		ptr = &(*ptr)->hnext;
+	*ptr = held->hnext;
+	saves->count--;
+
+	if(held->prev == 0)
+		saves->held = held->next;
+	else
+		held->prev->next = held->next;
+	if(held->next != 0)
+		held->next->prev = held->prev;
+	free(held->path);
+	free(held);
+}
+
+struct saves *init_saves(long window, char *src, char *dest) {
+	struct saves *saves = (struct saves *)calloc(1, sizeof(struct saves));
+
+	if(saves == 0)
+		return 0;
+
+	saves->window = window * 1000000LL;
+	saves->capacity = 64;
+	saves->index = (struct held **)calloc(saves->capacity, sizeof(struct held *));
+	saves->src = strndup(src, 4096);
+	saves->dest = dest != 0 ? strndup(dest, 4096) : 0;
+	if(saves->index == 0 || saves->src == 0 || (dest != 0 && saves->dest == 0)) {
+		free_saves(saves);
+		return 0;
+	}
+	return saves;
+}
+
+void free_saves(struct saves *saves) {
+	if(saves != 0) {
+		while(saves->held != 0) {
+			struct held *tmp = saves->held->next;
+			free(saves->held->path);
+			free(saves->held);
+			saves->held = tmp;
+		}
+		free(saves->index);
+		if(saves->src != 0)
+			free(saves->src);
+		if(saves->dest != 0)
+			free(saves->dest);
+		free(saves);
+	}
+}
+
+int is_temp_file(char *path) {
+	char name[256];
+	memset(name, 0, 256);
+	filename(name, path, 255);
+	size_t len = strlen(name);
+
+	//vim checks it can write to a directory by creating 4913
+	if(strcmp(name, "4913") == 0)
+		return 1;
+
+	//emacs auto-save files look like #name#
+	if(len > 2 && name[0] == '#' && name[len-1] == '#')
+		return 1;
+
+	for(int i = 0; temp_suffixes[i] != 0; i++) {
+		size_t suflen = strlen(temp_suffixes[i]);
+		if(len > suflen && strcmp(name + len - suflen, temp_suffixes[i]) == 0)
+			return 1;
+	}
+	for(int i = 0; temp_prefixes[i] != 0; i++) {
+		if(strncmp(name, temp_prefixes[i], strlen(temp_prefixes[i])) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+int collapse_saves(struct saves *saves, struct list *insert_list, struct list *update_list, struct list *delete_list) {
+	long long now = now_ns();
+
+	//hold back every new deletion
+	for(size_t i = 0; i < delete_list->length; i++) {
+		if(find_held(saves, delete_list->values[i]) == 0 && add_held(saves, delete_list->values[i], now) < 0)
+			return -1;
+	}
+	clear(delete_list);
+
+	//a held file that was created again was saved over
+	for(size_t i = 0; i < insert_list->length;) {
+		struct held *held = find_held(saves, insert_list->values[i]);
+		if(held == 0) {
+			i++;
+			continue;
+		}
+
+		//compare with what the destination still has, without one
+		//here the source's type has to do
+		char relative_filename[4096], full_filename[4096];
+		memset(relative_filename, 0, 4096);
+		memset(full_filename, 0, 4096);
+		relative(relative_filename, insert_list->values[i], saves->src, 4095);
+		if(saves->dest != 0)
+			join(full_filename, saves->dest, relative_filename, 4095);
+
+		struct stat src_info, dest_info;
+		int same = stat_source(saves, insert_list->values[i], &src_info) == 0 && (saves->dest == 0 || lstat(full_filename, &dest_info) == 0);
+		if(same && S_ISREG(src_info.st_mode) && (saves->dest == 0 || S_ISREG(dest_info.st_mode))) {
+			if(append(update_list, insert_list->values[i]) < 0)
+				return -1;
+		}
+		else {
+			//the type changed, or a directory that was deleted with everything
+			//in it was created again, the old one has to go before the new one
+			if(append(delete_list, insert_list->values[i]) < 0)
+				return -1;
+			drop_held(saves, held);
+			i++;
+			continue;
+		}
+
+		drop_held(saves, held);
+		discard(insert_list, i);
+	}
+
+	//deletions that nothing replaced are real
+	for(struct held *ptr = saves->held; ptr != 0;) {
+		struct held *tmp = ptr->next;
+		if(now - ptr->since >= saves->window) {
+			if(append(delete_list, ptr->path) < 0)
+				return -1;
+			drop_held(saves, ptr);
+		}
+		ptr = tmp;
+	}
+
+	return 0;
+}
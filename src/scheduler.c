@@ -0,0 +1,1058 @@
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+
+#include "scheduler.h"
+#include "throttle.h"
+#include "utils.h"
+#include "stats.h"
+#include "trace.h"
+#include "journal.h"
+#include "cache.h"
+#include "remover.h"
+#include "ring.h"
+#include "uring.h"
+#include "durable.h"
+#include "dedup.h"
+
+//most destinations a chunk read from a source is written to at once
+#define FANOUT_MAX 16
+
+//file extensions that are usually build output
+static const char *generated_exts[] = {
+	".o", ".a", ".so", ".obj", ".lib", ".dll", ".exe", ".class", ".jar", ".pyc",
+	".iso", ".img", ".tar", ".gz", ".xz", ".zip", ".bin", 0,
+};
+
+//directories that usually hold build output or vendored code
+static const char *generated_dirs[] = {
+	"/build/", "/dist/", "/target/", "/node_modules/", "/.git/", 0,
+};
+
+/*
+ * Get the current monotonic time in seconds
+ */
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Stat a source, following a symbolic link only in follow mode and
+ * only if it points to something
+ * Returns 0 if the source was stat'ed
+ * Otherwise returns -1
+ */
+static int stat_source(struct scheduler *scheduler, char *src, struct stat *st_info) {
+	if(scheduler->follow && stat(src, st_info) == 0)
+		return 0;
+	return lstat(src, st_info);
+}
+
+/*
+ * Hash a path name for the job index (FNV-1a)
+ */
+static size_t hash_path(struct scheduler *scheduler, char *path) {
+	size_t h = 14695981039346656037UL;
+	for(char *ptr = path; *ptr != 0; ptr++) {
+		h ^= (unsigned char)*ptr;
+		h *= 1099511628211UL;
+	}
+	return h % scheduler->capacity;
+}
+
+/*
+ * Find the job indexed under a destination path
+ */
+static struct job *lookup(struct scheduler *scheduler, char *dest) {
+	struct job *ptr = scheduler->index[hash_path(scheduler, dest)];
+	while(ptr != 0 && strcmp(ptr->dest, dest) != 0)
+		ptr = ptr->hnext;
+	return ptr;
+}
+
+/*
+ * Remove a job from the index if it is the entry for its path
+ */
+static void unindex(struct scheduler *scheduler, struct job *job) {
+	struct job **ptr = &scheduler->index[hash_path(scheduler, job->dest)];
+	while(*ptr != 0 && *ptr != job)
+		ptr = &(*ptr)->hnext;
+
+	if(*ptr == job) {
+		*ptr = job->hnext;
+		job->hnext = 0;
+		scheduler->count--;
+	}
+}
+
+/*
+ * Double the size of the index
+ */
+static int grow_index(struct scheduler *scheduler) {
+	size_t old_capacity = scheduler->capacity;
+	struct job **old_index = scheduler->index;
+
+	struct job **index = (struct job **)calloc(old_capacity * 2, sizeof(struct job *));
+	if(index == 0)
+		return -1;
+
+	scheduler->index = index;
+	scheduler->capacity = old_capacity * 2;
+
+	//rehash all the entries
+	for(size_t i = 0; i < old_capacity; i++) {
+		struct job *ptr = old_index[i];
+		while(ptr != 0) {
+			struct job *tmp = ptr->hnext;
+			size_t h = hash_path(scheduler, ptr->dest);
+			ptr->hnext = index[h];
+			index[h] = ptr;
+			ptr = tmp;
+		}
+	}
+
+	free(old_index);
+	return 0;
+}
+
+/*
+ * Make a job the index entry for its path, replacing the existing entry
+ */
+static void reindex(struct scheduler *scheduler, struct job *job) {
+	struct job *existing = lookup(scheduler, job->dest);
+	if(existing != 0)
+		unindex(scheduler, existing);
+
+	if(scheduler->count >= scheduler->capacity)
+		grow_index(scheduler);
+
+	size_t h = hash_path(scheduler, job->dest);
+	job->hnext = scheduler->index[h];
+	scheduler->index[h] = job;
+	scheduler->count++;
+}
+
+/*
+ * Add a job to the back of its priority class
+ */
+static void enqueue(struct scheduler *scheduler, struct job *job) {
+	struct queue *queue = &scheduler->queues[job->queue];
+	enum priority p = job->priority;
+	job->next = 0;
+	job->prev = queue->tail[p];
+	if(queue->tail[p] == 0)
+		queue->head[p] = job;
+	else
+		queue->tail[p]->next = job;
+	queue->tail[p] = job;
+}
+
+/*
+ * Remove a job from its priority class
+ */
+static void dequeue(struct scheduler *scheduler, struct job *job) {
+	struct queue *queue = &scheduler->queues[job->queue];
+	enum priority p = job->priority;
+	if(job->prev == 0)
+		queue->head[p] = job->next;
+	else
+		job->prev->next = job->next;
+	if(job->next == 0)
+		queue->tail[p] = job->prev;
+	else
+		job->next->prev = job->prev;
+	job->prev = job->next = 0;
+}
+
+/*
+ * Take a job out of the copies of its source to other destinations,
+ * which carry on without it
+ */
+static void leave_siblings(struct job *job) {
+	if(job->sibling != 0) {
+		struct job *ptr = job->sibling;
+		while(ptr->sibling != job)
+			ptr = ptr->sibling;
+		ptr->sibling = job->sibling == ptr ? 0 : job->sibling;
+		job->sibling = 0;
+	}
+}
+
+/*
+ * Free a job, closing any transfer in progress
+ */
+static void free_job(struct job *job) {
+	if(job != 0) {
+		leave_siblings(job);
+		if(job->kind == JOB_COPY && job->started)
+			close_transfer(&job->transfer);
+		if(job->src != 0)
+			free(job->src);
+		if(job->dest != 0)
+			free(job->dest);
+		free(job);
+	}
+}
+
+/*
+ * Create a job on the heap
+ */
+static struct job *init_job(struct scheduler *scheduler, int queue, enum job_kind kind, char *src, char *dest, long long detected) {
+	struct job *job = (struct job *)calloc(1, sizeof(struct job));
+	if(job == 0)
+		return 0;
+
+	job->kind = kind;
+	job->queue = queue;
+	job->seq = ++scheduler->seq;
+	job->detected = detected;
+	job->queued = now_ns();
+	job->dest = strndup(dest, 4096);
+	if(src != 0)
+		job->src = strndup(src, 4096);
+	if(job->dest == 0 || (src != 0 && job->src == 0)) {
+		free_job(job);
+		return 0;
+	}
+	return job;
+}
+
+/*
+ * Free the finished deletes once nothing can be made obsolete by them
+ */
+static void clear_finished(struct scheduler *scheduler) {
+	while(scheduler->finished != 0) {
+		struct job *tmp = scheduler->finished->next;
+		unindex(scheduler, scheduler->finished);
+		free_job(scheduler->finished);
+		scheduler->finished = tmp;
+	}
+}
+
+/*
+ * Check if a directory containing the job's destination was deleted
+ * after the job was scheduled
+ */
+static int obsolete(struct scheduler *scheduler, struct job *job) {
+	char buf[4096];
+	memset(buf, 0, 4096);
+	strncpy(buf, job->dest, 4095);
+
+	//walk up the destination path one component at a time
+	char *slash;
+	while((slash = strrchr(buf, '/')) != 0 && slash != buf) {
+		*slash = 0;
+		struct job *ancestor = lookup(scheduler, buf);
+		if(ancestor != 0 && ancestor->kind == JOB_DELETE && ancestor->seq > job->seq)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Check if a copy is catching up with a source that changed while it ran,
+ * on its own since its position no longer says what its destination holds
+ */
+static int settling(struct job *job) {
+	return job->kind == JOB_COPY && job->started && (job->transfer.due != 0 || job->transfer.reread >= 0);
+}
+
+/*
+ * Get how long a job is set aside for while its source is given a moment
+ * Returns the time in nanoseconds (0 if it can run now)
+ */
+static long long waiting(struct job *job, long long now) {
+	return job->kind == JOB_COPY && job->started && job->transfer.due > now ? job->transfer.due - now : 0;
+}
+
+/*
+ * Record how long a finished job took to reach the destination
+ */
+static void record_job(struct scheduler *scheduler, struct job *job) {
+	long long done = now_ns();
+	record_latency(scheduler->stats, STAGE_TRANSFER, job->priority, (done - job->queued) / 1000);
+	record_latency(scheduler->stats, STAGE_TOTAL, job->priority, (done - job->detected) / 1000);
+	if(job->kind != JOB_DELETE)
+		record_latency(scheduler->stats, STAGE_SAVE, job->priority, (done - job->saved) / 1000);
+}
+
+/*
+ * Open the files of a copy job
+ * Returns 0 if the copy can be stepped
+ * Otherwise returns -1
+ */
+static int start_copy(struct scheduler *scheduler, struct job *job) {
+	take_op(scheduler->throttle);
+	struct cache *cache = scheduler->queues[job->queue].cache;
+	struct filenode *filenode = cache != 0 ? get(cache, job->src) : 0;
+
+	//a receiver gets whole files, it can't be asked what it already has
+	struct ring *ring = scheduler->queues[job->queue].ring;
+	if(ring != 0) {
+		if(open_ring_transfer(&job->transfer, ring, job->src, job->dest, job->mode, 0) < 0)
+			return -1;
+		job->started = 1;
+		return 0;
+	}
+
+	//a linked destination is replaced instead of written through
+	if(break_link(scheduler->queues[job->queue].dedup, job->dest))
+		job->append_from = 0;
+
+	//a file that only grew gets just its new bytes, as long as the
+	//data the destination already has is still at the same place
+	if(job->append_from > 0 && open_append(&job->transfer, job->src, job->dest, job->append_from, job->hash) == 0) {
+		if(tail_fingerprint(job->transfer.r_fd, job->append_from) == job->tail)
+			job->started = 1;
+		else
+			close_transfer(&job->transfer);
+	}
+
+	if(!job->started) {
+		//the destination won't match what was fingerprinted any more
+		if(filenode != 0)
+			filenode->synced_size = 0;
+
+		//readers see the old file until the new one is complete
+		job->staged = scheduler->durable != 0 && scheduler->durable->mode != DURABLE_NONE;
+		if((job->staged ? open_staged(&job->transfer, job->src, job->dest, job->mode) : open_transfer(&job->transfer, job->src, job->dest, job->mode)) < 0)
+			return -1;
+		job->started = 1;
+	}
+	return 0;
+}
+
+/*
+ * Publish the destination of a job that ran, the job only counts as done
+ * once the destination is flushed if it waits in the batch
+ * Returns 0 if it was published or added to the batch
+ * Otherwise returns -1
+ */
+static int publish_job(struct scheduler *scheduler, struct job *job) {
+	int result = publish(scheduler->durable, job->dest, job->staged, job);
+	job->published = result > 0;
+	return result < 0 ? -1 : 0;
+}
+
+/*
+ * Check if the destination of a copy was written from the version of its
+ * source that is there now, as when a copy caught up with a writer before
+ * the scan found the writes, by its size and times in nanoseconds
+ * A destination the audit found to differ isn't trusted, since its last
+ * copy was forgotten
+ */
+static int same_version(struct scheduler *scheduler, struct job *job) {
+	struct stat src_info, dest_info;
+	struct cache *cache = scheduler->queues[job->queue].cache;
+	struct filenode *filenode = cache != 0 ? get(cache, job->src) : 0;
+
+	if(filenode == 0 || filenode->synced_size == 0 || stat_source(scheduler, job->src, &src_info) < 0 || lstat(job->dest, &dest_info) < 0)
+		return 0;
+	return S_ISREG(src_info.st_mode) && S_ISREG(dest_info.st_mode) && src_info.st_size == filenode->synced_size && src_info.st_size == dest_info.st_size &&
+		src_info.st_mtim.tv_sec == dest_info.st_mtim.tv_sec && src_info.st_mtim.tv_nsec == dest_info.st_mtim.tv_nsec;
+}
+
+/*
+ * Make the destination of a copy from a file on it with the same content
+ * Returns 0 if the destination was made
+ * Otherwise returns -1 and it has to be copied
+ */
+static int dedup_job(struct scheduler *scheduler, struct job *job) {
+	struct queue *queue = &scheduler->queues[job->queue];
+	struct stat st_info;
+
+	//only a new or rewritten file to a local destination, one that only
+	//grew sends less by appending, one that may be unchanged is checked first
+	if(queue->dedup == 0 || queue->ring != 0 || job->append_from > 0 || job->verify)
+		return -1;
+	if(stat_source(scheduler, job->src, &st_info) < 0 || dedup_file(queue->dedup, job->src, job->dest, &st_info) < 0)
+		return -1;
+	take_op(scheduler->throttle);
+
+	//how the destination ends isn't known without reading it again
+	struct filenode *filenode = queue->cache != 0 ? get(queue->cache, job->src) : 0;
+	if(filenode != 0)
+		filenode->synced_size = 0;
+	publish_job(scheduler, job);
+	return 0;
+}
+
+/*
+ * Take a job that ran to completion or failed off its queue, recording
+ * it if it finished, or once its destination is flushed if it waits in
+ * the batch
+ */
+static void finish_job(struct scheduler *scheduler, struct job *job, int result) {
+	dequeue(scheduler, job);
+	job->done = 1;
+	if(result < 0 && (scheduler->failed == 0 || job->seq < scheduler->failed))
+		scheduler->failed = job->seq;
+
+	//the batch holds on to it until then, a newer change is queued anew
+	if(result > 0 && job->published) {
+		unindex(scheduler, job);
+		leave_siblings(job);
+		return;
+	}
+	if(result > 0) {
+		record_job(scheduler, job);
+		struct journal *journal = scheduler->queues[job->queue].journal;
+		if(journal != 0)
+			journal_done(journal, job->dest);
+	}
+
+	//keep finished deletes around so older jobs under them are dropped
+	if(job->kind == JOB_DELETE && result > 0 && lookup(scheduler, job->dest) == job) {
+		job->next = scheduler->finished;
+		scheduler->finished = job;
+	}
+	else {
+		unindex(scheduler, job);
+		free_job(job);
+	}
+}
+
+/*
+ * Run one step of a job
+ * Returns 1 if the job finished, 0 if it has more work to do
+ * Otherwise returns -1
+ */
+static int run_job(struct scheduler *scheduler, struct job *job) {
+	long long start = now_ns();
+
+	struct ring *ring = scheduler->queues[job->queue].ring;
+	if(job->kind == JOB_DELETE) {
+		int result = ring != 0 ? ring_delete(ring, job->dest) : remove_tree(scheduler->remover, job->dest);
+		trace_span(scheduler->trace, job->dest, "delete", LANE_COPY + job->priority, start, now_ns());
+		if(result < 0) {
+			fprintf(stderr, "Error in physical delete - Couldn't remove file: %s\n", job->dest);
+			return -1;
+		}
+		return 1;
+	}
+
+	//the parent directory was deleted after this job was queued
+	if(!job->started && obsolete(scheduler, job))
+		return 1;
+
+	if(job->kind == JOB_MKDIR) {
+		take_op(scheduler->throttle);
+		int result = ring != 0 ? ring_mkdir(ring, job->dest, job->mode) : mkdir(job->dest, job->mode);
+		trace_span(scheduler->trace, job->dest, "mkdir", LANE_COPY + job->priority, start, now_ns());
+		if(result < 0 && (ring != 0 || errno != EEXIST)) {
+			fprintf(stderr, "Error in physical insert - Couldn't make directory: %s\n", job->dest);
+			return -1;
+		}
+		if(ring == 0 && publish_job(scheduler, job) < 0)
+			return -1;
+		return 1;
+	}
+
+	//a link is made again pointing to wherever the source points now
+	if(job->kind == JOB_LINK) {
+		struct stat st_info;
+		char target[4096];
+		take_op(scheduler->throttle);
+		ssize_t len = lstat(job->src, &st_info) == 0 ? readlink(job->src, target, 4095) : -1;
+		int result = -1;
+		if(len >= 0) {
+			target[len] = 0;
+			result = ring != 0 ? ring_link(ring, job->dest, target, &st_info) : make_link(target, job->dest, &st_info);
+		}
+		trace_span(scheduler->trace, job->dest, "link", LANE_COPY + job->priority, start, now_ns());
+		if(result < 0) {
+			fprintf(stderr, "Error in physical insert - Couldn't make link: %s -> %s\n", job->src, job->dest);
+			return -1;
+		}
+		if(ring == 0 && publish_job(scheduler, job) < 0)
+			return -1;
+		return 1;
+	}
+
+	//only the metadata of a destination that has this version can differ
+	if(job->kind == JOB_COPY && !job->started && ring == 0 && same_version(scheduler, job)) {
+		job->kind = JOB_META;
+		job->verify = 0;
+	}
+
+	//metadata set on a linked destination would show on the files
+	//it is linked to as well, so it gets a copy of its own
+	struct dedup *dedup = scheduler->queues[job->queue].dedup;
+	if((job->kind == JOB_META || job->verify) && !job->started && break_link(dedup, job->dest)) {
+		job->kind = JOB_COPY;
+		job->verify = 0;
+	}
+
+	//content the destination already has is made from the file holding it
+	if(job->kind == JOB_COPY && !job->started && dedup_job(scheduler, job) == 0) {
+		trace_span(scheduler->trace, job->dest, "dedup", LANE_COPY + job->priority, start, now_ns());
+		return 1;
+	}
+
+	//the file was touched or had its owner or permissions changed
+	if(job->kind == JOB_META || (job->kind == JOB_COPY && !job->started && job->verify && content_fingerprint(job->src) == job->hash)) {
+		struct stat st_info;
+		take_op(scheduler->throttle);
+		int result = -1;
+		if(stat_source(scheduler, job->src, &st_info) == 0)
+			result = ring != 0 ? ring_meta(ring, job->dest, &st_info) : apply_metadata(job->dest, &st_info);
+		trace_span(scheduler->trace, job->dest, "meta", LANE_COPY + job->priority, start, now_ns());
+		if(result < 0) {
+			fprintf(stderr, "Error in physical update - Couldn't update metadata: %s -> %s\n", job->src, job->dest);
+			return -1;
+		}
+		return 1;
+	}
+
+	//open the files the first time the copy is run
+	if(!job->started && start_copy(scheduler, job) < 0) {
+		fprintf(stderr, "Error in physical transfer - Couldn't open file: %s -> %s\n", job->src, job->dest);
+		return -1;
+	}
+
+	//copies of the same source to other destinations that are at the
+	//same point are written from the same buffer
+	struct job *peers[FANOUT_MAX];
+	struct transfer *mirrors[FANOUT_MAX];
+	int count = 0;
+	for(struct job *ptr = settling(job) || job->transfer.passed != 0 ? 0 : job->sibling; ptr != 0 && ptr != job && count < FANOUT_MAX; ptr = ptr->sibling) {
+		if(ptr->kind != JOB_COPY || ptr->done || ptr->verify || settling(ptr))
+			continue;
+		//one that isn't next in its own queue could overtake a
+		//delete or mkdir it depends on
+		if(!ptr->started && (ptr->prev != 0 || obsolete(scheduler, ptr) || start_copy(scheduler, ptr) < 0))
+			continue;
+		if(ptr->transfer.passed != 0 || ptr->transfer.offset != job->transfer.offset || ptr->transfer.data_end != job->transfer.data_end ||
+			ptr->transfer.size != job->transfer.size || ptr->transfer.sparse != job->transfer.sparse)
+			continue;
+		peers[count] = ptr;
+		mirrors[count++] = &ptr->transfer;
+	}
+
+	ssize_t copied = fan_transfer(&job->transfer, mirrors, count, scheduler->chunk, scheduler->throttle);
+	trace_span(scheduler->trace, job->dest, "copy", LANE_COPY + job->priority, start, now_ns());
+	if(copied < 0) {
+		fprintf(stderr, "Error in physical transfer - Couldn't copy file: %s -> %s\n", job->src, job->dest);
+		struct cache *cache = scheduler->queues[job->queue].cache;
+		struct filenode *filenode = cache != 0 ? get(cache, job->src) : 0;
+		if(filenode != 0)
+			filenode->synced_size = 0;
+		return -1;
+	}
+
+	//a short chunk means the end of the source was reached
+	if(copied < scheduler->chunk) {
+		//remember how the destination ends for the next append
+		struct cache *cache = scheduler->queues[job->queue].cache;
+		struct filenode *filenode = cache != 0 ? get(cache, job->src) : 0;
+		if(filenode != 0) {
+			filenode->synced_size = job->transfer.offset;
+			filenode->synced_tail = tail_fingerprint(job->transfer.r_fd, job->transfer.offset);
+			filenode->synced_hash = transfer_fingerprint(&job->transfer);
+		}
+		unsigned long hash = transfer_fingerprint(&job->transfer);
+		if(scheduler->queues[job->queue].dedup != 0)
+			add_content(scheduler->queues[job->queue].dedup, job->dest, job->transfer.offset, hash);
+		close_transfer(&job->transfer);
+		job->started = 0;
+
+		//the mirrors that kept up are finished too
+		for(int i = 0; i < count; i++) {
+			if(mirrors[i] != 0 && scheduler->queues[peers[i]->queue].dedup != 0)
+				add_content(scheduler->queues[peers[i]->queue].dedup, peers[i]->dest, mirrors[i]->offset, hash);
+			if(mirrors[i] != 0) {
+				close_transfer(mirrors[i]);
+				peers[i]->started = 0;
+				int result = scheduler->queues[peers[i]->queue].ring == 0 ? publish_job(scheduler, peers[i]) : 0;
+				finish_job(scheduler, peers[i], result < 0 ? -1 : 1);
+			}
+		}
+		if(ring == 0 && publish_job(scheduler, job) < 0)
+			return -1;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Check if a copy can go in a batch, which only makes whole copies of
+ * small files to a local destination
+ */
+static int batchable(struct scheduler *scheduler, struct job *job) {
+	struct dedup *dedup = scheduler->queues[job->queue].dedup;
+	return job->kind == JOB_COPY && !job->started && !job->verify && job->append_from == 0 && job->sibling == 0 &&
+		job->size <= URING_BUF_SIZE && scheduler->queues[job->queue].ring == 0 && (dedup == 0 || !has_size(dedup, job->size));
+}
+
+/*
+ * Copy a run of small files from the front of a class with one system
+ * call, a file the batch couldn't copy is run as a normal job
+ * Returns the number of jobs taken off the queue (0 if there was no batch)
+ * and sets success to -1 if one of them failed
+ */
+static int run_copies(struct scheduler *scheduler, struct job *job, int *success) {
+	struct job *jobs[URING_SLOTS];
+	struct uring_copy copies[URING_SLOTS];
+	char staged[URING_SLOTS][4096];
+	int count = 0;
+
+	if(scheduler->uring == 0 || scheduler->uring->broken)
+		return 0;
+
+	//the run ends before anything that has to happen in order with it
+	for(struct job *ptr = job; ptr != 0 && count < URING_SLOTS && batchable(scheduler, ptr) && !obsolete(scheduler, ptr); ptr = ptr->next) {
+		take_op(scheduler->throttle);
+		take_bytes(scheduler->throttle, ptr->size);
+		memset(&copies[count], 0, sizeof(struct uring_copy));
+		copies[count].src = ptr->src;
+		copies[count].dest = ptr->dest;
+		copies[count].mode = ptr->mode;
+		copies[count].size = ptr->size;
+		break_link(scheduler->queues[ptr->queue].dedup, ptr->dest);
+
+		//a staged copy is written under its temporary name and renamed
+		ptr->staged = scheduler->durable != 0 && scheduler->durable->mode != DURABLE_NONE;
+		if(ptr->staged) {
+			staged_name(ptr->dest, staged[count], 4096);
+			copies[count].dest = staged[count];
+		}
+		jobs[count++] = ptr;
+	}
+
+	long long start = now_ns();
+	if(count == 0 || uring_copy(scheduler->uring, copies, count) < 0)
+		return 0;
+	long long end = now_ns();
+
+	for(int i = 0; i < count; i++) {
+		//the ring has no way to set metadata, so that is done here
+		if(copies[i].result < 0 || apply_metadata(copies[i].dest, &copies[i].st_info) < 0 || publish_job(scheduler, jobs[i]) < 0) {
+			if(jobs[i]->staged)
+				unlink(copies[i].dest);
+			int result = run_job(scheduler, jobs[i]);
+			if(result < 0)
+				*success = -1;
+			if(result != 0)
+				finish_job(scheduler, jobs[i], result);
+			continue;
+		}
+		trace_span(scheduler->trace, jobs[i]->dest, "copy", LANE_COPY + jobs[i]->priority, start, end);
+
+		//the data is still in the buffer, so remember how the
+		//destination ends for the next append without reading it again
+		struct cache *cache = scheduler->queues[jobs[i]->queue].cache;
+		struct filenode *filenode = cache != 0 ? get(cache, jobs[i]->src) : 0;
+		if(filenode != 0) {
+			off_t tail = copies[i].size > TAIL_SIZE ? copies[i].size - TAIL_SIZE : 0;
+			filenode->synced_size = copies[i].size;
+			filenode->synced_tail = buffer_fingerprint(copies[i].data + tail, copies[i].size - tail);
+			filenode->synced_hash = buffer_fingerprint(copies[i].data, copies[i].size);
+		}
+		if(scheduler->queues[jobs[i]->queue].dedup != 0)
+			add_content(scheduler->queues[jobs[i]->queue].dedup, jobs[i]->dest, copies[i].size, buffer_fingerprint(copies[i].data, copies[i].size));
+		finish_job(scheduler, jobs[i], 1);
+	}
+	return count;
+}
+
+struct scheduler *init_scheduler(struct throttle *throttle) {
+	struct scheduler *scheduler = (struct scheduler *)calloc(1, sizeof(struct scheduler));
+
+	if(scheduler == 0)
+		return 0;
+
+	scheduler->capacity = 400;
+	scheduler->index = (struct job **)calloc(scheduler->capacity, sizeof(struct job *));
+	if(scheduler->index == 0) {
+		free(scheduler);
+		return 0;
+	}
+
+	//defaults for classifying files and preempting large copies
+	scheduler->small_size = 64 * 1024;
+	scheduler->large_size = 16 * 1024 * 1024;
+	scheduler->recent = 10;
+	scheduler->chunk = 1024 * 1024;
+	scheduler->throttle = throttle;
+
+	return scheduler;
+}
+
+void free_scheduler(struct scheduler *scheduler) {
+	if(scheduler != 0) {
+		for(int q = 0; q < scheduler->queue_count; q++) {
+			for(int p = 0; p < PRIORITY_COUNT; p++) {
+				struct job *ptr = scheduler->queues[q].head[p];
+				while(ptr != 0) {
+					struct job *tmp = ptr->next;
+					free_job(ptr);
+					ptr = tmp;
+				}
+			}
+		}
+		while(scheduler->finished != 0) {
+			struct job *tmp = scheduler->finished->next;
+			free_job(scheduler->finished);
+			scheduler->finished = tmp;
+		}
+
+		//jobs still waiting to be flushed aren't marked done in the
+		//journal, so they run again after a restart
+		flush_durable(scheduler->durable);
+		struct published *published = take_published(scheduler->durable);
+		while(published != 0) {
+			struct published *tmp = published->next;
+			free_job((struct job *)published->owner);
+			free_published(published);
+			published = tmp;
+		}
+		free(scheduler->index);
+		if(scheduler->queues != 0)
+			free(scheduler->queues);
+		free(scheduler);
+	}
+}
+
+int add_queue(struct scheduler *scheduler, struct cache *cache, struct journal *journal, struct ring *ring) {
+	struct queue *queues = (struct queue *)realloc(scheduler->queues, (scheduler->queue_count + 1) * sizeof(struct queue));
+	if(queues == 0)
+		return -1;
+
+	scheduler->queues = queues;
+	struct queue *queue = &queues[scheduler->queue_count];
+	memset(queue, 0, sizeof(struct queue));
+	queue->cache = cache;
+	queue->journal = journal;
+	queue->ring = ring;
+	return scheduler->queue_count++;
+}
+
+enum priority classify(struct scheduler *scheduler, char *path, struct stat *st_info) {
+	//directories are cheap and everything inside them depends on them
+	if(S_ISDIR(st_info->st_mode))
+		return PRIORITY_HIGH;
+
+	//build output can wait
+	size_t len = strlen(path);
+	for(int i = 0; generated_exts[i] != 0; i++) {
+		size_t extlen = strlen(generated_exts[i]);
+		if(len > extlen && strcmp(path + len - extlen, generated_exts[i]) == 0)
+			return PRIORITY_LOW;
+	}
+	for(int i = 0; generated_dirs[i] != 0; i++) {
+		if(strstr(path, generated_dirs[i]) != 0)
+			return PRIORITY_LOW;
+	}
+
+	if(st_info->st_size >= scheduler->large_size)
+		return PRIORITY_LOW;
+	if(st_info->st_size <= scheduler->small_size || time(0) - st_info->st_mtime <= scheduler->recent)
+		return PRIORITY_HIGH;
+	return PRIORITY_NORMAL;
+}
+
+/*
+ * Queue a source with the given stat info to be created or copied at dest
+ * Returns the queued job, or the copy already under way that takes it in
+ * Otherwise returns 0
+ */
+static struct job *queue_copy(struct scheduler *scheduler, int queue, char *src, char *dest, long long detected, struct stat *st_info) {
+	enum job_kind kind = S_ISDIR(st_info->st_mode) ? JOB_MKDIR : S_ISLNK(st_info->st_mode) ? JOB_LINK : JOB_COPY;
+	struct job *job = init_job(scheduler, queue, kind, src, dest, detected);
+	if(job == 0) {
+		fprintf(stderr, "Error in scheduling - Couldn't create job: %s\n", dest);
+		return 0;
+	}
+	job->mode = st_info->st_mode;
+	job->size = st_info->st_size;
+	job->saved = st_info->st_mtim.tv_sec * 1000000000LL + st_info->st_mtim.tv_nsec;
+	job->priority = classify(scheduler, src, st_info);
+
+	//check if the file only grew since the destination was last written,
+	//or kept its size and maybe its content (small files only, since the
+	//whole file is read to find out)
+	struct cache *cache = scheduler->queues[queue].cache;
+	struct filenode *filenode = cache != 0 ? get(cache, src) : 0;
+	if(job->kind == JOB_COPY && filenode != 0 && filenode->synced_size > 0) {
+		job->hash = filenode->synced_hash;
+		if(st_info->st_size > filenode->synced_size) {
+			job->append_from = filenode->synced_size;
+			job->tail = filenode->synced_tail;
+		}
+		else if(st_info->st_size == filenode->synced_size && job->hash != 0 && st_info->st_size < scheduler->large_size)
+			job->verify = 1;
+	}
+
+	//a copy already under way takes the change in as well, it catches up
+	//with its source at the end, unless it reads a clone or the file
+	//was replaced since
+	struct job *existing = lookup(scheduler, dest);
+	if(existing != 0 && job->kind == JOB_COPY && existing->kind == JOB_COPY && existing->started && !existing->done &&
+		!existing->transfer.frozen && existing->transfer.source.st_ino == st_info->st_ino && existing->transfer.source.st_dev == st_info->st_dev) {
+		free_job(job);
+		return existing;
+	}
+
+	if(existing != 0 && existing->kind == JOB_DELETE && !existing->done) {
+		//the old file has to be removed before the new one is created
+		dequeue(scheduler, existing);
+		existing->priority = job->priority;
+		enqueue(scheduler, existing);
+	}
+	else if(existing != 0 && existing->kind != JOB_DELETE) {
+		//a newer version of the file replaces the pending one,
+		//latency is still measured from the first change
+		if(existing->detected < job->detected)
+			job->detected = existing->detected;
+		dequeue(scheduler, existing);
+		unindex(scheduler, existing);
+		free_job(existing);
+	}
+
+	reindex(scheduler, job);
+	enqueue(scheduler, job);
+	record_latency(scheduler->stats, STAGE_QUEUE, job->priority, (job->queued - job->detected) / 1000);
+	return job;
+}
+
+/*
+ * Record the jobs whose destinations were flushed as done, and copy the
+ * ones that couldn't be published again from scratch
+ */
+static void settle_published(struct scheduler *scheduler) {
+	struct published *published = take_published(scheduler->durable);
+	while(published != 0) {
+		struct published *tmp = published->next;
+		struct job *job = (struct job *)published->owner;
+		struct queue *queue = &scheduler->queues[job->queue];
+
+		if(!published->failed) {
+			record_job(scheduler, job);
+			if(queue->journal != 0)
+				journal_done(queue->journal, job->dest);
+		}
+		else if(scheduler->failed == 0 || job->seq < scheduler->failed)
+			scheduler->failed = job->seq;
+		if(published->failed && job->kind == JOB_COPY) {
+			struct stat st_info;
+			struct filenode *filenode = queue->cache != 0 ? get(queue->cache, job->src) : 0;
+			if(filenode != 0)
+				filenode->synced_size = 0;
+			if(stat_source(scheduler, job->src, &st_info) == 0)
+				queue_copy(scheduler, job->queue, job->src, job->dest, job->detected, &st_info);
+		}
+		free_job(job);
+		free_published(published);
+		published = tmp;
+	}
+}
+
+int schedule(struct scheduler *scheduler, int queue, char *src, char *dest, long long detected) {
+	struct stat st_info;
+
+	if(stat_source(scheduler, src, &st_info) < 0) {
+		fprintf(stderr, "Error in scheduling - Couldn't stat file: %s\n", src);
+		return -1;
+	}
+	return queue_copy(scheduler, queue, src, dest, detected, &st_info) == 0 ? -1 : 0;
+}
+
+int schedule_fanout(struct scheduler *scheduler, int *queues, char **dests, int count, char *src, long long detected) {
+	struct stat st_info;
+	int success = 0;
+
+	//the source is looked at once for every destination
+	if(stat_source(scheduler, src, &st_info) < 0) {
+		fprintf(stderr, "Error in scheduling - Couldn't stat file: %s\n", src);
+		return -1;
+	}
+
+	struct job *first = 0, *last = 0;
+	for(int i = 0; i < count; i++) {
+		struct job *job = queue_copy(scheduler, queues[i], src, dests[i], detected, &st_info);
+		if(job == 0) {
+			success = -1;
+			continue;
+		}
+
+		//a copy already under way keeps the copies it reads for
+		if(job->started)
+			continue;
+
+		//link the copies into a ring so they can share reads
+		if(first == 0)
+			first = job;
+		else
+			last->sibling = job;
+		last = job;
+
+		//the fingerprints of the source's cache entry can come from
+		//another destination, so only this one's size can be trusted
+		if(count > 1)
+			job->verify = 0;
+	}
+	if(last != 0 && last != first)
+		last->sibling = first;
+	return success;
+}
+
+int schedule_meta(struct scheduler *scheduler, int queue, char *src, char *dest, long long detected) {
+	struct stat st_info;
+
+	//a pending job already picks up the latest metadata
+	struct job *existing = lookup(scheduler, dest);
+	if(existing != 0 && existing->kind != JOB_DELETE && !existing->done)
+		return 0;
+
+	if(stat_source(scheduler, src, &st_info) < 0) {
+		fprintf(stderr, "Error in scheduling - Couldn't stat file: %s\n", src);
+		return -1;
+	}
+
+	//a link's metadata comes with the link, so it is made again
+	if(S_ISLNK(st_info.st_mode))
+		return queue_copy(scheduler, queue, src, dest, detected, &st_info) == 0 ? -1 : 0;
+
+	struct job *job = init_job(scheduler, queue, JOB_META, src, dest, detected);
+	if(job == 0) {
+		fprintf(stderr, "Error in scheduling - Couldn't create job: %s\n", dest);
+		return -1;
+	}
+	job->mode = st_info.st_mode;
+	job->saved = st_info.st_ctim.tv_sec * 1000000000LL + st_info.st_ctim.tv_nsec;
+	job->priority = PRIORITY_HIGH;
+
+	reindex(scheduler, job);
+	enqueue(scheduler, job);
+	record_latency(scheduler->stats, STAGE_QUEUE, job->priority, (job->queued - job->detected) / 1000);
+	return 0;
+}
+
+int schedule_delete(struct scheduler *scheduler, int queue, char *dest, long long detected) {
+	struct job *job = init_job(scheduler, queue, JOB_DELETE, 0, dest, detected);
+	if(job == 0) {
+		fprintf(stderr, "Error in scheduling - Couldn't create job: %s\n", dest);
+		return -1;
+	}
+	job->priority = PRIORITY_NORMAL;
+
+	//the file is already going away
+	struct job *existing = lookup(scheduler, dest);
+	if(existing != 0 && existing->kind == JOB_DELETE && !existing->done) {
+		free_job(job);
+		return 0;
+	}
+
+	//nothing left to copy for a file that is going away
+	if(existing != 0 && existing->kind != JOB_DELETE) {
+		dequeue(scheduler, existing);
+		unindex(scheduler, existing);
+		free_job(existing);
+	}
+
+	reindex(scheduler, job);
+	enqueue(scheduler, job);
+	record_latency(scheduler->stats, STAGE_QUEUE, job->priority, (job->queued - job->detected) / 1000);
+	return 0;
+}
+
+int run_scheduler(struct scheduler *scheduler, double budget) {
+	int success = 0;
+	double start = now();
+
+	while(1) {
+		//pick the first job of the highest non-empty class, starting
+		//from the queue whose turn it is so every destination gets served,
+		//a copy set aside holds up the rest of its class in its queue
+		struct job *job = 0;
+		long long time = now_ns();
+		for(int p = 0; p < PRIORITY_COUNT && job == 0; p++) {
+			for(int i = 0; i < scheduler->queue_count && job == 0; i++) {
+				int q = (scheduler->turn + i) % scheduler->queue_count;
+				if((job = scheduler->queues[q].head[p]) != 0 && waiting(job, time) != 0)
+					job = 0;
+				else if(job != 0)
+					scheduler->turn = (q + 1) % scheduler->queue_count;
+			}
+		}
+		if(job == 0)
+			break;
+
+		//small copies next to each other go to the kernel together
+		if(batchable(scheduler, job) && run_copies(scheduler, job, &success) > 0) {
+			if(now() - start >= budget)
+				break;
+			continue;
+		}
+
+		int result = run_job(scheduler, job);
+		if(result < 0)
+			success = -1;
+
+		if(result != 0)
+			finish_job(scheduler, job, result);
+
+		//give the caller a chance to look for new changes
+		if(now() - start >= budget)
+			break;
+	}
+
+	if(!pending(scheduler))
+		clear_finished(scheduler);
+
+	//what this run wrote is on disk before anyone is told it is done
+	if(flush_durable(scheduler->durable) < 0)
+		success = -1;
+	settle_published(scheduler);
+
+	return success;
+}
+
+int pending(struct scheduler *scheduler) {
+	for(int q = 0; q < scheduler->queue_count; q++) {
+		for(int p = 0; p < PRIORITY_COUNT; p++) {
+			if(scheduler->queues[q].head[p] != 0)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+int next_run(struct scheduler *scheduler) {
+	long long time = now_ns(), wait = -1;
+	for(int q = 0; q < scheduler->queue_count; q++) {
+		for(int p = 0; p < PRIORITY_COUNT; p++) {
+			struct job *job = scheduler->queues[q].head[p];
+			if(job != 0 && (wait < 0 || waiting(job, time) < wait))
+				wait = waiting(job, time);
+		}
+	}
+	//a wait is rounded up so the job can run once it is over
+	return wait <= 0 ? (int)wait : (int)((wait + 999999) / 1000000);
+}
+
+unsigned long oldest_pending(struct scheduler *scheduler) {
+	unsigned long oldest = 0;
+	for(int q = 0; q < scheduler->queue_count; q++) {
+		for(int p = 0; p < PRIORITY_COUNT; p++) {
+			for(struct job *job = scheduler->queues[q].head[p]; job != 0; job = job->next) {
+				if(oldest == 0 || job->seq < oldest)
+					oldest = job->seq;
+			}
+		}
+	}
+	return oldest;
+}
+
+unsigned long take_failed(struct scheduler *scheduler) {
+	unsigned long failed = scheduler->failed;
+	scheduler->failed = 0;
+	return failed;
+}
@@ -0,0 +1,364 @@
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "list.h"
+#include "saves.h"
+#include "utils.h"
+
+//entries compared column by column at a time
+#define RUN_SIZE 256
+
+//differences between the columns of a run of entries, 0 where a field is unchanged
+struct changes {
+	uint64_t	content[RUN_SIZE]; //mtime, size and inode
+	uint64_t	ctime[RUN_SIZE];
+	uint32_t	mode[RUN_SIZE];
+};
+
+/*
+ * Make room for one more entry and len more bytes of path names
+ * Returns 0 if there is room
+ * Otherwise returns -1
+ */
+static int grow(struct snapshot *snapshot, size_t len) {
+	//offsets are 32 bits to keep the column small
+	if(snapshot->blob_len + len > UINT32_MAX)
+		return -1;
+
+	if(snapshot->blob_len + len > snapshot->blob_cap) {
+		size_t cap = snapshot->blob_cap * 2;
+		while(cap < snapshot->blob_len + len)
+			cap *= 2;
+		char *blob = (char *)realloc(snapshot->blob, cap);
+		if(blob == 0)
+			return -1;
+		snapshot->blob = blob;
+		snapshot->blob_cap = cap;
+	}
+
+	if(snapshot->count == snapshot->capacity) {
+		size_t capacity = snapshot->capacity * 2;
+		uint32_t *offsets = (uint32_t *)realloc(snapshot->offsets, capacity * sizeof(uint32_t));
+		if(offsets != 0)
+			snapshot->offsets = offsets;
+		int64_t *mtime = (int64_t *)realloc(snapshot->mtime, capacity * sizeof(int64_t));
+		if(mtime != 0)
+			snapshot->mtime = mtime;
+		int64_t *ctime = (int64_t *)realloc(snapshot->ctime, capacity * sizeof(int64_t));
+		if(ctime != 0)
+			snapshot->ctime = ctime;
+		int64_t *size = (int64_t *)realloc(snapshot->size, capacity * sizeof(int64_t));
+		if(size != 0)
+			snapshot->size = size;
+		uint64_t *ino = (uint64_t *)realloc(snapshot->ino, capacity * sizeof(uint64_t));
+		if(ino != 0)
+			snapshot->ino = ino;
+		uint32_t *mode = (uint32_t *)realloc(snapshot->mode, capacity * sizeof(uint32_t));
+		if(mode != 0)
+			snapshot->mode = mode;
+
+		//the arrays that did grow are kept, the capacity only moves once all of them have
+		if(offsets == 0 || mtime == 0 || ctime == 0 || size == 0 || ino == 0 || mode == 0)
+			return -1;
+		snapshot->capacity = capacity;
+	}
+	return 0;
+}
+
+/*
+ * Add an entry to the end of a snapshot
+ * Returns 0 if the entry was added
+ * Otherwise returns -1
+ */
+static int add_entry(struct snapshot *snapshot, char *path, struct stat *st_info) {
+	size_t len = strlen(path) + 1;
+	if(grow(snapshot, len) < 0)
+		return -1;
+
+	size_t i = snapshot->count++;
+	snapshot->offsets[i] = snapshot->blob_len;
+	memcpy(snapshot->blob + snapshot->blob_len, path, len);
+	snapshot->blob_len += len;
+	snapshot->mtime[i] = st_info->st_mtim.tv_sec * 1000000000LL + st_info->st_mtim.tv_nsec;
+	snapshot->ctime[i] = st_info->st_ctim.tv_sec * 1000000000LL + st_info->st_ctim.tv_nsec;
+	snapshot->size[i] = st_info->st_size;
+	snapshot->ino[i] = st_info->st_ino;
+	snapshot->mode[i] = st_info->st_mode;
+	return 0;
+}
+
+/*
+ * Order entry names for qsort
+ */
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+/*
+ * Add the entries of a directory to a snapshot, each one followed by
+ * everything under it, symbolic links are only followed in follow mode
+ * (a link to nothing is kept as a link) and never back up to a directory in dirs
+ * path holds len bytes and has room for 4096
+ * Returns 0 if the directory was read or is gone
+ * Otherwise returns -1
+ */
+static int walk(struct snapshot *snapshot, char *path, size_t len, int follow, struct walk *dirs) {
+	DIR *dp;
+	struct dirent *ep;
+
+	if((dp = opendir(path)) == 0)
+		return errno == ENOENT ? 0 : -1;
+
+	struct list *names = init_list(16);
+	if(names == 0) {
+		closedir(dp);
+		return -1;
+	}
+	while((ep = readdir(dp)) != 0) {
+		if(strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+			continue;
+		if(append(names, ep->d_name) < 0) {
+			free_list(names);
+			closedir(dp);
+			return -1;
+		}
+	}
+
+	//sorted names make the whole snapshot sorted, since a directory's
+	//entries are added right after it
+	qsort(names->values, names->length, sizeof(char *), compare_names);
+
+	int result = 0;
+	size_t base = len;
+	if(base > 0 && path[base - 1] != '/')
+		path[base++] = '/';
+	for(size_t i = 0; result == 0 && i < names->length; i++) {
+		size_t name_len = strlen(names->values[i]);
+		if(base + name_len >= 4096)
+			continue;
+		memcpy(path + base, names->values[i], name_len + 1);
+
+		//files that are gone by now aren't in the snapshot
+		struct stat st_info;
+		if(is_temp_file(path) || ((!follow || fstatat(dirfd(dp), names->values[i], &st_info, 0) < 0) &&
+			fstatat(dirfd(dp), names->values[i], &st_info, AT_SYMLINK_NOFOLLOW) < 0))
+			continue;
+		if(!S_ISDIR(st_info.st_mode)) {
+			if(add_entry(snapshot, path, &st_info) < 0)
+				result = -1;
+			continue;
+		}
+
+		//a link back up to a directory being walked is left out
+		int entered = enter_dir(dirs, st_info.st_dev, st_info.st_ino);
+		if(entered == 1)
+			continue;
+		if(entered < 0 || add_entry(snapshot, path, &st_info) < 0 || walk(snapshot, path, base + name_len, follow, dirs) < 0)
+			result = -1;
+		if(entered == 0)
+			leave_dir(dirs);
+	}
+	path[len] = 0;
+
+	free_list(names);
+	closedir(dp);
+	return result;
+}
+
+struct snapshot *take_snapshot(char *root, int follow) {
+	struct walk dirs = { 0 };
+	struct stat st_info;
+	char path[4096];
+	memset(path, 0, 4096);
+	strncpy(path, root, 4095);
+
+	if(stat(path, &st_info) < 0)
+		return 0;
+
+	struct snapshot *snapshot = (struct snapshot *)calloc(1, sizeof(struct snapshot));
+	if(snapshot == 0)
+		return 0;
+
+	//start with room for a few thousand files
+	snapshot->blob_cap = 65536;
+	snapshot->capacity = 1024;
+	snapshot->blob = (char *)malloc(snapshot->blob_cap);
+	snapshot->offsets = (uint32_t *)malloc(snapshot->capacity * sizeof(uint32_t));
+	snapshot->mtime = (int64_t *)malloc(snapshot->capacity * sizeof(int64_t));
+	snapshot->ctime = (int64_t *)malloc(snapshot->capacity * sizeof(int64_t));
+	snapshot->size = (int64_t *)malloc(snapshot->capacity * sizeof(int64_t));
+	snapshot->ino = (uint64_t *)malloc(snapshot->capacity * sizeof(uint64_t));
+	snapshot->mode = (uint32_t *)malloc(snapshot->capacity * sizeof(uint32_t));
+	if(snapshot->blob == 0 || snapshot->offsets == 0 || snapshot->mtime == 0 || snapshot->ctime == 0 ||
+		snapshot->size == 0 || snapshot->ino == 0 || snapshot->mode == 0 || add_entry(snapshot, path, &st_info) < 0 ||
+		(S_ISDIR(st_info.st_mode) && (enter_dir(&dirs, st_info.st_dev, st_info.st_ino) < 0 || walk(snapshot, path, strlen(path), follow, &dirs) < 0))) {
+		free_walk(&dirs);
+		free_snapshot(snapshot);
+		return 0;
+	}
+	free_walk(&dirs);
+	return snapshot;
+}
+
+void free_snapshot(struct snapshot *snapshot) {
+	if(snapshot != 0) {
+		if(snapshot->blob != 0)
+			free(snapshot->blob);
+		if(snapshot->offsets != 0)
+			free(snapshot->offsets);
+		if(snapshot->mtime != 0)
+			free(snapshot->mtime);
+		if(snapshot->ctime != 0)
+			free(snapshot->ctime);
+		if(snapshot->size != 0)
+			free(snapshot->size);
+		if(snapshot->ino != 0)
+			free(snapshot->ino);
+		if(snapshot->mode != 0)
+			free(snapshot->mode);
+		free(snapshot);
+	}
+}
+
+char *snapshot_path(struct snapshot *snapshot, size_t i) {
+	return snapshot->blob + snapshot->offsets[i];
+}
+
+void snapshot_stat(struct snapshot *snapshot, size_t i, struct stat *st_info) {
+	memset(st_info, 0, sizeof(struct stat));
+	st_info->st_mode = snapshot->mode[i];
+	st_info->st_size = snapshot->size[i];
+	st_info->st_ino = snapshot->ino[i];
+	st_info->st_mtim.tv_sec = snapshot->mtime[i] / 1000000000LL;
+	st_info->st_mtim.tv_nsec = snapshot->mtime[i] % 1000000000LL;
+	st_info->st_ctim.tv_sec = snapshot->ctime[i] / 1000000000LL;
+	st_info->st_ctim.tv_nsec = snapshot->ctime[i] % 1000000000LL;
+}
+
+int compare_paths(char *a, char *b) {
+	unsigned char *x = (unsigned char *)a, *y = (unsigned char *)b;
+	while(*x != 0 && *x == *y) {
+		x++;
+		y++;
+	}
+
+	//a slash sorts before any other character so a directory's
+	//entries come before its siblings with longer names
+	int cx = *x == '/' ? 1 : *x == 0 ? 0 : *x + 1;
+	int cy = *y == '/' ? 1 : *y == 0 ? 0 : *y + 1;
+	return cx - cy;
+}
+
+long find_path(struct snapshot *snapshot, char *path) {
+	size_t low = 0, high = snapshot->count;
+	while(low < high) {
+		size_t mid = low + (high - low) / 2;
+		int c = compare_paths(snapshot_path(snapshot, mid), path);
+		if(c == 0)
+			return mid;
+		if(c < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return -1;
+}
+
+/*
+ * Compare n entries of two snapshots that have the same paths, one
+ * column at a time
+ * The loops only xor and or whole columns, so the compiler vectorizes
+ * them even without 64 bit vector compares
+ */
+static void compare_columns(struct snapshot *old, size_t i, struct snapshot *new, size_t j, size_t n, struct changes *changes) {
+	const uint64_t *restrict old_mtime = (uint64_t *)old->mtime + i, *restrict new_mtime = (uint64_t *)new->mtime + j;
+	const uint64_t *restrict old_size = (uint64_t *)old->size + i, *restrict new_size = (uint64_t *)new->size + j;
+	const uint64_t *restrict old_ino = old->ino + i, *restrict new_ino = new->ino + j;
+	const uint64_t *restrict old_ctime = (uint64_t *)old->ctime + i, *restrict new_ctime = (uint64_t *)new->ctime + j;
+	const uint32_t *restrict old_mode = old->mode + i, *restrict new_mode = new->mode + j;
+	uint64_t *restrict content = changes->content, *restrict ctime = changes->ctime;
+	uint32_t *restrict mode = changes->mode;
+
+	for(size_t k = 0; k < n; k++)
+		content[k] = (old_mtime[k] ^ new_mtime[k]) | (old_size[k] ^ new_size[k]) | (old_ino[k] ^ new_ino[k]);
+	for(size_t k = 0; k < n; k++)
+		ctime[k] = old_ctime[k] ^ new_ctime[k];
+	for(size_t k = 0; k < n; k++)
+		mode[k] = old_mode[k] ^ new_mode[k];
+}
+
+/*
+ * Check if a path is inside a directory that was deleted
+ */
+static int under(char *dir, char *path) {
+	if(dir == 0)
+		return 0;
+	size_t len = strlen(dir);
+	return strncmp(path, dir, len) == 0 && (path[len] == '/' || (len > 0 && dir[len - 1] == '/'));
+}
+
+int diff_snapshots(struct snapshot *old, struct snapshot *new, struct list *insert_list, struct list *update_list, struct list *meta_list, struct list *delete_list) {
+	struct changes changes;
+	size_t i = 0, j = 0;
+	char *deleted = 0; //last directory deleted, everything in it goes with it
+	int success = 0;
+
+	while(i < old->count || j < new->count) {
+		//the same paths in both are compared a run at a time, which is
+		//most of them when little changed
+		size_t run = 0;
+		while(run < RUN_SIZE && i + run < old->count && j + run < new->count &&
+			strcmp(snapshot_path(old, i + run), snapshot_path(new, j + run)) == 0)
+			run++;
+
+		if(run > 0) {
+			compare_columns(old, i, new, j, run, &changes);
+			for(size_t k = 0; k < run; k++) {
+				if((changes.content[k] | changes.ctime[k] | changes.mode[k]) == 0)
+					continue;
+				char *path = snapshot_path(new, j + k);
+				mode_t mode = new->mode[j + k];
+
+				//a file replaced by a directory or the other way around has to
+				//be deleted from the destination before it is created again
+				if(changes.mode[k] & S_IFMT) {
+					deleted = snapshot_path(old, i + k);
+					if(append(delete_list, path) < 0 || append(insert_list, path) < 0)
+						success = -1;
+					continue;
+				}
+
+				//a new mtime, size or inode means the content changed, a new
+				//mode or ctime alone means only the metadata did
+				int content = changes.content[k] != 0;
+				int metadata = changes.mode[k] != 0 || (S_ISREG(mode) && changes.ctime[k] != 0);
+				if(content && (S_ISREG(mode) || S_ISLNK(mode)) && append(update_list, path) < 0)
+					success = -1;
+				if(metadata && (!content || !S_ISREG(mode)) && append(meta_list, path) < 0)
+					success = -1;
+			}
+			i += run;
+			j += run;
+			continue;
+		}
+
+		int c = i >= old->count ? 1 : j >= new->count ? -1 : compare_paths(snapshot_path(old, i), snapshot_path(new, j));
+		if(c < 0) {
+			//only the topmost missing path is deleted
+			char *path = snapshot_path(old, i++);
+			if(under(deleted, path))
+				continue;
+			deleted = path;
+			if(append(delete_list, path) < 0)
+				success = -1;
+		}
+		else if(append(insert_list, snapshot_path(new, j++)) < 0)
+			success = -1;
+	}
+	return success;
+}
@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "stats.h"
+
+static const char *stage_names[STAGE_COUNT] = {
+	"detect->queue", "queue->done", "detect->done", "save->done",
+};
+
+static const char *priority_names[PRIORITY_COUNT] = {
+	"high", "normal", "low",
+};
+
+/*
+ * Get the bucket a value falls into
+ */
+static int bucket_of(long long value) {
+	unsigned long long v = value < 0 ? 0 : value;
+
+	//small values get a bucket each
+	if(v < (1 << HIST_SUB_BITS))
+		return v;
+
+	//the leading bit picks the range, the next bits pick the linear bucket
+	int e = 63 - __builtin_clzll(v);
+	int sub = (v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+/*
+ * Get the smallest value that falls into a bucket
+ */
+static long long bucket_value(int bucket) {
+	if(bucket < (1 << HIST_SUB_BITS))
+		return bucket;
+
+	int e = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	long long sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+	return ((1LL << HIST_SUB_BITS) | sub) << (e - HIST_SUB_BITS);
+}
+
+struct stats *init_stats() {
+	struct stats *stats = (struct stats *)calloc(1, sizeof(struct stats));
+	return stats;
+}
+
+void free_stats(struct stats *stats) {
+	if(stats != 0)
+		free(stats);
+}
+
+void record(struct histogram *histogram, long long usec) {
+	if(usec < 0)
+		usec = 0;
+
+	if(histogram->total == 0 || usec < histogram->min)
+		histogram->min = usec;
+	if(histogram->total == 0 || usec > histogram->max)
+		histogram->max = usec;
+
+	histogram->counts[bucket_of(usec)]++;
+	histogram->total++;
+}
+
+void record_latency(struct stats *stats, enum stage stage, enum priority priority, long long usec) {
+	if(stats == 0)
+		return;
+	record(&stats->latency[stage][priority], usec);
+}
+
+long long percentile(struct histogram *histogram, double fraction) {
+	if(histogram->total == 0)
+		return 0;
+
+	//walk the buckets until enough samples have been seen
+	unsigned long target = fraction * histogram->total;
+	unsigned long seen = 0;
+	for(int i = 0; i < HIST_BUCKETS; i++) {
+		seen += histogram->counts[i];
+		if(seen > target || seen == histogram->total) {
+			//report the top of the bucket, never more than the real max
+			long long value = i + 1 < HIST_BUCKETS ? bucket_value(i + 1) - 1 : histogram->max;
+			return value < histogram->max ? value : histogram->max;
+		}
+	}
+	return histogram->max;
+}
+
+void print_stats(struct stats *stats, FILE *fp) {
+	if(stats == 0)
+		return;
+
+	//nothing to show until a change has been queued
+	int empty = 1;
+	for(int p = 0; p < PRIORITY_COUNT; p++) {
+		if(stats->latency[STAGE_QUEUE][p].total > 0)
+			empty = 0;
+	}
+	if(empty)
+		return;
+
+	fprintf(fp, "%-14s %-7s %8s %10s %10s %10s %10s %10s (ms)\n",
+		"stage", "class", "count", "min", "p50", "p90", "p99", "max");
+	for(int s = 0; s < STAGE_COUNT; s++) {
+		for(int p = 0; p < PRIORITY_COUNT; p++) {
+			struct histogram *h = &stats->latency[s][p];
+			if(h->total == 0)
+				continue;
+			fprintf(fp, "%-14s %-7s %8lu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+				stage_names[s], priority_names[p], h->total,
+				h->min / 1e3, percentile(h, 0.5) / 1e3, percentile(h, 0.9) / 1e3,
+				percentile(h, 0.99) / 1e3, h->max / 1e3);
+		}
+	}
+}
+
+long long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <stdio.h>
+
+#include "throttle.h"
+
+/*
+ * Get the current monotonic time in seconds
+ */
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Sleep for a number of seconds, resuming if interrupted by a signal
+ */
+static void pause_for(double seconds) {
+	struct timespec ts;
+	ts.tv_sec = (time_t)seconds;
+	ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+	while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Set the rate of a bucket, keeping the tokens it already has
+ */
+static void set_bucket(struct bucket *bucket, double rate, double burst) {
+	bucket->rate = rate;
+	bucket->burst = burst > 0 ? burst : rate;
+	bucket->last = now();
+	if(bucket->tokens > bucket->burst)
+		bucket->tokens = bucket->burst;
+}
+
+/*
+ * Take n tokens from a bucket, sleeping until the bucket is no longer in debt
+ * Requests larger than the burst are allowed and paid back over time
+ */
+static void take(struct bucket *bucket, double n) {
+	//unlimited
+	if(bucket->rate <= 0)
+		return;
+
+	//refill the bucket for the time that has passed
+	double t = now();
+	bucket->tokens += (t - bucket->last) * bucket->rate;
+	if(bucket->tokens > bucket->burst)
+		bucket->tokens = bucket->burst;
+	bucket->last = t;
+
+	//spend the tokens and wait off any debt
+	bucket->tokens -= n;
+	if(bucket->tokens < 0)
+		pause_for(-bucket->tokens / bucket->rate);
+}
+
+/*
+ * Parse a number with an optional K, M or G suffix
+ */
+static double parse_amount(char *str) {
+	char *end;
+	double value = strtod(str, &end);
+	switch(*end) {
+		case 'k': case 'K': value *= 1024; break;
+		case 'm': case 'M': value *= 1024 * 1024; break;
+		case 'g': case 'G': value *= 1024 * 1024 * 1024; break;
+	}
+	return value;
+}
+
+struct throttle *init_throttle(double bytes_rate, double ops_rate) {
+	struct throttle *throttle = (struct throttle *)malloc(sizeof(struct throttle));
+
+	if(throttle == 0)
+		return 0;
+
+	//buckets start full so the first edits go through immediately
+	memset(throttle, 0, sizeof(struct throttle));
+	set_limits(throttle, bytes_rate, 0, ops_rate, 0);
+	throttle->bytes.tokens = throttle->bytes.burst;
+	throttle->ops.tokens = throttle->ops.burst;
+
+	return throttle;
+}
+
+void free_throttle(struct throttle *throttle) {
+	if(throttle != 0) {
+		if(throttle->config != 0)
+			free(throttle->config);
+		free(throttle);
+	}
+}
+
+void set_limits(struct throttle *throttle, double bytes_rate, double bytes_burst, double ops_rate, double ops_burst) {
+	set_bucket(&throttle->bytes, bytes_rate, bytes_burst);
+	set_bucket(&throttle->ops, ops_rate, ops_burst);
+}
+
+int load_limits(struct throttle *throttle, char *path) {
+	FILE *fp;
+	char line[256], key[128], value[128];
+	double bytes_rate, bytes_burst, ops_rate, ops_burst;
+
+	if((fp = fopen(path, "r")) == 0) {
+		fprintf(stderr, "Error in loading limits - Couldn't open file: %s\n", path);
+		return -1;
+	}
+
+	//anything not in the file is unlimited
+	bytes_rate = bytes_burst = ops_rate = ops_burst = 0;
+
+	//each line is "key value", # starts a comment
+	while(fgets(line, sizeof(line), fp) != 0) {
+		if(line[0] == '#' || sscanf(line, "%127s %127s", key, value) != 2)
+			continue;
+
+		if(strcmp(key, "bytes_per_sec") == 0)
+			bytes_rate = parse_amount(value);
+		else if(strcmp(key, "burst_bytes") == 0)
+			bytes_burst = parse_amount(value);
+		else if(strcmp(key, "ops_per_sec") == 0)
+			ops_rate = parse_amount(value);
+		else if(strcmp(key, "burst_ops") == 0)
+			ops_burst = parse_amount(value);
+		else
+			fprintf(stderr, "Error in loading limits - Unknown key: %s\n", key);
+	}
+	fclose(fp);
+
+	set_limits(throttle, bytes_rate, bytes_burst, ops_rate, ops_burst);
+	return 0;
+}
+
+/*
+ * Re-read the limits file if a reload was requested
+ */
+static void check_reload(struct throttle *throttle) {
+	if(throttle->reload) {
+		throttle->reload = 0;
+		if(throttle->config != 0)
+			load_limits(throttle, throttle->config);
+	}
+}
+
+void take_bytes(struct throttle *throttle, size_t n) {
+	if(throttle == 0)
+		return;
+	check_reload(throttle);
+	take(&throttle->bytes, n);
+}
+
+void take_op(struct throttle *throttle) {
+	if(throttle == 0)
+		return;
+	check_reload(throttle);
+	take(&throttle->ops, 1);
+}
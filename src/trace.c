@@ -0,0 +1,62 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "stats.h"
+
+/*
+ * Write a string as a JSON string literal
+ */
+static void write_string(FILE *fp, char *str) {
+	fputc('"', fp);
+	for(char *ptr = str; *ptr != 0; ptr++) {
+		if(*ptr == '"' || *ptr == '\\')
+			fprintf(fp, "\\%c", *ptr);
+		else if((unsigned char)*ptr < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char)*ptr);
+		else
+			fputc(*ptr, fp);
+	}
+	fputc('"', fp);
+}
+
+struct trace *init_trace(char *path) {
+	struct trace *trace = (struct trace *)malloc(sizeof(struct trace));
+
+	if(trace == 0)
+		return 0;
+
+	if((trace->fp = fopen(path, "w")) == 0) {
+		free(trace);
+		return 0;
+	}
+
+	trace->start = now_ns();
+	trace->events = 0;
+	fprintf(trace->fp, "{\"traceEvents\":[\n");
+
+	return trace;
+}
+
+void free_trace(struct trace *trace) {
+	if(trace != 0) {
+		//close the event array so the file is valid JSON
+		fprintf(trace->fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+		fclose(trace->fp);
+		free(trace);
+	}
+}
+
+void trace_span(struct trace *trace, char *name, char *category, int lane, long long start, long long end) {
+	if(trace == 0)
+		return;
+
+	if(trace->events++ > 0)
+		fprintf(trace->fp, ",\n");
+
+	//trace-event timestamps are in microseconds
+	fprintf(trace->fp, "{\"name\":");
+	write_string(trace->fp, name);
+	fprintf(trace->fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+		category, (start - trace->start) / 1e3, (end - start) / 1e3, getpid(), lane);
+}
@@ -0,0 +1,740 @@
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "transfer.h"
+#include "throttle.h"
+#include "ring.h"
+#include "utils.h"
+#include "durable.h"
+#include "stats.h"
+
+//filesystems remembered as unable to clone a source, more are asked every time
+#define FREEZE_DEVS 16
+
+/*
+ * Add bytes to a content fingerprint (FNV-1a)
+ */
+static unsigned long fingerprint(unsigned long h, char *buf, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		h ^= (unsigned char)buf[i];
+		h *= 1099511628211UL;
+	}
+	return h;
+}
+
+/*
+ * Move a sparse transfer to the start of the next data range
+ * Returns 0 if the transfer was moved (to the end if only holes are left)
+ * Otherwise returns -1
+ */
+static int next_data(struct transfer *transfer) {
+	off_t data = lseek(transfer->r_fd, transfer->offset, SEEK_DATA);
+	if(data < 0) {
+		//only a hole is left before the end of the file
+		if(errno == ENXIO) {
+			transfer->offset = transfer->data_end = transfer->size;
+			return 0;
+		}
+		return -1;
+	}
+
+	off_t hole = lseek(transfer->r_fd, data, SEEK_HOLE);
+	if(hole < 0)
+		return -1;
+
+	//the destination was truncated, so skipping leaves a hole there too
+	transfer->offset = data;
+	transfer->data_end = hole;
+	return 0;
+}
+
+/*
+ * Set up a transfer with nothing opened yet, starting at offset
+ */
+static void init_transfer(struct transfer *transfer, off_t offset) {
+	transfer->r_fd = transfer->w_fd = -1;
+	transfer->offset = transfer->data_end = transfer->start = offset;
+	transfer->size = 0;
+	transfer->sparse = transfer->preallocated = transfer->frozen = 0;
+	transfer->hashing = 0;
+	transfer->hash = transfer->base = FINGERPRINT_INIT;
+	transfer->staged = 0;
+	transfer->unnamed = 0;
+	transfer->ring = 0;
+	transfer->handle = 0;
+	transfer->passed = 0;
+	transfer->blocks = 0;
+	transfer->block_count = 0;
+	transfer->retries = 0;
+	transfer->due = 0;
+	transfer->reread = -1;
+	transfer->reread_end = 0;
+	memset(&transfer->source, 0, sizeof(struct stat));
+}
+
+/*
+ * Read the source of a transfer from a clone of it made in its directory,
+ * which has no name and is gone once it is closed
+ * Left alone if the filesystem can't share blocks or the directory is
+ * read only, a filesystem that can't clone isn't asked again
+ */
+static void freeze_source(struct transfer *transfer, char *src) {
+	static dev_t failed[FREEZE_DEVS];
+	static int count = 0;
+	char dir[4096];
+
+	for(int i = 0; i < count; i++) {
+		if(failed[i] == transfer->source.st_dev)
+			return;
+	}
+
+	parent_dir(dir, src, 4096);
+	int fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+	if(fd < 0)
+		return;
+	if(ioctl(fd, FICLONE, transfer->r_fd) == 0) {
+		close(transfer->r_fd);
+		transfer->r_fd = fd;
+		transfer->frozen = 1;
+		return;
+	}
+
+	//only these say the filesystem can't clone at all, anything else
+	//may be down to this file
+	if((errno == EOPNOTSUPP || errno == EXDEV || errno == EINVAL) && count < FREEZE_DEVS)
+		failed[count++] = transfer->source.st_dev;
+	close(fd);
+}
+
+/*
+ * Open the files of a transfer and decide how the copy will be made
+ * Returns 0 if both files were opened
+ * Otherwise returns -1
+ */
+static int open_files(struct transfer *transfer, char *src, char *dest, int flags, mode_t mode, off_t offset) {
+	struct stat st_info;
+
+	init_transfer(transfer, offset);
+	if((transfer->r_fd = open(src, O_RDONLY)) < 0)
+		return -1;
+
+	if(fstat(transfer->r_fd, &st_info) < 0) {
+		close_transfer(transfer);
+		return -1;
+	}
+	transfer->size = st_info.st_size;
+	transfer->source = st_info;
+
+	//a copy that takes more than one read could see a writer halfway
+	if(st_info.st_size - offset > TRANSFER_BLOCK)
+		freeze_source(transfer, src);
+
+	if((transfer->w_fd = open(dest, flags, mode)) < 0) {
+		close_transfer(transfer);
+		return -1;
+	}
+
+	//fewer blocks than bytes means the source has holes,
+	//which are skipped so the fingerprint can't cover them
+	if((off_t)st_info.st_blocks * 512 < st_info.st_size)
+		transfer->sparse = 1;
+	else {
+		transfer->hashing = 1;
+
+		//reserve the space of a large copy in one go to avoid fragmenting it,
+		//keeping the size so readers don't see a file full of zeros
+		if(st_info.st_size - offset >= PREALLOCATE_SIZE && fallocate(transfer->w_fd, FALLOC_FL_KEEP_SIZE, offset, st_info.st_size - offset) == 0)
+			transfer->preallocated = 1;
+	}
+
+	return 0;
+}
+
+int open_transfer(struct transfer *transfer, char *src, char *dest, mode_t mode) {
+	return open_files(transfer, src, dest, O_WRONLY | O_CREAT | O_TRUNC, mode, 0);
+}
+
+int open_staged(struct transfer *transfer, char *src, char *dest, mode_t mode) {
+	char path[4096];
+
+	//nothing is left behind by a copy that never completes
+	parent_dir(path, dest, 4096);
+	if(open_files(transfer, src, path, O_WRONLY | O_TMPFILE, mode, 0) == 0)
+		transfer->unnamed = 1;
+	else {
+		staged_name(dest, path, 4096);
+		if(open_files(transfer, src, path, O_WRONLY | O_CREAT | O_TRUNC, mode, 0) < 0)
+			return -1;
+	}
+
+	if((transfer->staged = strndup(dest, 4096)) == 0) {
+		close_transfer(transfer);
+		return -1;
+	}
+	return 0;
+}
+
+int open_append(struct transfer *transfer, char *src, char *dest, off_t offset, unsigned long hash) {
+	struct stat st_info;
+
+	if(open_files(transfer, src, dest, O_WRONLY, 0, offset) < 0)
+		return -1;
+
+	//the fingerprint carries on from the data already there
+	if(hash != 0)
+		transfer->hash = transfer->base = hash;
+	else
+		transfer->hashing = 0;
+
+	//the destination has to end exactly where the new data starts
+	if(fstat(transfer->w_fd, &st_info) < 0 || st_info.st_size != offset || transfer->size < offset) {
+		close_transfer(transfer);
+		return -1;
+	}
+	return 0;
+}
+
+int open_ring_transfer(struct transfer *transfer, struct ring *ring, char *src, char *dest, mode_t mode, int exclusive) {
+	struct stat st_info;
+
+	init_transfer(transfer, 0);
+	transfer->ring = ring;
+	if((transfer->r_fd = open(src, O_RDONLY)) < 0)
+		return -1;
+
+	if(fstat(transfer->r_fd, &st_info) < 0) {
+		close_transfer(transfer);
+		return -1;
+	}
+	transfer->size = st_info.st_size;
+	transfer->source = st_info;
+
+	//the kernel would fill in the holes of a sparse source,
+	//so only dense ones are handed over
+	int result = RING_FALLBACK;
+	if((off_t)st_info.st_blocks * 512 < st_info.st_size)
+		transfer->sparse = 1;
+	else if((result = ring_copy(ring, transfer->r_fd, dest, mode, exclusive, 0)) < 0) {
+		close_transfer(transfer);
+		return -1;
+	}
+
+	//the rest of a large source is copied a range at a time by the steps
+	if(result == RING_PARTIAL) {
+		if((transfer->passed = strndup(dest, 4096)) == 0) {
+			close_transfer(transfer);
+			return -1;
+		}
+		transfer->offset = transfer->data_end = RING_COPY_RANGE;
+		return 0;
+	}
+
+	//the receiver already has the file, so the transfer starts at its end
+	if(result == 0 || result == RING_EXISTS) {
+		transfer->offset = transfer->data_end = transfer->size;
+		return 0;
+	}
+
+	transfer->hashing = !transfer->sparse;
+	if((result = ring_open(ring, dest, mode, exclusive, &transfer->handle)) < 0) {
+		close_transfer(transfer);
+		return -1;
+	}
+	if(result == RING_EXISTS) {
+		transfer->handle = 0;
+		transfer->offset = transfer->data_end = transfer->size;
+	}
+	return 0;
+}
+
+unsigned long tail_fingerprint(int fd, off_t end) {
+	char buf[TAIL_SIZE];
+	off_t start = end > TAIL_SIZE ? end - TAIL_SIZE : 0;
+
+	ssize_t n = pread(fd, buf, end - start, start);
+	if(n != end - start)
+		return 0;
+	return fingerprint(FINGERPRINT_INIT, buf, n);
+}
+
+unsigned long content_fingerprint(char *path) {
+	char buf[65536];
+	int fd;
+	ssize_t n;
+
+	if((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+
+	unsigned long h = FINGERPRINT_INIT;
+	while((n = read(fd, buf, sizeof(buf))) > 0)
+		h = fingerprint(h, buf, n);
+	close(fd);
+
+	return n < 0 ? 0 : h;
+}
+
+unsigned long buffer_fingerprint(char *buf, size_t n) {
+	return fingerprint(FINGERPRINT_INIT, buf, n);
+}
+
+unsigned long transfer_fingerprint(struct transfer *transfer) {
+	return transfer->hashing ? transfer->hash : 0;
+}
+
+int apply_metadata(char *dest, struct stat *st_info) {
+	struct timespec times[2] = { st_info->st_atim, st_info->st_mtim };
+
+	//a link has no mode of its own, and what it points to is left alone
+	if(!S_ISLNK(st_info->st_mode) && fchmodat(AT_FDCWD, dest, st_info->st_mode & 07777, 0) < 0)
+		return -1;
+	if(geteuid() == 0 && fchownat(AT_FDCWD, dest, st_info->st_uid, st_info->st_gid, AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+	return utimensat(AT_FDCWD, dest, times, AT_SYMLINK_NOFOLLOW);
+}
+
+int make_link(char *target, char *dest, struct stat *st_info) {
+	char tmp[4096];
+	staged_name(dest, tmp, 4096);
+	unlink(tmp);
+
+	//made under a temporary name so whatever dest was is replaced in one step
+	if(symlink(target, tmp) < 0)
+		return -1;
+	if((st_info != 0 && apply_metadata(tmp, st_info) < 0) || rename(tmp, dest) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write n bytes to the destination of a transfer at its offset
+ * Returns 0 if all of them were written
+ * Otherwise returns -1
+ */
+static int write_dest(struct transfer *transfer, char *buf, size_t n) {
+	if(transfer->ring != 0)
+		return ring_write(transfer->ring, transfer->handle, transfer->offset, buf, n);
+	return pwrite(transfer->w_fd, buf, n, transfer->offset) == n ? 0 : -1;
+}
+
+/*
+ * Find the fingerprint of the block of a transfer holding offset, counted
+ * from the block the copy started in, making room for it if needed
+ * Returns a pointer to the fingerprint
+ * Otherwise returns 0 if there's no memory for it
+ */
+static unsigned long *block_at(struct transfer *transfer, off_t offset) {
+	size_t block = offset / TRANSFER_BLOCK - transfer->start / TRANSFER_BLOCK;
+	if(block >= transfer->block_count) {
+		size_t count = transfer->block_count * 2 > block + 1 ? transfer->block_count * 2 : block + 16;
+		unsigned long *blocks = (unsigned long *)realloc(transfer->blocks, count * sizeof(unsigned long));
+		if(blocks == 0)
+			return 0;
+		for(size_t i = transfer->block_count; i < count; i++)
+			blocks[i] = FINGERPRINT_INIT;
+		transfer->blocks = blocks;
+		transfer->block_count = count;
+	}
+	return &transfer->blocks[block];
+}
+
+/*
+ * Write a block read again from the source of a transfer to its destination,
+ * unless its fingerprint shows the destination already holds it
+ * Returns 0 if the destination holds the block
+ * Otherwise returns -1
+ */
+static int rewrite_block(struct transfer *transfer, off_t offset, char *buf, size_t n, unsigned long h) {
+	unsigned long *block = block_at(transfer, offset);
+	if(block != 0 && *block == h)
+		return 0;
+
+	transfer->offset = offset;
+	if(write_dest(transfer, buf, n) < 0)
+		return -1;
+	if(block != 0)
+		*block = h;
+	return 0;
+}
+
+/*
+ * Read up to chunk bytes of the source of a transfer again, going on with
+ * a pass from where the copy started, writing the blocks that differ from
+ * what was written of them before to the destination and the mirrors, and
+ * fingerprinting the content anew
+ * A block without a fingerprint is always written
+ * Returns the number of bytes read, less than chunk once the pass reached
+ * the end of the source and the destinations hold what was read
+ * Otherwise returns -1
+ */
+static ssize_t reread_source(struct transfer *transfer, struct transfer **mirrors, int count, size_t chunk, struct throttle *throttle) {
+	char buf[TRANSFER_BLOCK];
+	off_t offset = transfer->reread, end = transfer->reread_end;
+	size_t done = 0;
+
+	while(done < chunk) {
+		size_t want = TRANSFER_BLOCK - offset % TRANSFER_BLOCK;
+		ssize_t n = pread(transfer->r_fd, buf, want, offset);
+		if(n < 0)
+			return -1;
+		if(n == 0)
+			break;
+
+		//reading is paid for as well, a block the file grew or shrank into differs
+		unsigned long h = fingerprint(FINGERPRINT_INIT, buf, n);
+		take_bytes(throttle, n);
+		if(rewrite_block(transfer, offset, buf, n, h) < 0)
+			return -1;
+		for(int i = 0; i < count; i++) {
+			if(mirrors[i] != 0 && rewrite_block(mirrors[i], offset, buf, n, h) < 0)
+				mirrors[i] = 0;
+		}
+		transfer->hash = fingerprint(transfer->hash, buf, n);
+		offset += n;
+		done += n;
+		transfer->reread = offset;
+		if((size_t)n < want)
+			break;
+	}
+	if(done == chunk)
+		return done;
+
+	//blocks past the new end are gone from the destinations too
+	size_t first = (offset + TRANSFER_BLOCK - 1) / TRANSFER_BLOCK - transfer->start / TRANSFER_BLOCK;
+	for(size_t i = first; i < transfer->block_count; i++)
+		transfer->blocks[i] = FINGERPRINT_INIT;
+	if(offset < end && transfer->ring == 0 && ftruncate(transfer->w_fd, offset) < 0)
+		return -1;
+
+	transfer->offset = transfer->data_end = offset;
+	transfer->reread = -1;
+	for(int i = 0; i < count; i++) {
+		if(mirrors[i] == 0)
+			continue;
+		if(offset < end && mirrors[i]->ring == 0 && ftruncate(mirrors[i]->w_fd, offset) < 0) {
+			mirrors[i] = 0;
+			continue;
+		}
+		first = (offset + TRANSFER_BLOCK - 1) / TRANSFER_BLOCK - mirrors[i]->start / TRANSFER_BLOCK;
+		for(size_t j = first; j < mirrors[i]->block_count; j++)
+			mirrors[i]->blocks[j] = FINGERPRINT_INIT;
+		mirrors[i]->offset = mirrors[i]->data_end = offset;
+		mirrors[i]->hash = transfer->hash;
+	}
+	return done;
+}
+
+/*
+ * Check if a source still has the size and times it was read with
+ */
+static int same_source(struct stat *a, struct stat *b) {
+	return a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+		a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+/*
+ * Check if the last block copied of the source of a transfer still holds
+ * what was read of it, which a writer that only appends leaves alone
+ */
+static int same_tail(struct transfer *transfer) {
+	char buf[TRANSFER_BLOCK];
+
+	if(transfer->offset == transfer->start)
+		return 1;
+	off_t from = (transfer->offset - 1) / TRANSFER_BLOCK * TRANSFER_BLOCK;
+	if(from < transfer->start)
+		from = transfer->start;
+	size_t n = transfer->offset - from;
+	unsigned long *block = block_at(transfer, from);
+	return block != 0 && pread(transfer->r_fd, buf, n, from) == (ssize_t)n && fingerprint(FINGERPRINT_INIT, buf, n) == *block;
+}
+
+/*
+ * Check if the source of a transfer that reached its end held still since
+ * it was last read, setting when it is looked at again if it didn't, giving
+ * the writer a little longer every time it is still going
+ * A source that doesn't hold still within TRANSFER_RETRIES is left as
+ * last read, the next scan finds it changed again
+ * Returns 1 if the destinations hold what was last read of the source,
+ * 0 if the transfer waits until due
+ * Otherwise returns -1
+ */
+static int settle_transfer(struct transfer *transfer) {
+	struct stat st_info;
+
+	if(fstat(transfer->r_fd, &st_info) < 0)
+		return -1;
+	if((st_info.st_size == transfer->offset && same_source(&st_info, &transfer->source)) || transfer->retries == TRANSFER_RETRIES)
+		return 1;
+	transfer->due = now_ns() + ((long long)TRANSFER_BACKOFF << transfer->retries) * 1000000LL;
+	transfer->retries++;
+	return 0;
+}
+
+/*
+ * Look again at the source of a transfer whose wait is over, the copy
+ * carries on from its end if the source only grew, otherwise a pass over
+ * what was copied so far is started
+ * Returns 0 if the transfer can go on
+ * Otherwise returns -1
+ */
+static int resume_transfer(struct transfer *transfer) {
+	//what is read next is at least as new as this
+	transfer->due = 0;
+	if(fstat(transfer->r_fd, &transfer->source) < 0)
+		return -1;
+	if(transfer->source.st_size > transfer->offset && same_tail(transfer))
+		return 0;
+
+	transfer->reread = transfer->start;
+	transfer->reread_end = transfer->offset;
+	transfer->hash = transfer->base;
+	return 0;
+}
+
+/*
+ * Give the destination of a finished transfer the mode and times the source
+ * had when it was last read, so an unchanged file compares equal later on
+ * and one changed after that doesn't
+ */
+static int finish_transfer(struct transfer *transfer) {
+	struct stat *st_info = &transfer->source;
+
+	struct timespec times[2] = { st_info->st_atim, st_info->st_mtim };
+	if(fchmod(transfer->w_fd, st_info->st_mode & 07777) < 0)
+		return -1;
+	if(geteuid() == 0 && fchown(transfer->w_fd, st_info->st_uid, st_info->st_gid) < 0)
+		return -1;
+	return futimens(transfer->w_fd, times);
+}
+
+/*
+ * Give the temporary file of a complete staged transfer the staged name
+ * of its destination, where it waits to be published
+ * Returns 0 if the file has the name
+ * Otherwise returns -1
+ */
+static int name_staged(struct transfer *transfer) {
+	char tmp[4096], proc[64];
+
+	staged_name(transfer->staged, tmp, 4096);
+	if(transfer->unnamed) {
+		//linking a descriptor takes a capability the path under /proc doesn't
+		unlink(tmp);
+		snprintf(proc, 64, "/proc/self/fd/%d", transfer->w_fd);
+		if(linkat(transfer->w_fd, "", AT_FDCWD, tmp, AT_EMPTY_PATH) < 0 && linkat(AT_FDCWD, proc, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW) < 0)
+			return -1;
+	}
+
+	//the name belongs to whoever publishes it now
+	free(transfer->staged);
+	transfer->staged = 0;
+	transfer->unnamed = 0;
+	return 0;
+}
+
+/*
+ * Set the size and metadata of the destination of a transfer that reached
+ * the end of its source, trailing holes are recreated and unused
+ * preallocated space is given back by setting the size
+ * Returns 0 if the destination is complete
+ * Otherwise returns -1
+ */
+static int end_transfer(struct transfer *transfer) {
+	if(transfer->ring != 0) {
+		uint64_t handle = transfer->handle;
+
+		//the receiver copied the file itself
+		if(handle == 0)
+			return 0;
+		transfer->handle = 0;
+		return ring_close(transfer->ring, handle, transfer->offset, &transfer->source);
+	}
+
+	if((transfer->sparse || transfer->preallocated) && ftruncate(transfer->w_fd, transfer->offset) < 0)
+		return -1;
+	if(finish_transfer(transfer) < 0)
+		return -1;
+	return transfer->staged != 0 ? name_staged(transfer) : 0;
+}
+
+ssize_t step_transfer(struct transfer *transfer, size_t chunk, struct throttle *throttle) {
+	return fan_transfer(transfer, 0, 0, chunk, throttle);
+}
+
+ssize_t fan_transfer(struct transfer *transfer, struct transfer **mirrors, int count, size_t chunk, struct throttle *throttle) {
+	char buf[65536];
+	size_t copied = 0;
+
+	//the receiver copies the next range itself, nothing is left to mirror
+	if(transfer->passed != 0) {
+		for(int i = 0; i < count; i++)
+			mirrors[i] = 0;
+		take_bytes(throttle, transfer->size - transfer->offset < RING_COPY_RANGE ? transfer->size - transfer->offset : RING_COPY_RANGE);
+		int result = ring_copy(transfer->ring, transfer->r_fd, transfer->passed, transfer->source.st_mode, 0, transfer->offset);
+		if(result < 0)
+			return -1;
+		if(result == RING_PARTIAL) {
+			transfer->offset = transfer->data_end = transfer->offset + RING_COPY_RANGE;
+			return chunk;
+		}
+		free(transfer->passed);
+		transfer->passed = 0;
+		transfer->offset = transfer->data_end = transfer->size;
+	}
+
+	//the receiver already made the copy
+	if(transfer->ring != 0 && transfer->handle == 0)
+		return 0;
+
+	//a source found changed is looked at again once the writer had its moment
+	if(transfer->due != 0) {
+		if(now_ns() < transfer->due)
+			return chunk;
+		if(resume_transfer(transfer) < 0)
+			return -1;
+	}
+
+	//a pass over a changed source goes on where it stopped
+	if(transfer->reread >= 0) {
+		ssize_t n = reread_source(transfer, mirrors, count, chunk, throttle);
+		if(n < 0)
+			return -1;
+		copied = n;
+	}
+
+	//copy until the chunk is used up or the source runs out
+	while(copied < chunk) {
+		if(transfer->sparse && transfer->offset >= transfer->data_end) {
+			if(next_data(transfer) < 0)
+				return -1;
+
+			//mirrors skip the same hole
+			for(int i = 0; i < count; i++) {
+				if(mirrors[i] != 0) {
+					mirrors[i]->offset = transfer->offset;
+					mirrors[i]->data_end = transfer->data_end;
+				}
+			}
+		}
+
+		//dense reads stay within a block so each one is fingerprinted whole
+		size_t want = chunk - copied < sizeof(buf) ? chunk - copied : sizeof(buf);
+		if(transfer->sparse && transfer->data_end - transfer->offset < (off_t)want)
+			want = transfer->data_end - transfer->offset;
+		else if(!transfer->sparse && TRANSFER_BLOCK - transfer->offset % TRANSFER_BLOCK < (off_t)want)
+			want = TRANSFER_BLOCK - transfer->offset % TRANSFER_BLOCK;
+		if(want == 0)
+			break;
+
+		//a lone copy through a ring is read straight into the shared memory
+		int direct = transfer->ring != 0 && count == 0;
+		char *data = direct ? ring_reserve(transfer->ring, want) : buf;
+		if(data == 0)
+			return -1;
+
+		ssize_t n = pread(transfer->r_fd, data, want, transfer->offset);
+		if(n < 0)
+			return -1;
+		if(n == 0)
+			break;
+
+		//a source that can change under the copy remembers what each block held
+		unsigned long *block = 0;
+		if(!transfer->sparse && !transfer->frozen) {
+			block = block_at(transfer, transfer->offset);
+			if(block != 0)
+				*block = fingerprint(*block, data, n);
+		}
+
+		//wait for enough bandwidth before writing
+		take_bytes(throttle, n);
+		if(direct ? ring_commit(transfer->ring, transfer->handle, transfer->offset, n) < 0 : write_dest(transfer, data, n) < 0)
+			return -1;
+		if(transfer->hashing)
+			transfer->hash = fingerprint(transfer->hash, data, n);
+
+		//the same buffer goes to every mirror, one that can't keep up
+		//drops out and carries on from its own offset later
+		for(int i = 0; i < count; i++) {
+			if(mirrors[i] == 0)
+				continue;
+			take_bytes(throttle, n);
+			if(write_dest(mirrors[i], buf, n) < 0) {
+				mirrors[i] = 0;
+				continue;
+			}
+			if(mirrors[i]->hashing)
+				mirrors[i]->hash = fingerprint(mirrors[i]->hash, buf, n);
+
+			//a mirror that started along with the transfer has the same blocks
+			if(!transfer->sparse && !transfer->frozen) {
+				unsigned long *own = block_at(mirrors[i], mirrors[i]->offset);
+				if(own != 0)
+					*own = block != 0 && mirrors[i]->start == transfer->start ? *block : fingerprint(*own, buf, n);
+			}
+			mirrors[i]->offset += n;
+		}
+
+		copied += n;
+		transfer->offset += n;
+	}
+
+	if(copied < chunk) {
+		//the writer gets a moment before the source is looked at again
+		if(!transfer->sparse && !transfer->frozen) {
+			int settled = settle_transfer(transfer);
+			if(settled < 0)
+				return -1;
+			if(settled == 0)
+				return chunk;
+		}
+		if(end_transfer(transfer) < 0)
+			return -1;
+
+		//the mirrors hold the content the transfer read
+		for(int i = 0; i < count; i++) {
+			if(mirrors[i] == 0)
+				continue;
+			mirrors[i]->source = transfer->source;
+			if(end_transfer(mirrors[i]) < 0)
+				mirrors[i] = 0;
+		}
+	}
+
+	return copied;
+}
+
+void close_transfer(struct transfer *transfer) {
+	//a stream that didn't reach its end is dropped by the receiver
+	if(transfer->ring != 0 && transfer->handle != 0)
+		ring_abort(transfer->ring, transfer->handle);
+	transfer->handle = 0;
+	if(transfer->r_fd >= 0)
+		close(transfer->r_fd);
+	if(transfer->w_fd >= 0)
+		close(transfer->w_fd);
+	transfer->r_fd = transfer->w_fd = -1;
+	free(transfer->passed);
+	transfer->passed = 0;
+	if(transfer->staged != 0) {
+		char tmp[4096];
+		staged_name(transfer->staged, tmp, 4096);
+		if(!transfer->unnamed)
+			unlink(tmp);
+		free(transfer->staged);
+		transfer->staged = 0;
+	}
+	free(transfer->blocks);
+	transfer->blocks = 0;
+	transfer->block_count = 0;
+}
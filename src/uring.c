@@ -0,0 +1,342 @@
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+//operations in the chain of one copy
+enum copy_step {
+	STEP_STAT, //stat the source
+	STEP_OPEN_SRC, //open the source into its file slot
+	STEP_OPEN_DEST, //create or truncate the destination into its file slot
+	STEP_READ, //read the source into the copy's buffer
+	STEP_WRITE, //write the buffer to the destination
+	STEP_CLOSE_SRC, //close the source's slot
+	STEP_CLOSE_DEST, //close the destination's slot, reporting late write errors
+	STEP_COUNT,
+};
+
+//operations io_uring has to support for the batches to be used
+static const int required_ops[] = {
+	IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_CLOSE, -1,
+};
+
+/*
+ * Fill in stat info from the result of a statx call
+ */
+static void from_statx(struct stat *st_info, struct statx *stx) {
+	memset(st_info, 0, sizeof(struct stat));
+	st_info->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st_info->st_ino = stx->stx_ino;
+	st_info->st_mode = stx->stx_mode;
+	st_info->st_nlink = stx->stx_nlink;
+	st_info->st_uid = stx->stx_uid;
+	st_info->st_gid = stx->stx_gid;
+	st_info->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st_info->st_size = stx->stx_size;
+	st_info->st_blksize = stx->stx_blksize;
+	st_info->st_blocks = stx->stx_blocks;
+	st_info->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st_info->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st_info->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st_info->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st_info->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st_info->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/*
+ * Check that the kernel supports every operation the batches use
+ */
+static int probe_ops(int fd) {
+	size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, len);
+	if(probe == 0)
+		return -1;
+
+	int result = 0;
+	if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+		result = -1;
+	for(int i = 0; result == 0 && required_ops[i] >= 0; i++) {
+		if(required_ops[i] > probe->last_op || !(probe->ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED))
+			result = -1;
+	}
+	free(probe);
+	return result;
+}
+
+/*
+ * Take the next free submission entry, cleared
+ */
+static struct io_uring_sqe *next_sqe(struct uring *uring) {
+	unsigned index = uring->tail & *uring->sq_mask;
+	struct io_uring_sqe *sqe = &uring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	uring->sq_array[index] = index;
+	uring->tail++;
+	return sqe;
+}
+
+/*
+ * Submit the n queued entries and wait for all of them to complete,
+ * setting res[i] to the result of the entry with user_data i
+ * Returns 0 if every entry completed
+ * Otherwise returns -1 and the ring isn't used again
+ */
+static int run_batch(struct uring *uring, unsigned n) {
+	unsigned submitted = 0, reaped = 0;
+
+	//the kernel only sees the entries once the tail is published
+	__atomic_store_n(uring->sq_tail, uring->tail, __ATOMIC_RELEASE);
+
+	while(reaped < n) {
+		int ret = syscall(__NR_io_uring_enter, uring->fd, n - submitted, n - reaped, IORING_ENTER_GETEVENTS, 0, 0);
+		if(ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			uring->broken = 1;
+			return -1;
+		}
+		if(ret > 0)
+			submitted += ret;
+
+		unsigned head = *uring->cq_head;
+		unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != tail; head++) {
+			struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+			if(cqe->user_data < n)
+				uring->res[cqe->user_data] = cqe->res;
+			reaped++;
+		}
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+struct uring *init_uring() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	//a bad entry shouldn't stop the rest of a batch from being submitted
+	params.flags = IORING_SETUP_SUBMIT_ALL;
+	int fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+	if(fd < 0)
+		return 0;
+
+	//a read linked to the open of its file needs the file looked up
+	//when the read runs, not when it is submitted
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_LINKED_FILE) || probe_ops(fd) < 0) {
+		close(fd);
+		return 0;
+	}
+
+	struct uring *uring = (struct uring *)calloc(1, sizeof(struct uring));
+	if(uring == 0) {
+		close(fd);
+		return 0;
+	}
+	uring->fd = fd;
+	uring->sq_ring = uring->cq_ring = MAP_FAILED;
+	uring->sqes = MAP_FAILED;
+	uring->buffers = MAP_FAILED;
+
+	//both rings share one mapping
+	uring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	uring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(uring->cq_size > uring->sq_size)
+		uring->sq_size = uring->cq_size;
+	uring->sq_ring = uring->cq_ring = mmap(0, uring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	uring->sqes = mmap(0, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	uring->buffers = mmap(0, URING_SLOTS * URING_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	uring->statx_bufs = (struct statx *)calloc(URING_DEPTH, sizeof(struct statx));
+	uring->res = (int *)calloc(URING_DEPTH, sizeof(int));
+	if(uring->sq_ring == MAP_FAILED || uring->sqes == MAP_FAILED || uring->buffers == MAP_FAILED || uring->statx_bufs == 0 || uring->res == 0) {
+		free_uring(uring);
+		return 0;
+	}
+
+	char *ring = (char *)uring->sq_ring;
+	uring->sq_head = (unsigned *)(ring + params.sq_off.head);
+	uring->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+	uring->sq_mask = (unsigned *)(ring + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned *)(ring + params.sq_off.array);
+	uring->cq_head = (unsigned *)(ring + params.cq_off.head);
+	uring->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+	uring->cq_mask = (unsigned *)(ring + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+	uring->tail = *uring->sq_tail;
+
+	//the buffers are pinned once instead of on every read and write,
+	//and two empty file slots per copy are opened straight into
+	struct iovec iov[URING_SLOTS];
+	for(int i = 0; i < URING_SLOTS; i++) {
+		iov[i].iov_base = uring->buffers + i * URING_BUF_SIZE;
+		iov[i].iov_len = URING_BUF_SIZE;
+	}
+	int slots[URING_SLOTS * 2];
+	for(int i = 0; i < URING_SLOTS * 2; i++)
+		slots[i] = -1;
+	if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, URING_SLOTS) < 0 ||
+		syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, slots, URING_SLOTS * 2) < 0) {
+		free_uring(uring);
+		return 0;
+	}
+	return uring;
+}
+
+void free_uring(struct uring *uring) {
+	if(uring != 0) {
+		//closing the ring also drops the registered buffers and files
+		close(uring->fd);
+		if(uring->sq_ring != MAP_FAILED)
+			munmap(uring->sq_ring, uring->sq_size);
+		if(uring->sqes != MAP_FAILED)
+			munmap(uring->sqes, URING_DEPTH * sizeof(struct io_uring_sqe));
+		if(uring->buffers != MAP_FAILED)
+			munmap(uring->buffers, URING_SLOTS * URING_BUF_SIZE);
+		if(uring->statx_bufs != 0)
+			free(uring->statx_bufs);
+		if(uring->res != 0)
+			free(uring->res);
+		free(uring);
+	}
+}
+
+void uring_stat(struct uring *uring, char **paths, int count, struct stat *st_info, int *results, int follow) {
+	int done = 0;
+
+	while(uring != 0 && !uring->broken && done < count) {
+		int n = count - done < URING_DEPTH ? count - done : URING_DEPTH;
+		for(int i = 0; i < n; i++) {
+			struct io_uring_sqe *sqe = next_sqe(uring);
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (unsigned long)paths[done + i];
+			sqe->len = STATX_BASIC_STATS;
+			sqe->statx_flags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+			sqe->off = (unsigned long)&uring->statx_bufs[i];
+			sqe->user_data = i;
+		}
+		if(run_batch(uring, n) < 0)
+			break;
+
+		for(int i = 0; i < n; i++) {
+			results[done + i] = uring->res[i] < 0 ? -1 : 0;
+			if(uring->res[i] >= 0)
+				from_statx(&st_info[done + i], &uring->statx_bufs[i]);
+			//a link to nothing is stat'ed as a link even when following
+			else if(follow)
+				results[done + i] = lstat(paths[done + i], &st_info[done + i]);
+		}
+		done += n;
+	}
+
+	//without a ring the paths are stat'ed one at a time
+	for(; done < count; done++)
+		results[done] = follow && stat(paths[done], &st_info[done]) == 0 ? 0 : lstat(paths[done], &st_info[done]);
+}
+
+int uring_copy(struct uring *uring, struct uring_copy *copies, int count) {
+	if(uring == 0 || uring->broken || count > URING_SLOTS)
+		return -1;
+
+	//every copy gets its own buffer and pair of file slots, and its
+	//chain stops at the first operation that fails or comes up short
+	for(int i = 0; i < count; i++) {
+		char *buf = uring->buffers + i * URING_BUF_SIZE;
+		copies[i].data = buf;
+		copies[i].result = -1;
+
+		struct io_uring_sqe *sqe = next_sqe(uring);
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long)copies[i].src;
+		sqe->len = STATX_BASIC_STATS;
+		sqe->off = (unsigned long)&uring->statx_bufs[i];
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = i * STEP_COUNT + STEP_STAT;
+
+		sqe = next_sqe(uring);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long)copies[i].src;
+		sqe->open_flags = O_RDONLY;
+		sqe->file_index = i * 2 + 1;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = i * STEP_COUNT + STEP_OPEN_SRC;
+
+		sqe = next_sqe(uring);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long)copies[i].dest;
+		sqe->len = copies[i].mode & 07777;
+		sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+		sqe->file_index = i * 2 + 2;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = i * STEP_COUNT + STEP_OPEN_DEST;
+
+		sqe = next_sqe(uring);
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->fd = i * 2;
+		sqe->addr = (unsigned long)buf;
+		sqe->len = copies[i].size;
+		sqe->buf_index = i;
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+		sqe->user_data = i * STEP_COUNT + STEP_READ;
+
+		sqe = next_sqe(uring);
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->fd = i * 2 + 1;
+		sqe->addr = (unsigned long)buf;
+		sqe->len = copies[i].size;
+		sqe->buf_index = i;
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+		sqe->user_data = i * STEP_COUNT + STEP_WRITE;
+
+		//the destination is closed even if closing the source fails
+		sqe = next_sqe(uring);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->file_index = i * 2 + 1;
+		sqe->flags = IOSQE_IO_HARDLINK;
+		sqe->user_data = i * STEP_COUNT + STEP_CLOSE_SRC;
+
+		sqe = next_sqe(uring);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->file_index = i * 2 + 2;
+		sqe->user_data = i * STEP_COUNT + STEP_CLOSE_DEST;
+	}
+	if(run_batch(uring, count * STEP_COUNT) < 0)
+		return -1;
+
+	int broken = 0;
+	for(int i = 0; i < count; i++) {
+		int *res = uring->res + i * STEP_COUNT;
+		if(res[STEP_STAT] < 0 || res[STEP_OPEN_SRC] < 0 || res[STEP_OPEN_DEST] < 0 || res[STEP_CLOSE_DEST] < 0 ||
+			res[STEP_READ] != copies[i].size || res[STEP_WRITE] != copies[i].size) {
+			broken = 1;
+			continue;
+		}
+
+		//the source changed size after it was queued
+		from_statx(&copies[i].st_info, &uring->statx_bufs[i]);
+		if(copies[i].st_info.st_size != copies[i].size)
+			continue;
+		copies[i].result = 0;
+	}
+
+	//chains that stopped part way leave files open in their slots
+	if(broken) {
+		int slots[URING_SLOTS * 2];
+		for(int i = 0; i < URING_SLOTS * 2; i++)
+			slots[i] = -1;
+		struct io_uring_files_update update = { .offset = 0, .fds = (unsigned long)slots };
+		syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_FILES_UPDATE, &update, URING_SLOTS * 2);
+	}
+	return 0;
+}
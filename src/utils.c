@@ -1,3 +1,5 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <dirent.h>
@@ -5,6 +7,7 @@
 #include <fcntl.h>
 
 #include "utils.h"
+#include "throttle.h"
 
 void join(char *dest, char *src1, char *src2, size_t maxlen) {
 	char *first = dest;
@@ -63,6 +66,17 @@ void filename(char *result, char *path, size_t maxlen) {
 		*dest++ = *src;
 }
 
+void parent_dir(char *result, char *path, size_t maxlen) {
+	snprintf(result, maxlen, "%s", path);
+	char *slash = strrchr(result, '/');
+
+	//the root keeps its slash
+	if(slash == 0)
+		snprintf(result, maxlen, ".");
+	else
+		slash[slash == result ? 1 : 0] = 0;
+}
+
 void relative(char *result, char *path, char *parent, size_t maxlen) {
 	//index of the last character that matches in path and parent
 	size_t i, j;
@@ -79,12 +93,14 @@ void relative(char *result, char *path, char *parent, size_t maxlen) {
 		*dest++ = *src;
 }
 
-int copy(int w_fd, int r_fd, int bufsize) {
+int copy(int w_fd, int r_fd, int bufsize, struct throttle *throttle) {
 	char buf[bufsize];
 	memset(buf, 0, bufsize);
 
 	ssize_t chunk;
 	while((chunk = read(r_fd, buf, bufsize)) > 0) {
+		//wait for enough bandwidth before writing the chunk
+		take_bytes(throttle, chunk);
 		if(write(w_fd, buf, chunk) != chunk)
 			return -1;
 	}
@@ -93,24 +109,37 @@ int copy(int w_fd, int r_fd, int bufsize) {
 }
 
 int rm(char *path) {
-	int fd, st_res;
 	struct stat st_info;
 
-	if((fd = open(path, O_RDONLY)) < 0)
+	//links are removed, not followed
+	if(lstat(path, &st_info) < 0)
 		return -1;
-	
-	if((st_res = fstat(fd, &st_info)) < 0) {
-		close(fd);
+
+	if(!S_ISDIR(st_info.st_mode))
+		return unlink(path);
+
+	//empty the directory before removing it
+	DIR *dp;
+	struct dirent *ep;
+	int result = 0;
+
+	if((dp = opendir(path)) == 0)
 		return -1;
+	while((ep = readdir(dp)) != 0) {
+		if(strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+			continue;
+
+		char buf[4096];
+		memset(buf, 0, 4096);
+		join(buf, path, ep->d_name, 4095);
+		if(rm(buf) < 0)
+			result = -1;
 	}
+	closedir(dp);
 
-	//no longer needed
-	close(fd);
-	
-	if(S_ISDIR(st_info.st_mode)) 
-		return rmdir(path);
-
-	return unlink(path);
+	if(result < 0)
+		return -1;
+	return rmdir(path);
 }
 
 int ascending(char *a, char *b) {
@@ -153,4 +182,48 @@ int descending(char *a, char *b) {
 	if(*ptr1 > *ptr2)
 		return -1;
 	return 1;
-}
\ No newline at end of file
+}
+
+int in_walk(struct walk *walk, dev_t dev, ino_t ino) {
+	for(size_t i = 0; i < walk->depth; i++) {
+		if(walk->devs[i] == dev && walk->inos[i] == ino)
+			return 1;
+	}
+	return 0;
+}
+
+int enter_dir(struct walk *walk, dev_t dev, ino_t ino) {
+	if(in_walk(walk, dev, ino))
+		return 1;
+
+	if(walk->depth == walk->capacity) {
+		size_t capacity = walk->capacity == 0 ? 64 : walk->capacity * 2;
+		dev_t *devs = (dev_t *)realloc(walk->devs, capacity * sizeof(dev_t));
+		if(devs == 0)
+			return -1;
+		walk->devs = devs;
+		ino_t *inos = (ino_t *)realloc(walk->inos, capacity * sizeof(ino_t));
+		if(inos == 0)
+			return -1;
+		walk->inos = inos;
+		walk->capacity = capacity;
+	}
+	walk->devs[walk->depth] = dev;
+	walk->inos[walk->depth++] = ino;
+	return 0;
+}
+
+void leave_dir(struct walk *walk) {
+	if(walk->depth > 0)
+		walk->depth--;
+}
+
+void free_walk(struct walk *walk) {
+	if(walk->devs != 0)
+		free(walk->devs);
+	if(walk->inos != 0)
+		free(walk->inos);
+	walk->devs = 0;
+	walk->inos = 0;
+	walk->depth = walk->capacity = 0;
+}